@@ -0,0 +1,174 @@
+#include "csp_convert.h"
+
+#include <cstring>
+
+#include <emmintrin.h>
+
+#include "common/hardware_env.h"
+
+namespace
+{
+void interleaveRowC(const uint8* u, const uint8* v, uint8* dest, int begin,
+                    int width)
+{
+    for (int x = begin; x < width; ++x)
+    {
+        dest[x * 2] = u[x];
+        dest[x * 2 + 1] = v[x];
+    }
+}
+
+void widenRowC(const uint8* source, uint16* dest, int begin, int width)
+{
+    for (int x = begin; x < width; ++x)
+        dest[x] = static_cast<uint16>(source[x] << 8);
+}
+
+void widenInterleaveRowC(const uint8* u, const uint8* v, uint16* dest,
+                         int begin, int width)
+{
+    for (int x = begin; x < width; ++x)
+    {
+        dest[x * 2] = static_cast<uint16>(u[x] << 8);
+        dest[x * 2 + 1] = static_cast<uint16>(v[x] << 8);
+    }
+}
+
+void interleaveRowSSE2(const uint8* u, const uint8* v, uint8* dest,
+                       int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        const __m128i a =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + x));
+        const __m128i b =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + x));
+        __m128i* to = reinterpret_cast<__m128i*>(dest + x * 2);
+        _mm_storeu_si128(to, _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128(to + 1, _mm_unpackhi_epi8(a, b));
+    }
+
+    interleaveRowC(u, v, dest, x, width);
+}
+
+// Unpacking zero as the low byte shifts each sample into the high byte.
+void widenRowSSE2(const uint8* source, uint16* dest, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        const __m128i a =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+        __m128i* to = reinterpret_cast<__m128i*>(dest + x);
+        _mm_storeu_si128(to, _mm_unpacklo_epi8(zero, a));
+        _mm_storeu_si128(to + 1, _mm_unpackhi_epi8(zero, a));
+    }
+
+    widenRowC(source, dest, x, width);
+}
+
+void widenInterleaveRowSSE2(const uint8* u, const uint8* v, uint16* dest,
+                            int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        const __m128i uv = _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(u + x)),
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(v + x)));
+        __m128i* to = reinterpret_cast<__m128i*>(dest + x * 2);
+        _mm_storeu_si128(to, _mm_unpacklo_epi8(zero, uv));
+        _mm_storeu_si128(to + 1, _mm_unpackhi_epi8(zero, uv));
+    }
+
+    widenInterleaveRowC(u, v, dest, x, width);
+}
+
+void copyLuma(const uint8* source, int sourceStride, uint8* dest,
+              int destStride, int width, int height)
+{
+    for (int y = 0; y < height; ++y)
+        memcpy(dest + y * destStride, source + y * sourceStride, width);
+}
+}
+
+namespace csp_convert
+{
+void YUV420PToNV12C(const uint8* const src[3], const int srcStride[3],
+                    uint8* const dst[2], int dstStride, int width,
+                    int height)
+{
+    copyLuma(src[0], srcStride[0], dst[0], dstStride, width, height);
+
+    uint8* chroma = dst[1];
+    for (int y = 0; y < (height + 1) / 2; ++y)
+        interleaveRowC(src[1] + y * srcStride[1], src[2] + y * srcStride[2],
+                       chroma + y * dstStride, 0, (width + 1) / 2);
+}
+
+void YUV420PToNV12SSE2(const uint8* const src[3], const int srcStride[3],
+                       uint8* const dst[2], int dstStride, int width,
+                       int height)
+{
+    copyLuma(src[0], srcStride[0], dst[0], dstStride, width, height);
+
+    uint8* chroma = dst[1];
+    for (int y = 0; y < (height + 1) / 2; ++y)
+        interleaveRowSSE2(src[1] + y * srcStride[1],
+                          src[2] + y * srcStride[2], chroma + y * dstStride,
+                          (width + 1) / 2);
+}
+
+void YUV420PToP010C(const uint8* const src[3], const int srcStride[3],
+                    uint8* const dst[2], int dstStride, int width,
+                    int height)
+{
+    for (int y = 0; y < height; ++y)
+        widenRowC(src[0] + y * srcStride[0],
+                  reinterpret_cast<uint16*>(dst[0] + y * dstStride), 0, width);
+
+    uint8* chroma = dst[1];
+    for (int y = 0; y < (height + 1) / 2; ++y)
+        widenInterleaveRowC(
+            src[1] + y * srcStride[1], src[2] + y * srcStride[2],
+            reinterpret_cast<uint16*>(chroma + y * dstStride), 0,
+            (width + 1) / 2);
+}
+
+void YUV420PToP010SSE2(const uint8* const src[3], const int srcStride[3],
+                       uint8* const dst[2], int dstStride, int width,
+                       int height)
+{
+    for (int y = 0; y < height; ++y)
+        widenRowSSE2(src[0] + y * srcStride[0],
+                     reinterpret_cast<uint16*>(dst[0] + y * dstStride), width);
+
+    uint8* chroma = dst[1];
+    for (int y = 0; y < (height + 1) / 2; ++y)
+        widenInterleaveRowSSE2(
+            src[1] + y * srcStride[1], src[2] + y * srcStride[2],
+            reinterpret_cast<uint16*>(chroma + y * dstStride),
+            (width + 1) / 2);
+}
+
+ConvertFunc GetYUV420PToNV12()
+{
+    if (CHardwareEnv::get()->GetProcessorFeatures() &
+        CHardwareEnv::PROCESSOR_FEATURE_SSE2)
+        return YUV420PToNV12SSE2;
+
+    return YUV420PToNV12C;
+}
+
+ConvertFunc GetYUV420PToP010()
+{
+    if (CHardwareEnv::get()->GetProcessorFeatures() &
+        CHardwareEnv::PROCESSOR_FEATURE_SSE2)
+        return YUV420PToP010SSE2;
+
+    return YUV420PToP010C;
+}
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef _CSP_CONVERT_H_
+#define _CSP_CONVERT_H_
+
+#include <guiddef.h>
+
+#include "chromium/base/basictypes.h"
+
+// Only defined where <initguid.h> comes first.
+DEFINE_GUID(MEDIASUBTYPE_P010,
+            0x30313050, 0x0000, 0x0010, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38,
+            0x9B, 0x71);
+
+// Repacks decoded planar 4:2:0 pictures into the semi-planar layouts
+// renderers prefer, without going through swscale.
+namespace csp_convert
+{
+// |src| holds the Y, Cb and Cr planes, |dst| the luma and the interleaved
+// chroma plane, which share |dstStride|.
+typedef void (*ConvertFunc)(const uint8* const src[3], const int srcStride[3],
+                            uint8* const dst[2], int dstStride, int width,
+                            int height);
+
+void YUV420PToNV12C(const uint8* const src[3], const int srcStride[3],
+                    uint8* const dst[2], int dstStride, int width,
+                    int height);
+void YUV420PToNV12SSE2(const uint8* const src[3], const int srcStride[3],
+                       uint8* const dst[2], int dstStride, int width,
+                       int height);
+
+// 16 bits per sample, the 8-bit value in the most significant byte. The
+// stride is in bytes.
+void YUV420PToP010C(const uint8* const src[3], const int srcStride[3],
+                    uint8* const dst[2], int dstStride, int width,
+                    int height);
+void YUV420PToP010SSE2(const uint8* const src[3], const int srcStride[3],
+                       uint8* const dst[2], int dstStride, int width,
+                       int height);
+
+// The fastest versions the processor supports.
+ConvertFunc GetYUV420PToNV12();
+ConvertFunc GetYUV420PToP010();
+}
+
+#endif  // _CSP_CONVERT_H_
\ No newline at end of file
@@ -0,0 +1,323 @@
+#include "decode_pipeline.h"
+
+#include <cassert>
+
+CDecodePipeline::TItem::TItem()
+    : Type(ITEM_NONE)
+    , Sample()
+    , Props()
+    , Start(0)
+    , Stop(0)
+    , Rate(1.0)
+    , Generation(0)
+{
+}
+
+CDecodePipeline::CThread::CThread(CDecodePipeline* owner,
+                                  void (CDecodePipeline::*main)())
+    : m_owner(owner)
+    , m_main(main)
+    , m_handle()
+    , m_started(false)
+{
+}
+
+bool CDecodePipeline::CThread::Start()
+{
+    assert(!m_started);
+    m_started = PlatformThread::Create(0, this, &m_handle);
+    return m_started;
+}
+
+void CDecodePipeline::CThread::Join()
+{
+    if (!m_started)
+        return;
+
+    PlatformThread::Join(m_handle);
+    m_started = false;
+}
+
+void CDecodePipeline::CThread::ThreadMain()
+{
+    (m_owner->*m_main)();
+}
+
+//------------------------------------------------------------------------------
+CDecodePipeline::CDecodePipeline(CDelegate* delegate, int inputDepth,
+                                 int outputDepth)
+    : m_delegate(delegate)
+    , m_input(inputDepth)
+    , m_output(outputDepth)
+    , m_decodeThread(this, &CDecodePipeline::decodeMain)
+    , m_deliverThread(this, &CDecodePipeline::deliverMain)
+    , m_generation(0)
+    , m_flushing(0)
+    , m_stopping(0)
+    , m_error(S_OK)
+    , m_decodeBusy(0)
+    , m_deliverBusy(0)
+    , m_itemDone(false, false)
+    , m_decoderGeneration(0)
+{
+    assert(delegate);
+}
+
+CDecodePipeline::~CDecodePipeline()
+{
+    Stop();
+}
+
+bool CDecodePipeline::Start()
+{
+    m_flushing = 0;
+    m_stopping = 0;
+    m_error = S_OK;
+    m_decoderGeneration = m_generation;
+    if (!m_decodeThread.Start())
+        return false;
+
+    if (!m_deliverThread.Start())
+    {
+        Stop();
+        return false;
+    }
+
+    return true;
+}
+
+void CDecodePipeline::Abort()
+{
+    InterlockedExchange(&m_stopping, 1);
+    m_input.Wake();
+    m_output.Wake();
+    m_itemDone.Signal();
+}
+
+void CDecodePipeline::Stop()
+{
+    Abort();
+    m_decodeThread.Join();
+    m_deliverThread.Join();
+
+    // Nothing else touches the queues any more.
+    TItem item;
+    while (m_input.TryPop(&item))
+        ;
+
+    while (m_output.TryPop(&item))
+        ;
+}
+
+HRESULT CDecodePipeline::QueueSample(IMediaSample* sample,
+                                     const AM_SAMPLE2_PROPERTIES& props)
+{
+    assert(sample);
+    if (FAILED(m_error))
+        return m_error;
+
+    TItem item;
+    item.Type = ITEM_SAMPLE;
+    item.Sample = sample;
+    item.Props = props;
+    item.Generation = m_generation;
+    return push(&m_input, item);
+}
+
+HRESULT CDecodePipeline::QueueNewSegment(REFERENCE_TIME start,
+                                         REFERENCE_TIME stop, double rate)
+{
+    TItem item;
+    item.Type = ITEM_NEW_SEGMENT;
+    item.Start = start;
+    item.Stop = stop;
+    item.Rate = rate;
+    item.Generation = m_generation;
+    return push(&m_input, item);
+}
+
+HRESULT CDecodePipeline::QueueEndOfStream()
+{
+    TItem item;
+    item.Type = ITEM_END_OF_STREAM;
+    item.Generation = m_generation;
+    return push(&m_input, item);
+}
+
+HRESULT CDecodePipeline::QueueOutput(IMediaSample* sample)
+{
+    assert(sample);
+    TItem item;
+    item.Type = ITEM_SAMPLE;
+    item.Sample = sample;
+    item.Generation = m_decoderGeneration;
+    return push(&m_output, item);
+}
+
+void CDecodePipeline::BeginFlush()
+{
+    // Invalidate everything queued so far, then kick the producers out of
+    // their waits.
+    InterlockedIncrement(&m_generation);
+    InterlockedExchange(&m_flushing, 1);
+    m_input.Wake();
+    m_output.Wake();
+}
+
+void CDecodePipeline::EndFlush()
+{
+    // A thread that took an item before BeginFlush() may still be handing it
+    // on; the flushing downstream pin turns it down quickly.
+    while (!m_stopping &&
+           (InterlockedCompareExchange(&m_decodeBusy, 0, 0) ||
+            InterlockedCompareExchange(&m_deliverBusy, 0, 0)))
+        m_itemDone.Wait();
+
+    InterlockedExchange(&m_error, S_OK);
+    InterlockedExchange(&m_flushing, 0);
+}
+
+HRESULT CDecodePipeline::push(CBoundedQueue<TItem>* queue, const TItem& item)
+{
+    for (;;)
+    {
+        if (m_stopping)
+            return VFW_E_WRONG_STATE;
+
+        // Matches the S_FALSE a flushing input pin answers with.
+        if (m_flushing || isStale(item))
+            return S_FALSE;
+
+        if (queue->TryPush(item))
+            return S_OK;
+
+        queue->WaitForSpace();
+    }
+}
+
+bool CDecodePipeline::pop(CBoundedQueue<TItem>* queue, TItem* item)
+{
+    for (;;)
+    {
+        if (m_stopping)
+            return false;
+
+        if (queue->TryPop(item))
+            return true;
+
+        queue->WaitForItem();
+    }
+}
+
+bool CDecodePipeline::isStale(const TItem& item) const
+{
+    return item.Generation != m_generation;
+}
+
+bool CDecodePipeline::beginItem(volatile LONG* busy, const TItem& item)
+{
+    InterlockedExchange(busy, 1);
+    if (!isStale(item))
+        return true;
+
+    endItem(busy);
+    return false;
+}
+
+void CDecodePipeline::endItem(volatile LONG* busy)
+{
+    InterlockedExchange(busy, 0);
+    m_itemDone.Signal();
+}
+
+void CDecodePipeline::setError(HRESULT r)
+{
+    if (FAILED(r))
+        InterlockedCompareExchange(&m_error, r, S_OK);
+}
+
+void CDecodePipeline::decodeMain()
+{
+    TItem item;
+    while (pop(&m_input, &item))
+    {
+        if (!beginItem(&m_decodeBusy, item))
+        {
+            item = TItem();
+            continue;
+        }
+
+        // First item after a flush: the decoder still holds references to
+        // the discarded pictures.
+        if (item.Generation != m_decoderGeneration)
+        {
+            m_delegate->FlushQueuedDecoder();
+            m_decoderGeneration = item.Generation;
+        }
+
+        HRESULT r = S_OK;
+        switch (item.Type)
+        {
+        case ITEM_SAMPLE:
+            // After a failure keep draining, so that the upstream thread
+            // sees the error instead of blocking on a full queue.
+            if (SUCCEEDED(m_error))
+                r = m_delegate->DecodeQueuedSample(item.Sample.get(),
+                                                   item.Props);
+            break;
+        case ITEM_NEW_SEGMENT:
+            m_delegate->FlushQueuedDecoder();
+            r = push(&m_output, item);
+            break;
+        case ITEM_END_OF_STREAM:
+            r = push(&m_output, item);
+            break;
+        default:
+            assert(false);
+            break;
+        }
+
+        setError(r);
+
+        // Hand the input buffer back to the upstream allocator now rather
+        // than at the next pop.
+        item = TItem();
+        endItem(&m_decodeBusy);
+    }
+}
+
+void CDecodePipeline::deliverMain()
+{
+    TItem item;
+    while (pop(&m_output, &item))
+    {
+        if (!beginItem(&m_deliverBusy, item))
+        {
+            item = TItem();
+            continue;
+        }
+
+        HRESULT r = S_OK;
+        switch (item.Type)
+        {
+        case ITEM_SAMPLE:
+            if (SUCCEEDED(m_error))
+                r = m_delegate->DeliverQueuedSample(item.Sample.get());
+            break;
+        case ITEM_NEW_SEGMENT:
+            r = m_delegate->DeliverQueuedNewSegment(item.Start, item.Stop,
+                                                    item.Rate);
+            break;
+        case ITEM_END_OF_STREAM:
+            r = m_delegate->DeliverQueuedEndOfStream();
+            break;
+        default:
+            assert(false);
+            break;
+        }
+
+        setError(r);
+        item = TItem();
+        endItem(&m_deliverBusy);
+    }
+}
\ No newline at end of file
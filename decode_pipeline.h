@@ -0,0 +1,223 @@
+#ifndef _DECODE_PIPELINE_H_
+#define _DECODE_PIPELINE_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/intrusive_ptr.hpp>
+#include <streams.h>
+
+#include "chromium/base/basictypes.h"
+#include "chromium/base/platform_thread.h"
+#include "chromium/base/waitable_event.h"
+#include "common/intrusive_ptr_helper.h"
+
+// Fixed capacity ring for exactly one producer and one consumer thread. The
+// indices are published with interlocked writes, so neither side ever takes a
+// lock; the events only exist to park a side that has nothing to do.
+template <typename T>
+class CBoundedQueue
+{
+public:
+    explicit CBoundedQueue(int capacity)
+        : m_items(std::max(capacity, 1) + 1)
+        , m_head(0)
+        , m_tail(0)
+        , m_itemAvailable(false, false)
+        , m_spaceAvailable(false, false)
+    {
+    }
+
+    // Producer side.
+    bool TryPush(const T& item)
+    {
+        const LONG tail = m_tail;
+        const LONG next = (tail + 1) % static_cast<LONG>(m_items.size());
+        if (next == InterlockedCompareExchange(&m_head, 0, 0))
+            return false;
+
+        m_items[tail] = item;
+        InterlockedExchange(&m_tail, next);
+        m_itemAvailable.Signal();
+        return true;
+    }
+
+    // Consumer side.
+    bool TryPop(T* item)
+    {
+        const LONG head = m_head;
+        if (head == InterlockedCompareExchange(&m_tail, 0, 0))
+            return false;
+
+        *item = m_items[head];
+        m_items[head] = T();
+        InterlockedExchange(&m_head,
+                            (head + 1) % static_cast<LONG>(m_items.size()));
+        m_spaceAvailable.Signal();
+        return true;
+    }
+
+    int GetCount() const
+    {
+        const int size = static_cast<int>(m_items.size());
+        return (m_tail - m_head + size) % size;
+    }
+
+    void WaitForItem() { m_itemAvailable.Wait(); }
+    void WaitForSpace() { m_spaceAvailable.Wait(); }
+
+    // Wakes both sides so that they re-check their exit conditions.
+    void Wake()
+    {
+        m_itemAvailable.Signal();
+        m_spaceAvailable.Signal();
+    }
+
+private:
+    std::vector<T> m_items;
+    volatile LONG m_head;
+    volatile LONG m_tail;
+    WaitableEvent m_itemAvailable;
+    WaitableEvent m_spaceAvailable;
+
+    DISALLOW_COPY_AND_ASSIGN(CBoundedQueue);
+};
+
+//------------------------------------------------------------------------------
+// Moves decoding off the upstream streaming thread and delivery off the decode
+// thread. Receive only queues the input sample; a decode thread runs the
+// decoder and queues the output samples, which a delivery thread hands
+// downstream. Both queues are bounded: a full input queue blocks the upstream
+// thread in Receive, and a full output queue holds the decoder in
+// GetDeliveryBuffer, which is the back-pressure DirectShow expects.
+//
+// New segments and end of stream travel through the queues, so they reach the
+// decoder and the downstream pin in stream order. A flush bumps a generation
+// counter; anything queued under an older generation is dropped, and the
+// decoder is reset on its own thread before the first newer sample. The end
+// of a flush waits until neither thread is still working on an item taken
+// before it, so that nothing from before the flush reaches the downstream
+// pin after it.
+class CDecodePipeline
+{
+public:
+    class CDelegate
+    {
+    public:
+        // Decode thread.
+        virtual HRESULT DecodeQueuedSample(
+            IMediaSample* sample, const AM_SAMPLE2_PROPERTIES& props) = 0;
+        virtual void FlushQueuedDecoder() = 0;
+
+        // Delivery thread.
+        virtual HRESULT DeliverQueuedSample(IMediaSample* sample) = 0;
+        virtual HRESULT DeliverQueuedNewSegment(REFERENCE_TIME start,
+                                                REFERENCE_TIME stop,
+                                                double rate) = 0;
+        virtual HRESULT DeliverQueuedEndOfStream() = 0;
+
+    protected:
+        virtual ~CDelegate() {}
+    };
+
+    CDecodePipeline(CDelegate* delegate, int inputDepth, int outputDepth);
+    ~CDecodePipeline();
+
+    bool Start();
+
+    // Makes every blocked or future queue operation fail, so that the
+    // threads wind down. Safe to call from any thread.
+    void Abort();
+
+    // Joins the threads and drops whatever is still queued.
+    void Stop();
+
+    // Upstream streaming thread.
+    HRESULT QueueSample(IMediaSample* sample,
+                        const AM_SAMPLE2_PROPERTIES& props);
+    HRESULT QueueNewSegment(REFERENCE_TIME start, REFERENCE_TIME stop,
+                            double rate);
+    HRESULT QueueEndOfStream();
+
+    // Decode thread, from CDelegate::DecodeQueuedSample().
+    HRESULT QueueOutput(IMediaSample* sample);
+
+    // Application thread. EndFlush() returns once both threads are done
+    // with what they took off the queues before BeginFlush().
+    void BeginFlush();
+    void EndFlush();
+
+    int GetInputCount() const { return m_input.GetCount(); }
+    int GetOutputCount() const { return m_output.GetCount(); }
+
+private:
+    enum KItemType
+    {
+        ITEM_NONE = 0,
+        ITEM_SAMPLE = 1,
+        ITEM_NEW_SEGMENT = 2,
+        ITEM_END_OF_STREAM = 3
+    };
+
+    struct TItem
+    {
+        TItem();
+
+        KItemType Type;
+        boost::intrusive_ptr<IMediaSample> Sample;
+        AM_SAMPLE2_PROPERTIES Props;
+        REFERENCE_TIME Start;
+        REFERENCE_TIME Stop;
+        double Rate;
+        LONG Generation;
+    };
+
+    class CThread : public PlatformThread::Delegate
+    {
+    public:
+        CThread(CDecodePipeline* owner, void (CDecodePipeline::*main)());
+
+        bool Start();
+        void Join();
+        virtual void ThreadMain();
+
+    private:
+        CDecodePipeline* m_owner;
+        void (CDecodePipeline::*m_main)();
+        PlatformThreadHandle m_handle;
+        bool m_started;
+    };
+
+    HRESULT push(CBoundedQueue<TItem>* queue, const TItem& item);
+    bool pop(CBoundedQueue<TItem>* queue, TItem* item);
+    bool isStale(const TItem& item) const;
+
+    // Mark a thread busy while it works on |item|. The flag is raised before
+    // the generation is checked, so a flush either sees the thread busy or
+    // the thread sees the flush. False, with the flag lowered again, for a
+    // stale item.
+    bool beginItem(volatile LONG* busy, const TItem& item);
+    void endItem(volatile LONG* busy);
+
+    void setError(HRESULT r);
+    void decodeMain();
+    void deliverMain();
+
+    CDelegate* m_delegate;
+    CBoundedQueue<TItem> m_input;
+    CBoundedQueue<TItem> m_output;
+    CThread m_decodeThread;
+    CThread m_deliverThread;
+    volatile LONG m_generation;
+    volatile LONG m_flushing;
+    volatile LONG m_stopping;
+    volatile LONG m_error;
+    volatile LONG m_decodeBusy;
+    volatile LONG m_deliverBusy;
+    WaitableEvent m_itemDone;
+    LONG m_decoderGeneration;
+
+    DISALLOW_COPY_AND_ASSIGN(CDecodePipeline);
+};
+
+#endif  // _DECODE_PIPELINE_H_
\ No newline at end of file
@@ -0,0 +1,181 @@
+#include "decoder_stats.h"
+
+#include <cassert>
+
+namespace
+{
+const int64 firstBucketLimit = 16; // In us
+
+int64 getTicks()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+int64 readCounter(const volatile LONGLONG* counter)
+{
+    // A plain read may tear on 32 bit builds.
+    return InterlockedCompareExchange64(const_cast<volatile LONGLONG*>(counter),
+                                        0, 0);
+}
+
+void raiseTo(volatile LONGLONG* counter, int64 value)
+{
+    LONGLONG current = readCounter(counter);
+    while (value > current)
+    {
+        const LONGLONG previous =
+            InterlockedCompareExchange64(counter, value, current);
+        if (previous == current)
+            break;
+
+        current = previous;
+    }
+}
+
+void raiseTo(volatile LONG* counter, LONG value)
+{
+    LONG current = *counter;
+    while (value > current)
+    {
+        const LONG previous =
+            InterlockedCompareExchange(counter, value, current);
+        if (previous == current)
+            break;
+
+        current = previous;
+    }
+}
+
+int getBucket(int64 time)
+{
+    int bucket = 0;
+    for (int64 limit = firstBucketLimit;
+         (time >= limit) && (bucket < H264_STAGE_HISTOGRAM_SIZE - 1);
+         limit <<= 1)
+        bucket++;
+
+    return bucket;
+}
+}
+
+CDecoderStats::CDecoderStats()
+    : m_frequency(0)
+    , m_decoded(0)
+    , m_dropped(0)
+    , m_skippedAfterFlush(0)
+    , m_beginFrameRetries(0)
+    , m_beginFrameFailures(0)
+    , m_surfaceCount(0)
+    , m_surfacesInUse(0)
+    , m_maxSurfacesInUse(0)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    m_frequency = frequency.QuadPart;
+    memset(const_cast<TStage*>(m_stages), 0, sizeof(m_stages));
+}
+
+CDecoderStats::~CDecoderStats()
+{
+}
+
+void CDecoderStats::AddDecoded()
+{
+    InterlockedIncrement64(&m_decoded);
+}
+
+void CDecoderStats::AddDropped()
+{
+    InterlockedIncrement64(&m_dropped);
+}
+
+void CDecoderStats::AddSkippedAfterFlush()
+{
+    InterlockedIncrement64(&m_skippedAfterFlush);
+}
+
+void CDecoderStats::AddBeginFrameWait(int retries, bool failed)
+{
+    if (retries)
+        InterlockedExchangeAdd64(&m_beginFrameRetries, retries);
+
+    if (failed)
+        InterlockedIncrement64(&m_beginFrameFailures);
+}
+
+void CDecoderStats::SetSurfaceOccupancy(int inUse, int count)
+{
+    InterlockedExchange(&m_surfaceCount, count);
+    InterlockedExchange(&m_surfacesInUse, inUse);
+    raiseTo(&m_maxSurfacesInUse, inUse);
+}
+
+void CDecoderStats::AddStageTime(KH264DecodeStage stage, int64 ticks)
+{
+    assert((stage >= 0) && (stage < H264_STAGE_COUNT));
+    TStage& s = m_stages[stage];
+    InterlockedIncrement64(&s.Count);
+    InterlockedExchangeAdd64(&s.TotalTime, ticks);
+    raiseTo(&s.MaxTime, ticks);
+
+    const int64 time = ticks * 1000000 / m_frequency;
+    InterlockedIncrement64(&s.Histogram[getBucket(time)]);
+}
+
+void CDecoderStats::Get(TH264DecoderStats* stats) const
+{
+    assert(stats);
+    stats->FramesDecoded = readCounter(&m_decoded);
+    stats->FramesDropped = readCounter(&m_dropped);
+    stats->FramesSkippedAfterFlush = readCounter(&m_skippedAfterFlush);
+    stats->BeginFrameRetries = readCounter(&m_beginFrameRetries);
+    stats->BeginFrameFailures = readCounter(&m_beginFrameFailures);
+    stats->SurfaceCount = m_surfaceCount;
+    stats->SurfacesInUse = m_surfacesInUse;
+    stats->MaxSurfacesInUse = m_maxSurfacesInUse;
+    for (int i = 0; i < H264_STAGE_COUNT; ++i)
+    {
+        const TStage& s = m_stages[i];
+        TH264StageTimes& times = stats->Stages[i];
+        times.Count = readCounter(&s.Count);
+        times.TotalTime = readCounter(&s.TotalTime) * 1000000 / m_frequency;
+        times.MaxTime = readCounter(&s.MaxTime) * 1000000 / m_frequency;
+        for (int j = 0; j < H264_STAGE_HISTOGRAM_SIZE; ++j)
+            times.Histogram[j] = readCounter(&s.Histogram[j]);
+    }
+}
+
+void CDecoderStats::Reset()
+{
+    InterlockedExchange64(&m_decoded, 0);
+    InterlockedExchange64(&m_dropped, 0);
+    InterlockedExchange64(&m_skippedAfterFlush, 0);
+    InterlockedExchange64(&m_beginFrameRetries, 0);
+    InterlockedExchange64(&m_beginFrameFailures, 0);
+    InterlockedExchange(&m_maxSurfacesInUse, m_surfacesInUse);
+    for (int i = 0; i < H264_STAGE_COUNT; ++i)
+    {
+        TStage& s = m_stages[i];
+        InterlockedExchange64(&s.Count, 0);
+        InterlockedExchange64(&s.TotalTime, 0);
+        InterlockedExchange64(&s.MaxTime, 0);
+        for (int j = 0; j < H264_STAGE_HISTOGRAM_SIZE; ++j)
+            InterlockedExchange64(&s.Histogram[j], 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+CStageTimer::CStageTimer(CDecoderStats* stats, KH264DecodeStage stage)
+    : m_stats(stats)
+    , m_stage(stage)
+    , m_begin(stats ? getTicks() : 0)
+{
+}
+
+CStageTimer::~CStageTimer()
+{
+    if (m_stats)
+        m_stats->AddStageTime(m_stage, getTicks() - m_begin);
+}
\ No newline at end of file
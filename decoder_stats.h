@@ -0,0 +1,119 @@
+#ifndef _DECODER_STATS_H_
+#define _DECODER_STATS_H_
+
+#include <windows.h>
+#include <unknwn.h>
+
+#include "chromium/base/basictypes.h"
+
+// The stages IH264DecoderStats times.
+enum KH264DecodeStage
+{
+    // libavcodec: parsing for the DXVA decoders, the whole decode for the
+    // software one.
+    H264_STAGE_PRE_DECODE = 0,
+    H264_STAGE_BITSTREAM_BUILD = 1,
+    H264_STAGE_EXECUTE = 2,
+    H264_STAGE_CONVERT = 3,     // Into the output sample
+    H264_STAGE_DELIVER = 4,
+    H264_STAGE_COUNT = 5
+};
+
+enum
+{
+    // Bucket 0 counts the stages that took less than 16 us, bucket n those
+    // that took from 16 << (n - 1) up to 16 << n us. The last one also takes
+    // everything longer.
+    H264_STAGE_HISTOGRAM_SIZE = 16
+};
+
+struct TH264StageTimes
+{
+    int64 Count;
+    int64 TotalTime;    // In us
+    int64 MaxTime;      // In us
+    int64 Histogram[H264_STAGE_HISTOGRAM_SIZE];
+};
+
+struct TH264DecoderStats
+{
+    int64 FramesDecoded;
+    int64 FramesDropped;            // Failed, or shed under load
+    int64 FramesSkippedAfterFlush;  // Waiting for an I frame
+    int64 BeginFrameRetries;        // Yields and sleeps for a free surface
+    int64 BeginFrameFailures;
+    int SurfaceCount;               // 0 for software decoding
+    int SurfacesInUse;
+    int MaxSurfacesInUse;
+    TH264StageTimes Stages[H264_STAGE_COUNT];
+};
+
+// Exposed by the decoder filter. The counters cover the filter's lifetime, or
+// the time since the last ResetStats(), across reconnections.
+struct __declspec(uuid("3ef2666e-69ac-46b6-9a57-f423faaf17b4"))
+IH264DecoderStats : public IUnknown
+{
+    virtual HRESULT __stdcall GetStats(TH264DecoderStats* stats) = 0;
+    virtual HRESULT __stdcall ResetStats() = 0;
+};
+
+//------------------------------------------------------------------------------
+// The counters behind IH264DecoderStats. They are only ever updated with
+// interlocked operations, so the decoding, delivering and querying threads
+// never wait for each other.
+class CDecoderStats
+{
+public:
+    CDecoderStats();
+    ~CDecoderStats();
+
+    void AddDecoded();
+    void AddDropped();
+    void AddSkippedAfterFlush();
+    void AddBeginFrameWait(int retries, bool failed);
+    void SetSurfaceOccupancy(int inUse, int count);
+    void AddStageTime(KH264DecodeStage stage, int64 ticks);
+
+    // Not a snapshot; the counters may move while they are copied.
+    void Get(TH264DecoderStats* stats) const;
+    void Reset();
+
+private:
+    struct TStage
+    {
+        volatile LONGLONG Count;
+        volatile LONGLONG TotalTime;    // In performance counter ticks
+        volatile LONGLONG MaxTime;
+        volatile LONGLONG Histogram[H264_STAGE_HISTOGRAM_SIZE];
+    };
+
+    int64 m_frequency;
+    volatile LONGLONG m_decoded;
+    volatile LONGLONG m_dropped;
+    volatile LONGLONG m_skippedAfterFlush;
+    volatile LONGLONG m_beginFrameRetries;
+    volatile LONGLONG m_beginFrameFailures;
+    volatile LONG m_surfaceCount;
+    volatile LONG m_surfacesInUse;
+    volatile LONG m_maxSurfacesInUse;
+    TStage m_stages[H264_STAGE_COUNT];
+};
+
+//------------------------------------------------------------------------------
+// Adds the time until it goes out of scope to a stage. Does nothing without a
+// CDecoderStats.
+class CStageTimer
+{
+public:
+    CStageTimer(CDecoderStats* stats, KH264DecodeStage stage);
+    ~CStageTimer();
+
+private:
+    CDecoderStats* m_stats;
+    KH264DecodeStage m_stage;
+    int64 m_begin;
+
+    DISALLOW_COPY_AND_ASSIGN(CStageTimer);
+};
+
+#endif  // _DECODER_STATS_H_
\ No newline at end of file
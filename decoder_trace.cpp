@@ -0,0 +1,166 @@
+#include "decoder_trace.h"
+
+#include <cassert>
+
+namespace
+{
+// {2CC0E6A8-C256-474D-BB42-10ECD3157ABC}, as in h264_decoder_trace.man.
+const GUID providerID =
+{
+    0x2cc0e6a8, 0xc256, 0x474d,
+    { 0xbb, 0x42, 0x10, 0xec, 0xd3, 0x15, 0x7a, 0xbc }
+};
+
+// EVENT_DESCRIPTOR and EVENT_DATA_DESCRIPTOR of evntprov.h, which only
+// declares them for Vista and later targets.
+struct TEventDescriptor
+{
+    USHORT Id;
+    UCHAR Version;
+    UCHAR Channel;
+    UCHAR Level;
+    UCHAR Opcode;
+    USHORT Task;
+    ULONGLONG Keyword;
+};
+
+struct TEventDataDescriptor
+{
+    ULONGLONG Ptr;
+    ULONG Size;
+    ULONG Reserved;
+};
+
+typedef void (__stdcall* TEnableCallback)(const GUID*, ULONG, UCHAR,
+                                          ULONGLONG, ULONGLONG, void*, void*);
+typedef ULONG (__stdcall* TEventRegister)(const GUID*, TEnableCallback, void*,
+                                          uint64*);
+
+// win:Verbose, win:Start and win:Stop.
+const UCHAR levelVerbose = 5;
+const UCHAR opcodeStart = 1;
+const UCHAR opcodeStop = 2;
+const ULONGLONG keywordDecode = 1;
+
+// Event ids are 2 * task - 1 for the begin events and 2 * task for the end
+// events.
+TEventDescriptor buildDescriptor(KH264TraceTask task, bool begin)
+{
+    TEventDescriptor desc;
+    desc.Id = static_cast<USHORT>(task * 2 - (begin ? 1 : 0));
+    desc.Version = 0;
+    desc.Channel = 0;
+    desc.Level = levelVerbose;
+    desc.Opcode = begin ? opcodeStart : opcodeStop;
+    desc.Task = static_cast<USHORT>(task);
+    desc.Keyword = keywordDecode;
+    return desc;
+}
+
+void setDataDescriptor(const int* value, TEventDataDescriptor* dataDesc)
+{
+    dataDesc->Ptr = reinterpret_cast<ULONGLONG>(value);
+    dataDesc->Size = sizeof(*value);
+    dataDesc->Reserved = 0;
+}
+}
+
+CDecoderTrace::CDecoderTrace()
+    : m_advapi(LoadLibrary(L"advapi32.dll"))
+    , m_eventWrite(NULL)
+    , m_eventUnregister(NULL)
+    , m_handle(0)
+    , m_enabled(0)
+{
+    if (!m_advapi)
+        return;
+
+    TEventRegister eventRegister = reinterpret_cast<TEventRegister>(
+        GetProcAddress(m_advapi, "EventRegister"));
+    m_eventWrite = reinterpret_cast<TEventWrite>(
+        GetProcAddress(m_advapi, "EventWrite"));
+    m_eventUnregister = reinterpret_cast<TEventUnregister>(
+        GetProcAddress(m_advapi, "EventUnregister"));
+    if (!eventRegister || !m_eventWrite || !m_eventUnregister ||
+        (ERROR_SUCCESS != eventRegister(&providerID, enableCallback, this,
+                                        &m_handle)))
+    {
+        m_eventWrite = NULL;
+        m_handle = 0;
+    }
+}
+
+CDecoderTrace::~CDecoderTrace()
+{
+    if (m_handle)
+        m_eventUnregister(m_handle);
+
+    if (m_advapi)
+        FreeLibrary(m_advapi);
+}
+
+void CDecoderTrace::Write(KH264TraceTask task, bool begin,
+                          const TH264TraceData& data)
+{
+    if (!m_enabled || !m_eventWrite)
+        return;
+
+    const TEventDescriptor desc = buildDescriptor(task, begin);
+    TEventDataDescriptor dataDesc[4];
+    setDataDescriptor(&data.POC, &dataDesc[0]);
+    setDataDescriptor(&data.SliceCount, &dataDesc[1]);
+    setDataDescriptor(&data.Surface, &dataDesc[2]);
+    setDataDescriptor(&data.Size, &dataDesc[3]);
+    m_eventWrite(m_handle, &desc, arraysize(dataDesc), dataDesc);
+}
+
+void __stdcall CDecoderTrace::enableCallback(const GUID* sourceID,
+                                             ULONG isEnabled, UCHAR level,
+                                             ULONGLONG matchAny,
+                                             ULONGLONG matchAll,
+                                             void* filterData, void* context)
+{
+    assert(context);
+    CDecoderTrace* trace = reinterpret_cast<CDecoderTrace*>(context);
+
+    // 0 stops the last session; 2 asks for a state capture, which changes
+    // nothing here.
+    if (!isEnabled)
+    {
+        InterlockedExchange(&trace->m_enabled, 0);
+        return;
+    }
+
+    if (1 == isEnabled)
+    {
+        const bool wanted = (!level || (level >= levelVerbose)) &&
+            (!matchAny || (matchAny & keywordDecode));
+        InterlockedExchange(&trace->m_enabled, wanted ? 1 : 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+CTraceScope::CTraceScope(KH264TraceTask task, int POC, int sliceCount,
+                         int surface, int size)
+    : m_trace(CDecoderTrace::get())
+    , m_task(task)
+    , m_data()
+{
+    if (!m_trace->IsEnabled())
+    {
+        m_trace = NULL;
+        return;
+    }
+
+    m_data.POC = POC;
+    m_data.SliceCount = sliceCount;
+    m_data.Surface = surface;
+    m_data.Size = size;
+    m_trace->Write(m_task, true, m_data);
+}
+
+CTraceScope::~CTraceScope()
+{
+    if (m_trace)
+        m_trace->Write(m_task, false, m_data);
+}
\ No newline at end of file
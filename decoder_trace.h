@@ -0,0 +1,83 @@
+#ifndef _DECODER_TRACE_H_
+#define _DECODER_TRACE_H_
+
+#include <windows.h>
+
+#include "chromium/base/basictypes.h"
+#include "chromium/base/singleton.h"
+
+// The tasks of the ETW provider in h264_decoder_trace.man; each one has a
+// begin and an end event.
+enum KH264TraceTask
+{
+    H264_TRACE_PRE_DECODE = 1,
+    H264_TRACE_BITSTREAM_BUILD = 2,
+    H264_TRACE_EXECUTE = 3,
+    H264_TRACE_BEGIN_FRAME = 4,     // Waiting for a surface
+    H264_TRACE_CONVERT = 5,
+    H264_TRACE_DELIVER = 6
+};
+
+// What the events carry; -1 where a stage doesn't know.
+struct TH264TraceData
+{
+    int POC;
+    int SliceCount;
+    int Surface;
+    int Size;           // In bytes
+};
+
+// Writes the decode path to ETW, for lining it up with the GPU and the
+// renderer in WPA. The provider is registered the first time get() is
+// called, through entry points looked up in advapi32 so that the filter
+// still loads on XP. While no session listens, an event costs a test of a
+// flag.
+class CDecoderTrace : public Singleton<CDecoderTrace>
+{
+public:
+    CDecoderTrace();
+    ~CDecoderTrace();
+
+    bool IsEnabled() const { return !!m_enabled; }
+    void Write(KH264TraceTask task, bool begin, const TH264TraceData& data);
+
+private:
+    typedef ULONG (__stdcall* TEventWrite)(uint64, const void*, ULONG, void*);
+    typedef ULONG (__stdcall* TEventUnregister)(uint64);
+
+    static void __stdcall enableCallback(const GUID* sourceID, ULONG isEnabled,
+                                         UCHAR level, ULONGLONG matchAny,
+                                         ULONGLONG matchAll, void* filterData,
+                                         void* context);
+
+    HMODULE m_advapi;
+    TEventWrite m_eventWrite;
+    TEventUnregister m_eventUnregister;
+    uint64 m_handle;
+    volatile LONG m_enabled;
+
+    DISALLOW_COPY_AND_ASSIGN(CDecoderTrace);
+};
+
+//------------------------------------------------------------------------------
+// Writes the begin event of |task| and, when it goes out of scope, the end
+// event, with the same data unless it was changed in between.
+class CTraceScope
+{
+public:
+    CTraceScope(KH264TraceTask task, int POC, int sliceCount, int surface,
+                int size);
+    ~CTraceScope();
+
+    void SetPOC(int POC) { m_data.POC = POC; }
+    void SetSize(int size) { m_data.Size = size; }
+
+private:
+    CDecoderTrace* m_trace;     // NULL while tracing is off
+    KH264TraceTask m_task;
+    TH264TraceData m_data;
+
+    DISALLOW_COPY_AND_ASSIGN(CTraceScope);
+};
+
+#endif  // _DECODER_TRACE_H_
\ No newline at end of file
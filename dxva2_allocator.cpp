@@ -0,0 +1,137 @@
+#include "dxva2_allocator.h"
+
+#include <cassert>
+#include <vector>
+
+#include "h264_decoder.h"
+#include "common/intrusive_ptr_helper.h"
+
+using std::vector;
+using boost::shared_ptr;
+
+namespace
+{
+const wchar_t* sampleName = L"CDXVA2Sample";
+const wchar_t* allocatorName = L"CDXVA2Allocator";
+}
+
+CDXVA2Sample::CDXVA2Sample(CBaseAllocator* allocator, HRESULT* r)
+    : CMediaSample(sampleName, allocator, r, NULL, 0)
+    , m_surface()
+    , m_surfaceIndex(-1)
+{
+}
+
+CDXVA2Sample::~CDXVA2Sample()
+{
+}
+
+HRESULT CDXVA2Sample::QueryInterface(const IID& ID, void** o)
+{
+    if (!o)
+        return E_POINTER;
+
+    if (__uuidof(IMFGetService) == ID)
+    {
+        IMFGetService* i = this;
+        i->AddRef();
+        *o = i;
+        return S_OK;
+    }
+
+    return CMediaSample::QueryInterface(ID, o);
+}
+
+ULONG CDXVA2Sample::AddRef()
+{
+    return CMediaSample::AddRef();
+}
+
+ULONG CDXVA2Sample::Release()
+{
+    // Goes back to the allocator at zero instead of being deleted.
+    return CMediaSample::Release();
+}
+
+HRESULT CDXVA2Sample::GetService(const GUID& service, const IID& ID, void** o)
+{
+    if (!o)
+        return E_POINTER;
+
+    if (MR_BUFFER_SERVICE != service)
+        return MF_E_UNSUPPORTED_SERVICE;
+
+    if (!m_surface)
+        return E_NOINTERFACE;
+
+    return m_surface->QueryInterface(ID, o);
+}
+
+HRESULT CDXVA2Sample::GetPointer(BYTE** buffer)
+{
+    // The picture is only reachable through the surface.
+    return E_NOTIMPL;
+}
+
+void CDXVA2Sample::SetSurface(int index, IDirect3DSurface9* surface)
+{
+    m_surfaceIndex = index;
+    m_surface = surface;
+}
+
+//------------------------------------------------------------------------------
+CDXVA2Allocator::CDXVA2Allocator(const shared_ptr<CH264DXVA2Decoder>& decoder,
+                                 HRESULT* r)
+    : CBaseAllocator(allocatorName, NULL, r)
+    , m_decoder(decoder)
+{
+    assert(decoder);
+}
+
+CDXVA2Allocator::~CDXVA2Allocator()
+{
+    Decommit();
+}
+
+HRESULT CDXVA2Allocator::Alloc()
+{
+    CAutoLock lock(this);
+    HRESULT r = CBaseAllocator::Alloc();
+    if (FAILED(r))
+        return r;
+
+    // Free() gives the surfaces back on every decommit, so they are created
+    // again even when the properties haven't changed.
+    assert(!m_lAllocated);
+    vector<IDirect3DSurface9*> surfaces(m_lCount, NULL);
+    r = m_decoder->CreateSurfaces(this, m_lCount, &surfaces[0]);
+    if (FAILED(r))
+        return r;
+
+    for (int i = 0; i < m_lCount; ++i)
+    {
+        CDXVA2Sample* sample = new CDXVA2Sample(this, &r);
+        sample->SetSurface(i, surfaces[i]);
+
+        // The sample holds its own reference.
+        surfaces[i]->Release();
+        m_lFree.Add(sample);
+    }
+
+    m_lAllocated = m_lCount;
+    m_bChanged = FALSE;
+    return S_OK;
+}
+
+void CDXVA2Allocator::Free()
+{
+    CAutoLock lock(this);
+    assert(m_lAllocated == m_lFree.GetCount());
+
+    CMediaSample* sample;
+    while ((sample = m_lFree.RemoveHead()) != NULL)
+        delete sample;
+
+    m_lAllocated = 0;
+    m_decoder->ReleaseSurfaces();
+}
\ No newline at end of file
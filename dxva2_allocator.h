@@ -0,0 +1,60 @@
+#ifndef _DXVA2_ALLOCATOR_H_
+#define _DXVA2_ALLOCATOR_H_
+
+#include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <streams.h>
+#include <d3d9.h>
+#include <evr.h>
+
+#include "chromium/base/basictypes.h"
+
+// A sample without memory of its own. The picture lives in a Direct3D surface,
+// which the EVR fetches through IMFGetService.
+class CDXVA2Sample : public CMediaSample, public IMFGetService
+{
+public:
+    CDXVA2Sample(CBaseAllocator* allocator, HRESULT* r);
+    virtual ~CDXVA2Sample();
+
+    // IUnknown
+    virtual HRESULT __stdcall QueryInterface(const IID& ID, void** o);
+    virtual ULONG __stdcall AddRef();
+    virtual ULONG __stdcall Release();
+
+    // IMFGetService
+    virtual HRESULT __stdcall GetService(const GUID& service, const IID& ID,
+                                         void** o);
+
+    // IMediaSample
+    virtual HRESULT __stdcall GetPointer(BYTE** buffer);
+
+    int GetSurfaceIndex() const { return m_surfaceIndex; }
+    void SetSurface(int index, IDirect3DSurface9* surface);
+
+private:
+    boost::intrusive_ptr<IDirect3DSurface9> m_surface;
+    int m_surfaceIndex;
+};
+
+//------------------------------------------------------------------------------
+// Hands out the decoding surfaces of a CH264DXVA2Decoder as media samples.
+// The surfaces are created on commit and released once the last sample has
+// come back after a decommit.
+class CH264DXVA2Decoder;
+class CDXVA2Allocator : public CBaseAllocator
+{
+public:
+    CDXVA2Allocator(const boost::shared_ptr<CH264DXVA2Decoder>& decoder,
+                    HRESULT* r);
+    virtual ~CDXVA2Allocator();
+
+protected:
+    virtual HRESULT Alloc();
+    virtual void Free();
+
+private:
+    boost::shared_ptr<CH264DXVA2Decoder> m_decoder;
+};
+
+#endif  // _DXVA2_ALLOCATOR_H_
\ No newline at end of file
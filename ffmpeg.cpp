@@ -3,6 +3,8 @@
 #define HAVE_AV_CONFIG_H
 #define __STDC_CONSTANT_MACROS
 #include "common/stdint.h"
+#include <algorithm>
+#include <limits>
 #include <vector>
 
 #include <boost/intrusive_ptr.hpp>
@@ -13,7 +15,10 @@
 #include "common/dshow_util.h"
 #include "common/hardware_env.h"
 #include "common/intrusive_ptr_helper.h"
+#include "decoder_trace.h"
+#include "frame_arena.h"
 #include "podtypes.h"
+#include "worker_pool.h"
 #include "libavcodec/dsputil.h"
 #include "libavcodec/avcodec.h"
 #include "libavcodec/h264.h"
@@ -31,7 +36,10 @@ void releaseCodec(AVCodecContext* cont)
 {
     if (cont)
     {
-        avcodec_close(cont);
+        {
+            AutoLock lock(CFFMPEG::get()->GetCodecAccess());
+            avcodec_close(cont);
+        }
         av_free(cont);
     }
 }
@@ -74,71 +82,238 @@ enum KYCbCrRGBMatrixCoefType
     YCBCR_RGB_COEFF_SMPTE240M = 2,
 };
 
-struct TYCbCr2RGBCoef
-{
-    double Kr;
-    double Kg;
-    double Kb;
-    double ChrRange;
-    double YMul;
-    double VrMul;
-    double UgMul;
-    double VgMul;
-    double UbMul;
-    int YSub;
-    int RGBAdd1;
-    int RGBAdd3;
+// The YCbCr to RGB coefficients swscale takes, in 16.16 fixed point: Cr to R,
+// Cb to B, Cb to G, Cr to G, the luma scale, the black level to subtract,
+// times 65536, and the RGB black level. For an RGB range of 0 to 255, with
+//   Kg = 1 - Kr - Kb,     C = 255 / (chroma range)
+//   Cr to R = C * (1 - Kr),   Cb to G = C * (1 - Kb) * Kb / Kg,
+//   Cb to B = C * (1 - Kb),   Cr to G = C * (1 - Kr) * Kr / Kg,
+// where Kr, Kb are 0.299, 0.114 for BT.601, 0.2125, 0.0721 for BT.709 and
+// 0.2122, 0.0865 for SMPTE 240M. Limited range has luma from 16 to 235 and a
+// chroma range of 112; full range 0 to 255 and 128.
+const int32 yCbCr2RGBCoefs[][2][7] = {
+    {   // YCBCR_RGB_COEFF_ITUR_BT601
+        { 104597, 132201, 25675, 53279, 76309, 16 << 16, 0 },
+        { 91523, 115676, 22465, 46619, 65536, 0, 0 }
+    },
+    {   // YCBCR_RGB_COEFF_ITUR_BT709
+        { 117504, 138453, 13954, 34903, 76309, 16 << 16, 0 },
+        { 102816, 121147, 12209, 30540, 65536, 0, 0 }
+    },
+    {   // YCBCR_RGB_COEFF_SMPTE240M
+        { 117549, 136305, 16812, 35568, 76309, 16 << 16, 0 },
+        { 102855, 119267, 14711, 31122, 65536, 0, 0 }
+    }
 };
 
-void initYCbCr2RGBCoef(TYCbCr2RGBCoef* c,
-                       KYCbCrRGBMatrixCoefType iturBt,
-                       int whiteCutoff, int blackCutoff,
-                       int chromaCutoff, double RGBWhiteLevel,
-                       double RGBBlackLevel)
+// The conversion the SPS VUI asks for. Streams that don't say follow the
+// usual practice: BT.709 for HD, BT.601 below.
+const int32* getYCbCr2RGBCoefs(const AVCodecContext* codecCont)
 {
-    assert(c);
-    if (YCBCR_RGB_COEFF_ITUR_BT601 == iturBt)
+    KYCbCrRGBMatrixCoefType matrix = (codecCont->height > 576) ?
+        YCBCR_RGB_COEFF_ITUR_BT709 : YCBCR_RGB_COEFF_ITUR_BT601;
+    bool fullRange = false;
+    const H264Context* info =
+        reinterpret_cast<const H264Context*>(codecCont->priv_data);
+    if (info && info->sps.video_signal_type_present_flag)
     {
-        c->Kr = 0.299;
-        c->Kg = 0.587;
-        c->Kb = 0.114;
+        fullRange = !!info->sps.full_range;
+        if (info->sps.colour_description_present_flag)
+        {
+            switch (info->sps.colorspace)
+            {
+            case AVCOL_SPC_BT709:
+                matrix = YCBCR_RGB_COEFF_ITUR_BT709;
+                break;
+            case AVCOL_SPC_FCC:
+            case AVCOL_SPC_BT470BG:
+            case AVCOL_SPC_SMPTE170M:
+                matrix = YCBCR_RGB_COEFF_ITUR_BT601;
+                break;
+            case AVCOL_SPC_SMPTE240M:
+                matrix = YCBCR_RGB_COEFF_SMPTE240M;
+                break;
+            default:
+                break;
+            }
+        }
     }
-    else if (YCBCR_RGB_COEFF_SMPTE240M == iturBt)
+
+    return yCbCr2RGBCoefs[matrix][fullRange ? 1 : 0];
+}
+
+// Below this, handing a band to another thread costs more than converting it.
+const int minBandHeight = 64;
+
+// Threads worth spending on one stream, by the number of macroblocks in a
+// picture. Beyond these the extra threads mostly wait on each other, and each
+// frame thread costs a picture of delay and memory.
+struct TThreadLimit
+{
+    int MacroblockCount;
+    int Threads;
+};
+
+const TThreadLimit threadLimits[] = {
+    { 1620, 2 },    // 720x576
+    { 8160, 4 },    // 1920x1088
+    { 34560, 8 },   // 4096x2160
+};
+
+// Level 5.1 and above allow more reference pictures than frame threading can
+// afford to keep around per thread.
+const int maxFrameThreadLevel = 50;
+const int maxFrameThreadRefFrames = 8;
+
+AVDiscard toAVDiscard(KDiscardLevel level)
+{
+    const AVDiscard levels[] = {
+        AVDISCARD_NONE, AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_BIDIR,
+        AVDISCARD_NONKEY, AVDISCARD_ALL
+    };
+    assert((level >= 0) && (level < arraysize(levels)));
+    return levels[level];
+}
+
+// The most reference pictures an SPS may ask for.
+const int maxH264RefFrames = 16;
+
+// An arena picture: the planes and the edges libavcodec draws around them,
+// unless it emulates them. The chroma strides are half the luma one, as with
+// the libavcodec buffers.
+struct TPictureLayout
+{
+    int Size;
+    int Offset[3];  // Of the top left pixel
+    int Stride[3];
+};
+
+int alignUp(int n, int alignment)
+{
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+void getPictureLayout(AVCodecContext* c, TPictureLayout* layout)
+{
+    int width = c->width;
+    int height = c->height;
+    avcodec_align_dimensions(c, &width, &height);
+
+    int shiftX;
+    int shiftY;
+    avcodec_get_chroma_sub_sample(c->pix_fmt, &shiftX, &shiftY);
+
+    // The left edge is widened so that every plane starts aligned.
+    const int edge = (c->flags & CODEC_FLAG_EMU_EDGE) ? 0 : EDGE_WIDTH;
+    const int left = alignUp(edge, CFrameArena::ALIGNMENT);
+    const int stride =
+        alignUp(width + left * 2, CFrameArena::ALIGNMENT << shiftX);
+    layout->Size = 0;
+    for (int i = 0; i < 3; ++i)
     {
-        c->Kr = 0.2122;
-        c->Kg = 0.7013;
-        c->Kb = 0.0865;
+        const int x = i ? shiftX : 0;
+        const int y = i ? shiftY : 0;
+        const int top = edge >> y;
+        layout->Stride[i] = stride >> x;
+        layout->Offset[i] =
+            layout->Size + top * layout->Stride[i] + (left >> x);
+
+        // libavcodec reads a little past the last row.
+        layout->Size += layout->Stride[i] * ((height >> y) + top * 2) +
+            CFrameArena::ALIGNMENT;
     }
-    else
+}
+
+int64 getPictureMemory(int width, int height)
+{
+    return CFrameArena::GetSizeClass(std::max(width * height * 3 / 2, 1));
+}
+
+#ifdef FF_THREAD_FRAME
+// Every frame thread decodes into a picture of its own, on top of the
+// reference pictures and the one being output. Streams that start while the
+// arena is close to its budget get only as many as fit in what is left.
+int getAffordableFrameThreads(const CCodecContext& codec)
+{
+    const int64 headroom = CFFMPEG::get()->GetFrameArena()->GetHeadroom();
+    if (std::numeric_limits<int64>::max() == headroom)
+        return std::numeric_limits<int>::max();
+
+    const int64 pictures = (headroom - codec.GetDecodeMemory()) /
+        getPictureMemory(codec.GetWidth(), codec.GetHeight());
+    return static_cast<int>(std::max<int64>(std::min<int64>(pictures, 64), 0));
+}
+#endif
+
+// Only errors reach the debugger by default; the chattier levels come with
+// nearly every picture.
+const int defaultLogLevel = AV_LOG_ERROR;
+
+// One AVCodecContext::execute() call as a worker pool task.
+class CExecuteTask : public CWorkerPool::CTask
+{
+public:
+    CExecuteTask(AVCodecContext* c, int (*func)(AVCodecContext*, void*),
+                 void* arg, int* ret, int size)
+        : m_cont(c)
+        , m_func(func)
+        , m_arg(reinterpret_cast<int8*>(arg))
+        , m_ret(ret)
+        , m_size(size)
     {
-        c->Kr = 0.2125;
-        c->Kg = 0.7154;
-        c->Kb = 0.0721;
     }
 
-    double inYRange = whiteCutoff - blackCutoff;
-    c->ChrRange = 128 - chromaCutoff;
+    virtual void Execute(int index)
+    {
+        const int r = m_func(m_cont, m_arg + index * m_size);
+        if (m_ret)
+            m_ret[index] = r;
+    }
 
-    double RGBRange =
-        RGBWhiteLevel - RGBBlackLevel;
-    c->YMul =RGBRange / inYRange;
-    c->VrMul=(RGBRange / c->ChrRange) * (1.0 - c->Kr);
-    c->UgMul=(RGBRange / c->ChrRange) * (1.0 - c->Kb) * c->Kb / c->Kg;
-    c->VgMul=(RGBRange / c->ChrRange) * (1.0 - c->Kr) * c->Kr / c->Kg;
-    c->UbMul=(RGBRange / c->ChrRange) * (1.0 - c->Kb);
-    int sub = std::min(static_cast<int>(RGBBlackLevel), blackCutoff);
-    c->YSub = blackCutoff - sub;
-    c->RGBAdd1 = static_cast<int>(RGBBlackLevel) - sub;
-    c->RGBAdd3 = (c->RGBAdd1 << 8) + (c->RGBAdd1 << 16) + c->RGBAdd1;
+private:
+    AVCodecContext* m_cont;
+    int (*m_func)(AVCodecContext*, void*);
+    int8* m_arg;
+    int* m_ret;
+    int m_size;
+};
 }
 
-}
+class CSWScale::CBandTask : public CWorkerPool::CTask
+{
+public:
+    CBandTask(CSWScale* owner, const AVFrame* frame, void* buf)
+        : m_owner(owner)
+        , m_frame(frame)
+        , m_buf(buf)
+    {
+    }
 
+    virtual void Execute(int index)
+    {
+        m_owner->convertBand(m_owner->m_bands[index], m_frame, m_buf);
+    }
+
+private:
+    CSWScale* m_owner;
+    const AVFrame* m_frame;
+    void* m_buf;
+};
+
+//------------------------------------------------------------------------------
 CSWScale::CSWScale()
-    : m_cont()
+    : m_bands()
+    , m_convert(NULL)
     , m_width(0)
     , m_height(0)
+    , m_srcWidth(0)
+    , m_srcHeight(0)
+    , m_codecWidth(0)
+    , m_codecHeight(0)
+    , m_coefs(NULL)
+    , m_inCsp(0)
     , m_outCsp(0)
+    , m_bytesPerSample(1)
 {
 }
 
@@ -148,31 +323,113 @@ CSWScale::~CSWScale()
 
 bool CSWScale::Init(const CCodecContext& codec, IMediaSample* sample)
 {
-    if (m_cont)
-        return true;
-    
-    AM_MEDIA_TYPE* m;
-    if (FAILED(sample->GetMediaType(&m)) || !m)
-        return false;
+    AM_MEDIA_TYPE* m = NULL;
+    if (S_OK == sample->GetMediaType(&m))
+    {
+        BITMAPINFOHEADER header;
+        const bool extracted = ExtractBitmapInfoFromMediaType(*m, &header);
+        if (extracted)
+            setOutputFormat(m->subtype, header.biWidth, abs(header.biHeight));
+
+        DeleteMediaType(m);
+        if (!extracted)
+            return false;
+    }
 
-    BITMAPINFOHEADER header;
-    if (!ExtractBitmapInfoFromMediaType(*m, &header))
+    return update(codec);
+}
+
+bool CSWScale::Init(const CCodecContext& codec, const GUID& subtype,
+                    int width, int height)
+{
+    setOutputFormat(subtype, width, height);
+    return update(codec);
+}
+
+bool CSWScale::Convert(const CVideoFrame& frame, void* buf)
+{
+    if (m_bands.empty())
         return false;
 
-    m_width = header.biWidth;
-    m_height = abs(header.biHeight);
-    m_outCsp = (MEDIASUBTYPE_YV12 == m->subtype) ?
-        (FF_CSP_420P | FF_CSP_FLAGS_YUV_ADJ) : FF_CSP_YUY2;
-    DeleteMediaType(m);
+    CTraceScope trace(H264_TRACE_CONVERT, -1, -1, -1, -1);
+    CBandTask task(this, const_cast<CVideoFrame&>(frame).getFrame(), buf);
+    CFFMPEG::get()->GetWorkerPool()->Run(&task,
+                                         static_cast<int>(m_bands.size()));
+    return true;
+}
 
-    TYCbCr2RGBCoef coeffs;
-    initYCbCr2RGBCoef(&coeffs, YCBCR_RGB_COEFF_ITUR_BT601, 0, 235, 16, 255.0,
-                      0.0);
-    int32 swscaleTable[7];
-    SwsParams params = {0};
+bool CSWScale::update(const CCodecContext& codec)
+{
+    // No output format seen yet.
+    if (!m_width)
+        return false;
 
     const AVCodecContext* codecCont =
         const_cast<CCodecContext&>(codec).getCodecContext();
+    if (!m_bands.empty() && (codecCont->width == m_codecWidth) &&
+        (codecCont->height == m_codecHeight) &&
+        (csp_lavc2ffdshow(codecCont->pix_fmt) == m_inCsp) &&
+        (getYCbCr2RGBCoefs(codecCont) == m_coefs))
+        return true;
+
+    return build(codecCont);
+}
+
+void CSWScale::setOutputFormat(const GUID& subtype, int width, int height)
+{
+    const csp_convert::ConvertFunc convert = m_convert;
+    const int outCsp = m_outCsp;
+    m_convert = NULL;
+    m_bytesPerSample = 1;
+    if (MEDIASUBTYPE_NV12 == subtype)
+    {
+        m_outCsp = FF_CSP_NV12;
+        m_convert = csp_convert::GetYUV420PToNV12();
+    }
+    else if (MEDIASUBTYPE_P010 == subtype)
+    {
+        m_outCsp = FF_CSP_NULL;
+        m_bytesPerSample = 2;
+        m_convert = csp_convert::GetYUV420PToP010();
+    }
+    else
+    {
+        m_outCsp = (MEDIASUBTYPE_YV12 == subtype) ?
+            (FF_CSP_420P | FF_CSP_FLAGS_YUV_ADJ) : FF_CSP_YUY2;
+    }
+
+    // Renderers attach the same format again now and then, e.g. when
+    // they are moved to another monitor.
+    if ((m_convert == convert) && (m_outCsp == outCsp) &&
+        (width == m_width) && (height == m_height))
+        return;
+
+    m_width = width;
+    m_height = height;
+    m_bands.clear();
+}
+
+bool CSWScale::build(const AVCodecContext* codecCont)
+{
+    m_bands.clear();
+    m_codecWidth = codecCont->width;
+    m_codecHeight = codecCont->height;
+    m_srcWidth = std::min(codecCont->width, m_width);
+    m_srcHeight = std::min(codecCont->height, m_height);
+    m_inCsp = csp_lavc2ffdshow(codecCont->pix_fmt);
+    m_coefs = getYCbCr2RGBCoefs(codecCont);
+    if (m_convert)
+    {
+        if ((PIX_FMT_YUV420P != codecCont->pix_fmt) &&
+            (PIX_FMT_YUVJ420P != codecCont->pix_fmt))
+            return false;
+
+        splitIntoBands(2);
+        return true;
+    }
+
+    SwsParams params = {0};
+
     if (codecCont->dsp_mask & CHardwareEnv::PROCESSOR_FEATURE_MMX)
         params.cpu |= SWS_CPU_CAPS_MMX | SWS_CPU_CAPS_MMX2;
 
@@ -182,36 +439,89 @@ bool CSWScale::Init(const CCodecContext& codec, IMediaSample* sample)
     params.methodLuma.method = SWS_POINT;
     params.methodChroma.method = SWS_POINT;
 
-    swscaleTable[0] = static_cast<int32>(coeffs.VrMul * 65536 + 0.5);
-    swscaleTable[1] = static_cast<int32>(coeffs.UbMul * 65536 + 0.5);
-    swscaleTable[2] = static_cast<int32>(coeffs.UgMul * 65536 + 0.5);
-    swscaleTable[3] = static_cast<int32>(coeffs.VgMul * 65536 + 0.5);
-    swscaleTable[4] = static_cast<int32>(coeffs.YMul  * 65536 + 0.5);
-    swscaleTable[5] = static_cast<int32>(coeffs.YSub * 65536);
-    swscaleTable[6] = coeffs.RGBAdd1;
-
-    m_cont.reset(
-        sws_getContext(
-            codecCont->width, codecCont->height,
-            csp_ffdshow2mplayer(csp_lavc2ffdshow(codecCont->pix_fmt)),
-            codecCont->width, codecCont->height,
-            csp_ffdshow2mplayer(m_outCsp), &params,
-            NULL, NULL, swscaleTable),
-        sws_freeContext);
+    // A band must not start in the middle of a subsampled chroma row, on
+    // either side of the conversion.
+    const TcspInfo* incspInfo = csp_getInfo(m_inCsp);
+    const TcspInfo* outcspInfo = csp_getInfo(m_outCsp);
+    splitIntoBands(
+        1 << std::max(incspInfo->shiftY[1], outcspInfo->shiftY[1]));
+
+    // Pictures wider than the output, from a size change the downstream
+    // filter turned down, are cropped.
+    for (int i = 0; i < static_cast<int>(m_bands.size()); ++i)
+    {
+        m_bands[i].Cont.reset(
+            sws_getContext(
+                m_srcWidth, m_bands[i].Height, csp_ffdshow2mplayer(m_inCsp),
+                m_srcWidth, m_bands[i].Height, csp_ffdshow2mplayer(m_outCsp),
+                &params, NULL, NULL, const_cast<int32*>(m_coefs)),
+            sws_freeContext);
+        if (!m_bands[i].Cont)
+        {
+            m_bands.clear();
+            return false;
+        }
+    }
+
     return true;
 }
 
-bool CSWScale::Convert(const CVideoFrame& frame, void* buf)
+void CSWScale::splitIntoBands(int alignment)
+{
+    const int threads = CFFMPEG::get()->GetWorkerPool()->GetThreadCount();
+    const int count =
+        std::max(1, std::min(threads, m_srcHeight / minBandHeight));
+    const int rows =
+        ((m_srcHeight + count - 1) / count + alignment - 1) / alignment *
+        alignment;
+
+    m_bands.clear();
+    for (int top = 0; top < m_srcHeight; top += rows)
+    {
+        TBand band;
+        band.Top = top;
+        band.Height = std::min(rows, m_srcHeight - top);
+        m_bands.push_back(band);
+    }
+}
+
+void CSWScale::convertBand(const TBand& band, const AVFrame* frame, void* buf)
 {
+    if (m_convert)
+    {
+        const int chromaTop = band.Top / 2;
+        const uint8* src[3] = {
+            frame->data[0] + band.Top * frame->linesize[0],
+            frame->data[1] + chromaTop * frame->linesize[1],
+            frame->data[2] + chromaTop * frame->linesize[2]
+        };
+        const int srcStride[3] = {
+            frame->linesize[0], frame->linesize[1], frame->linesize[2]
+        };
+        const int dstStride = m_width * m_bytesPerSample;
+        uint8* luma = reinterpret_cast<uint8*>(buf);
+        uint8* const dst[2] = {
+            luma + band.Top * dstStride,
+            luma + dstStride * m_height + chromaTop * dstStride
+        };
+        m_convert(src, srcStride, dst, dstStride, m_srcWidth, band.Height);
+        return;
+    }
+
+    uint8* src[4];
     uint8* dst[4];
     stride_t srcStride[4];
     stride_t dstStride[4];
 
+    const TcspInfo* incspInfo = csp_getInfo(m_inCsp);
     const TcspInfo* outcspInfo = csp_getInfo(m_outCsp);
-    const AVFrame* rawFrame = const_cast<CVideoFrame&>(frame).getFrame();
     for (int i = 0; i < 4; ++i)
     {
-        srcStride[i] = static_cast<stride_t>(rawFrame->linesize[i]);
+        srcStride[i] = static_cast<stride_t>(frame->linesize[i]);
+        src[i] = frame->data[i];
+        if (src[i])
+            src[i] += (band.Top >> incspInfo->shiftY[i]) * srcStride[i];
+
         dstStride[i] = m_width >> outcspInfo->shiftX[i];
         if (!i)
             dst[i] = reinterpret_cast<uint8*>(buf);
@@ -228,10 +538,12 @@ bool CSWScale::Convert(const CVideoFrame& frame, void* buf)
         csp_yuv_adj_to_plane(csp,outcspInfo, m_height,
                              (unsigned char**)dst,dstStride);
 
-    sws_scale_ordered(reinterpret_cast<SwsContext*>(m_cont.get()),
-                      const_cast<uint8_t**>(rawFrame->data), srcStride, 0,
-                      m_height, dst, dstStride);
-    return true;
+    for (int i = 0; i < 4; ++i)
+        if (dst[i])
+            dst[i] += (band.Top >> outcspInfo->shiftY[i]) * dstStride[i];
+
+    sws_scale_ordered(reinterpret_cast<SwsContext*>(band.Cont.get()), src,
+                      srcStride, 0, band.Height, dst, dstStride);
 }
 
 //------------------------------------------------------------------------------
@@ -245,6 +557,11 @@ CVideoFrame::~CVideoFrame()
 {
 }
 
+bool CVideoFrame::IsReference() const
+{
+    return !!m_frame->reference;
+}
+
 bool CVideoFrame::GetTime(int64* start, int64* stop)
 {
     if (start)
@@ -298,6 +615,11 @@ void CVideoFrame::SetTypeSpecificFlags(IMediaSample* sample)
     }
 }
 
+const void* CVideoFrame::GetBuffer() const
+{
+    return m_frame.get()->data[0];
+}
+
 inline AVFrame* CVideoFrame::getFrame()
 {
     return reinterpret_cast<AVFrame*>(m_frame.get());
@@ -333,16 +655,15 @@ void CCodecContext::ReviseTypeSpecFlags(int firstFieldType, int picType,
 CCodecContext::CCodecContext()
     : m_cont(avcodec_alloc_context(), releaseCodec)
     , m_extraData()
+    , m_frameAllocator(NULL)
+    , m_threadingPolicy()
+    , m_hasThreadingPolicy(false)
+    , m_lowLatency(false)
 {
 }
 
 CCodecContext::~CCodecContext()
 {
-    if (m_cont->thread_count > 1)
-    {
-        avcodec_thread_free(m_cont.get());
-        m_cont->thread_count = 1;
-    }
 }
 
 bool CCodecContext::Init(AVCodec* c, const CMediaType& mediaType)
@@ -379,18 +700,17 @@ bool CCodecContext::Init(AVCodec* c, const CMediaType& mediaType)
     cont->dsp_mask = FF_MM_FORCE | CHardwareEnv::get()->GetProcessorFeatures();
     cont->postgain = 1.0f;
     cont->debug_mv = 0;
-    cont->get_buffer = avcodec_default_get_buffer;
-    cont->release_buffer = avcodec_default_release_buffer;
+    cont->opaque = this;
+    cont->get_buffer = getBuffer;
+    cont->release_buffer = releaseBuffer;
     cont->reget_buffer = avcodec_default_reget_buffer;
     cont->handle_user_data =
         reinterpret_cast<void (__cdecl*)(AVCodecContext*,const uint8_t *,int)>(
             handleUserData);
 
     allocExtraData(mediaType);
-    if (avcodec_open(cont, c) < 0)
-        return false;
-
-    return true;
+    AutoLock lock(CFFMPEG::get()->GetCodecAccess());
+    return avcodec_open(cont, c) >= 0;
 }
 
 int CCodecContext::GetVideoLevel() const
@@ -406,6 +726,13 @@ int CCodecContext::GetVideoLevel() const
     return -1;
 }
 
+int64 CCodecContext::GetDecodeMemory() const
+{
+    const int refFrames = GetRefFrameCount();
+    return getPictureMemory(GetWidth(), GetHeight()) *
+        (((refFrames >= 0) ? refFrames : maxH264RefFrames) + 2);
+}
+
 int CCodecContext::GetRefFrameCount() const
 {
     H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
@@ -434,36 +761,157 @@ int CCodecContext::GetNALLength() const
     return m_cont.get()->nal_length_size;
 }
 
-bool CCodecContext::IsRefFrameInUse(int frameNum) const
+uint32 CCodecContext::GetRefFrameMask() const
 {
     H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
     if (!info)
-        return false;
+        return 0;
 
+    uint32 mask = 0;
     for (int i = 0; i < info->short_ref_count; ++i)
-        if (reinterpret_cast<intptr_t>(info->short_ref[i]->opaque) == frameNum)
-            return true;
+    {
+        const intptr_t frameNum =
+            reinterpret_cast<intptr_t>(info->short_ref[i]->opaque);
+        if ((frameNum >= 0) && (frameNum < 32))
+            mask |= 1U << frameNum;
+    }
 
-    for (int i = 0; i < info->long_ref_count; ++i)
-        if (reinterpret_cast<intptr_t>(info->long_ref[i]->opaque) == frameNum)
-            return true;
+    // Indexed by LongTermFrameIdx, so there can be holes before the last
+    // entry.
+    for (int i = 0; i < arraysize(info->long_ref); ++i)
+    {
+        if (!info->long_ref[i])
+            continue;
 
-    return false;
+        const intptr_t frameNum =
+            reinterpret_cast<intptr_t>(info->long_ref[i]->opaque);
+        if ((frameNum >= 0) && (frameNum < 32))
+            mask |= 1U << frameNum;
+    }
+
+    return mask;
 }
 
 void CCodecContext::SetThreadNumber(int n)
 {
-    if (n == m_cont->thread_count)
-        return;
+    // No avcodec_thread_init(): that would start a thread set per stream.
+    // libavcodec only needs thread_count to split the picture into as many
+    // slice contexts, and hands those to execute().
+    AVCodecContext* cont = m_cont.get();
+    if (n > 1)
+    {
+        cont->thread_count = n;
+        cont->execute = execute;
+    }
+    else
+    {
+        cont->thread_count = 1;
+        cont->execute = avcodec_default_execute;
+    }
+}
+
+void CCodecContext::SetThreadingPolicy(const TThreadingPolicy& policy)
+{
+    m_threadingPolicy = policy;
+    m_hasThreadingPolicy = true;
+}
+
+TThreadingPolicy CCodecContext::GetThreadingPolicy() const
+{
+    if (m_hasThreadingPolicy)
+        return m_threadingPolicy;
+
+    const int macroblocks =
+        ((GetWidth() + 15) / 16) * ((GetHeight() + 15) / 16);
+    TThreadingPolicy policy;
+    policy.SliceThreads = true;
+    policy.LowLatency = IsLowLatency();
+    policy.MaxThreads = 0;
+    for (int i = 0; i < arraysize(threadLimits); ++i)
+    {
+        if (macroblocks <= threadLimits[i].MacroblockCount)
+        {
+            policy.MaxThreads = threadLimits[i].Threads;
+            break;
+        }
+    }
 
-    if (m_cont->thread_count > 1)
+    // Unknown until the first SPS, in which case nothing is ruled out.
+    const int level = GetVideoLevel();
+    const int refFrames = GetRefFrameCount();
+    policy.FrameThreads = (level <= maxFrameThreadLevel) &&
+        (refFrames <= maxFrameThreadRefFrames);
+    return policy;
+}
+
+void CCodecContext::ApplyThreadingPolicy()
+{
+    const TThreadingPolicy policy = GetThreadingPolicy();
+    const int processors = CHardwareEnv::get()->GetNumOfLogicalProcessors();
+    int threads = (policy.MaxThreads > 0) ?
+        std::min(policy.MaxThreads, processors) : processors;
+    bool frameThreads =
+        policy.FrameThreads && !policy.LowLatency && !IsLowLatency();
+
+#ifdef FF_THREAD_FRAME
+    if (frameThreads)
     {
-        avcodec_thread_free(m_cont.get());
-        m_cont->thread_count = 1;
+        const int affordable = getAffordableFrameThreads(*this);
+        if (affordable < 2)
+            frameThreads = false;
+        else if (affordable < threads)
+            threads = affordable;
     }
 
-    if (n > 1)
-        avcodec_thread_init(m_cont.get(), n);
+    m_cont->thread_type = (policy.SliceThreads ? FF_THREAD_SLICE : 0) |
+        (frameThreads ? FF_THREAD_FRAME : 0);
+    const bool slicesOnly = !frameThreads;
+#else
+    const bool slicesOnly = true;
+#endif
+
+    // Slice threads cost no pictures, but each one gets a copy of the
+    // decoder context with its scratch buffers. A stream that starts without
+    // room in the budget for its pictures decodes on one thread.
+    if (slicesOnly && (CFFMPEG::get()->GetFrameArena()->GetHeadroom() <
+                       GetDecodeMemory()))
+        threads = 1;
+
+    // Without FF_THREAD_FRAME this libavcodec only threads slices, which
+    // adds no delay, so a frame threading request falls back to it.
+    SetThreadNumber((policy.SliceThreads || frameThreads) ? threads : 1);
+}
+
+void CCodecContext::SetLowLatency(bool lowLatency)
+{
+    m_lowLatency = lowLatency;
+}
+
+bool CCodecContext::IsLowLatency() const
+{
+    if (m_lowLatency)
+        return true;
+
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return false;
+
+    SPS* s = info->sps_buffers[0];
+    if (!s)
+        return false;
+
+    return (2 == s->poc_type) ||
+        (s->bitstream_restriction_flag && !s->num_reorder_frames);
+}
+
+void CCodecContext::SetSkipFrame(KDiscardLevel level)
+{
+    m_cont->skip_frame = toAVDiscard(level);
+}
+
+void CCodecContext::SetSkipLoopFilter(KDiscardLevel level)
+{
+    m_cont->skip_loop_filter = toAVDiscard(level);
 }
 
 void CCodecContext::SetSliceLong(void* sliceLong)
@@ -505,6 +953,11 @@ int CCodecContext::Decode(CVideoFrame* frame, const void* buf, int size)
     packet.data = const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(buf));
     packet.size = size;
 
+    // libavcodec holds back as many pictures as it guesses the stream
+    // reorders, and raises that guess when it sees one out of order.
+    if (IsLowLatency())
+        m_cont->has_b_frames = 0;
+
     int frameFinished;
     int usedBytes = avcodec_decode_video2(
         reinterpret_cast<AVCodecContext*>(m_cont.get()), frame->getFrame(),
@@ -519,11 +972,102 @@ void CCodecContext::FlushBuffers()
     avcodec_flush_buffers(m_cont.get());
 }
 
+void CCodecContext::SetFrameBufferAllocator(CFrameBufferAllocator* allocator)
+{
+    m_frameAllocator = allocator;
+    if (!allocator)
+        return;
+
+    // The reference pictures have no room for drawn edges. Never cleared
+    // again, since earlier pictures may still be referenced.
+    m_cont->flags |= CODEC_FLAG_EMU_EDGE;
+}
+
+int CCodecContext::execute(AVCodecContext* c,
+                           int (*func)(AVCodecContext* c2, void* arg),
+                           void* arg, int* ret, int count, int size)
+{
+    CExecuteTask task(c, func, arg, ret, size);
+    CFFMPEG::get()->GetWorkerPool()->Run(&task, count);
+    return 0;
+}
+
 void CCodecContext::handleUserData(AVCodecContext* c, const void* buf,
                                    int bufSize)
 {
 }
 
+int CCodecContext::getBuffer(AVCodecContext* c, AVFrame* pic)
+{
+    CCodecContext* context = reinterpret_cast<CCodecContext*>(c->opaque);
+    CFrameBufferAllocator::TFrameBuffer buffer;
+    if (context->m_frameAllocator &&
+        context->m_frameAllocator->AllocFrameBuffer(c->width, c->height,
+                                                    &buffer))
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            pic->data[i] = reinterpret_cast<uint8_t*>(buffer.Plane[i]);
+            pic->base[i] = pic->data[i];
+            pic->linesize[i] = buffer.Stride[i];
+        }
+
+        // Tells the allocator's buffers apart from the arena blocks on
+        // release; the allocator may take arena blocks of its own.
+        pic->opaque = context->m_frameAllocator;
+    }
+    else
+    {
+        TPictureLayout layout;
+        getPictureLayout(c, &layout);
+        uint8_t* block = reinterpret_cast<uint8_t*>(
+            CFFMPEG::get()->GetFrameArena()->Alloc(layout.Size));
+        if (!block)
+            return -1;
+
+        // base[0] is the arena block, which is what goes back on release.
+        for (int i = 0; i < 3; ++i)
+        {
+            pic->data[i] = block + layout.Offset[i];
+            pic->base[i] = i ? pic->data[i] : block;
+            pic->linesize[i] = layout.Stride[i];
+        }
+
+        pic->opaque = NULL;
+    }
+
+    pic->data[3] = NULL;
+    pic->base[3] = NULL;
+    pic->linesize[3] = 0;
+    pic->type = FF_BUFFER_TYPE_USER;
+    pic->age = 256 * 256 * 256 * 64;
+    pic->reordered_opaque = c->reordered_opaque;
+    return 0;
+}
+
+void CCodecContext::releaseBuffer(AVCodecContext* c, AVFrame* pic)
+{
+    if (pic->type != FF_BUFFER_TYPE_USER)
+    {
+        avcodec_default_release_buffer(c, pic);
+        return;
+    }
+
+    if (pic->opaque)
+        reinterpret_cast<CFrameBufferAllocator*>(pic->opaque)->
+            ReleaseFrameBuffer(pic->data[0]);
+    else
+        CFFMPEG::get()->GetFrameArena()->Free(pic->base[0]);
+
+    pic->opaque = NULL;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        pic->data[i] = NULL;
+        pic->base[i] = NULL;
+    }
+}
+
 AVCodecContext* CCodecContext::getCodecContext()
 {
     return m_cont.get();
@@ -609,10 +1153,15 @@ shared_ptr<CCodecContext> CFFMPEG::CreateCodec(const CMediaType& mediaType)
 }
 
 CFFMPEG::CFFMPEG()
+    : m_workerPool(
+        new CWorkerPool(CHardwareEnv::get()->GetNumOfLogicalProcessors()))
+    , m_frameArena(new CFrameArena)
+    , m_codecAccess()
 {
     // Initialize FFMPEG
     avcodec_init();
     avcodec_register_all();
+    av_log_set_level(defaultLogLevel);
     av_log_set_callback(logCallback);
 }
 
@@ -622,9 +1171,14 @@ CFFMPEG::~CFFMPEG()
 
 void CFFMPEG::logCallback(void* p, int level, const char* format, va_list v)
 {
+    // Called with the decoding locks held, so the common case returns before
+    // formatting anything, and nothing is allocated.
+    if ((level > av_log_get_level()) || !IsDebuggerPresent())
+        return;
+
     const int debugMessageSize = 1024;
-    boost::scoped_array<char> buf(new char[debugMessageSize]);
-    buf[0] = L'\0';
-    _vsnprintf_s(buf.get(), debugMessageSize, debugMessageSize - 1, format, v);
-    OutputDebugStringA(buf.get());
+    char buf[debugMessageSize];
+    buf[0] = '\0';
+    _vsnprintf_s(buf, debugMessageSize, debugMessageSize - 1, format, v);
+    OutputDebugStringA(buf);
 }
\ No newline at end of file
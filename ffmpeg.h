@@ -1,30 +1,77 @@
 #ifndef _FFMPEG_H_
 #define _FFMPEG_H_
 
+#include <vector>
+
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
 
+#include "csp_convert.h"
+#include "chromium/base/lock.h"
 #include "chromium/base/singleton.h"
 
 struct IMediaSample;
 class CMediaType;
 class CVideoFrame;
 class CCodecContext;
+class CWorkerPool;
+class CFrameArena;
+struct AVFrame;
+
+// Converts the picture in horizontal bands, which run in parallel on the
+// CFFMPEG worker pool once the picture is tall enough to be worth splitting.
 class CSWScale
 {
 public:
     CSWScale();
     ~CSWScale();
 
+    // Takes the output format from |sample| when it carries one, and keeps
+    // the last one otherwise. The conversion is only set up again when the
+    // output format, or the size, pixel format or colorimetry of the decoded
+    // pictures, changes.
     bool Init(const CCodecContext& codec, IMediaSample* sample);
+
+    // For output buffers that come without a media type. |width| is the
+    // stride, in pixels.
+    bool Init(const CCodecContext& codec, const GUID& subtype, int width,
+              int height);
     bool Convert(const CVideoFrame& frame, void* buf);
     int GetOutCsp() const { return m_outCsp; }
 
 private:
-    boost::shared_ptr<void> m_cont;
+    class CBandTask;
+
+    // One SwsContext per band; swscale keeps per-context state between
+    // slices, so the bands can't share one.
+    struct TBand
+    {
+        int Top;
+        int Height;
+        boost::shared_ptr<void> Cont;
+    };
+
+    void setOutputFormat(const GUID& subtype, int width, int height);
+    bool update(const CCodecContext& codec);
+    bool build(const AVCodecContext* codecCont);
+    void splitIntoBands(int alignment);
+    void convertBand(const TBand& band, const AVFrame* frame, void* buf);
+
+    std::vector<TBand> m_bands;
+
+    // NV12 and P010 are repacked directly instead of through swscale.
+    csp_convert::ConvertFunc m_convert;
     int m_width;
     int m_height;
+    int m_srcWidth;
+    int m_srcHeight;
+    int m_codecWidth;
+    int m_codecHeight;
+    const int32* m_coefs;   // Colorimetry of the decoded pictures
+    int m_inCsp;
     int m_outCsp;
+    int m_bytesPerSample;
 };
 
 //------------------------------------------------------------------------------
@@ -37,6 +84,13 @@ public:
 
     bool IsComplete() const { return m_isComplete; }
     void SetComplete(bool complete) { m_isComplete = complete; }
+
+    // Other pictures may be predicted from this one.
+    bool IsReference() const;
+
+    // First plane of the decoded picture, which identifies the buffer a
+    // CFrameBufferAllocator handed out.
+    const void* GetBuffer() const;
     bool GetTime(int64* start, int64* stop);
     void SetTypeSpecificFlags(IMediaSample* sample);
 
@@ -49,9 +103,58 @@ private:
     bool m_isComplete;
 };
 
+//------------------------------------------------------------------------------
+// Supplies the picture buffers libavcodec decodes into, instead of its own.
+// The buffers have no edge padding; libavcodec emulates the edges in that
+// case.
+class CFrameBufferAllocator
+{
+public:
+    struct TFrameBuffer
+    {
+        void* Plane[3];     // Y, Cb, Cr
+        int Stride[3];
+    };
+
+    // Returning false gives the picture an arena block laid out by
+    // libavcodec, whose strides differ from the allocator's; libavcodec
+    // fails the picture when the strides change in the middle of a stream.
+    // So once a stream has started, only return false for a new picture
+    // size, and otherwise hand out a buffer of the same layout.
+    virtual bool AllocFrameBuffer(int width, int height,
+                                  TFrameBuffer* buffer) = 0;
+    virtual void ReleaseFrameBuffer(const void* plane) = 0;
+
+protected:
+    virtual ~CFrameBufferAllocator() {}
+};
+
+//------------------------------------------------------------------------------
+// How libavcodec spreads the decoding of one stream over threads.
+struct TThreadingPolicy
+{
+    bool FrameThreads;  // Several pictures at once, one picture of delay each
+    bool SliceThreads;  // The slices of one picture in parallel
+    int MaxThreads;     // 0 for one per logical processor
+    bool LowLatency;    // Never trade delay for throughput
+};
+
+//------------------------------------------------------------------------------
+// What libavcodec may leave out, in the order of AVDiscard.
+enum KDiscardLevel
+{
+    DISCARD_NONE = 0,
+    DISCARD_DEFAULT = 1,    // Empty packets only
+    DISCARD_NON_REF = 2,
+    DISCARD_BIDIR = 3,
+    DISCARD_NON_KEY = 4,    // All but I pictures
+    DISCARD_ALL = 5
+};
+
 //------------------------------------------------------------------------------
 struct AVCodec;
 struct AVCodecContext;
+struct AVFrame;
 class CCodecContext
 {
 public:
@@ -67,8 +170,42 @@ public:
     int GetWidth() const;
     int GetHeight() const;
     int GetNALLength() const;
-    bool IsRefFrameInUse(int frameNum) const;
+
+    // Roughly what decoding the stream holds in the frame arena: the
+    // reference pictures, the one being decoded and the one being output.
+    int64 GetDecodeMemory() const;
+
+    // Bit n is set if the picture tagged with frame number n is still in the
+    // short or long term reference list. Frame numbers from 32 up aren't
+    // reported.
+    uint32 GetRefFrameMask() const;
+
+    // Runs the slice jobs of up to |n| threads on the CFFMPEG worker pool.
     void SetThreadNumber(int n);
+
+    // Overrides the policy chosen from the stream until the context goes
+    // away. Takes effect at the next ApplyThreadingPolicy().
+    void SetThreadingPolicy(const TThreadingPolicy& policy);
+
+    // The policy given to SetThreadingPolicy(), otherwise one chosen from the
+    // picture size, level and reference count.
+    TThreadingPolicy GetThreadingPolicy() const;
+    void ApplyThreadingPolicy();
+
+    // Pictures then come out the moment they are decoded, in decoding order,
+    // and frame threading is off from the next ApplyThreadingPolicy().
+    void SetLowLatency(bool lowLatency);
+
+    // True if asked for, or if the SPS rules out reordering: POC type 2, or a
+    // bitstream restriction with no reorder frames.
+    bool IsLowLatency() const;
+
+    // Pictures, or the deblocking of pictures, that Decode() leaves out.
+    // Only for the software decoder; the DXVA decoders need every slice
+    // header parsed.
+    void SetSkipFrame(KDiscardLevel level);
+    void SetSkipLoopFilter(KDiscardLevel level);
+
     void SetSliceLong(void* sliceLong);
     void UpdateTime(int64 start, int64 stop);
     void PreDecodeBuffer(const void* data, int size, int* framePOC, int* outPOC,
@@ -77,16 +214,30 @@ public:
     int Decode(CVideoFrame* frame, const void* buf, int size);
     void FlushBuffers();
 
+    // NULL goes back to the CFFMPEG frame arena, which also takes the
+    // pictures |allocator| turns down. Flush first, so that no picture still
+    // lives in the previous allocator's memory.
+    void SetFrameBufferAllocator(CFrameBufferAllocator* allocator);
+
 private:
     friend class CSWScale;
 
     static void handleUserData(AVCodecContext* c, const void* buf, int bufSize);
+    static int getBuffer(AVCodecContext* c, AVFrame* pic);
+    static void releaseBuffer(AVCodecContext* c, AVFrame* pic);
+    static int execute(AVCodecContext* c,
+                       int (*func)(AVCodecContext* c2, void* arg),
+                       void* arg, int* ret, int count, int size);
 
     AVCodecContext* getCodecContext();
     void allocExtraData(const CMediaType& mediaType);
 
     boost::shared_ptr<AVCodecContext> m_cont;
     boost::scoped_array<int8> m_extraData;
+    CFrameBufferAllocator* m_frameAllocator;
+    TThreadingPolicy m_threadingPolicy;
+    bool m_hasThreadingPolicy;
+    bool m_lowLatency;
 };
 
 //------------------------------------------------------------------------------
@@ -100,8 +251,23 @@ public:
     CFFMPEG();
     ~CFFMPEG();
 
+    // Shared by every stream in the process, so that the number of decoding
+    // threads doesn't grow with the number of streams.
+    CWorkerPool* GetWorkerPool() { return m_workerPool.get(); }
+
+    // Where every context's pictures live; the place to set a process-wide
+    // memory budget.
+    CFrameArena* GetFrameArena() { return m_frameArena.get(); }
+
+    // avcodec_open() and avcodec_close() must not run on two threads at once.
+    Lock& GetCodecAccess() { return m_codecAccess; }
+
 private:
     static void logCallback(void* p, int level, const char* format, va_list v);
+
+    boost::scoped_ptr<CWorkerPool> m_workerPool;
+    boost::scoped_ptr<CFrameArena> m_frameArena;
+    Lock m_codecAccess;
 };
 
 #endif  // _FFMPEG_H_
\ No newline at end of file
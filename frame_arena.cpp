@@ -0,0 +1,142 @@
+#include "frame_arena.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <malloc.h>
+
+namespace
+{
+// Smaller blocks are rounded up to this.
+const int minSizeClass = 4096;
+}
+
+int CFrameArena::GetSizeClass(int size)
+{
+    assert(size >= 0);
+    if (size <= minSizeClass)
+        return minSizeClass;
+
+    int power = minSizeClass;
+    while (power < size)
+        power <<= 1;
+
+    const int step = power / 8;
+    return (size + step - 1) / step * step;
+}
+
+CFrameArena::CFrameArena()
+    : m_access()
+    , m_inUse()
+    , m_free()
+    , m_inUseSize(0)
+    , m_freeSize(0)
+    , m_budget(0)
+{
+}
+
+CFrameArena::~CFrameArena()
+{
+    trim(0);
+}
+
+void* CFrameArena::Alloc(int size)
+{
+    const int sizeClass = GetSizeClass(size);
+    {
+        AutoLock lock(m_access);
+        std::vector<void*>& blocks = m_free[sizeClass];
+        if (!blocks.empty())
+        {
+            void* block = blocks.back();
+            blocks.pop_back();
+            m_freeSize -= sizeClass;
+            m_inUse[block] = sizeClass;
+            m_inUseSize += sizeClass;
+            return block;
+        }
+
+        // Kept blocks of other sizes make room first.
+        if (m_budget)
+            trim(std::max<int64>(m_budget - m_inUseSize - sizeClass, 0));
+    }
+
+    void* block = _aligned_malloc(sizeClass, ALIGNMENT);
+    if (!block)
+        return NULL;
+
+    AutoLock lock(m_access);
+    m_inUse[block] = sizeClass;
+    m_inUseSize += sizeClass;
+    return block;
+}
+
+bool CFrameArena::Free(void* block)
+{
+    AutoLock lock(m_access);
+    std::map<void*, int>::iterator i = m_inUse.find(block);
+    if (m_inUse.end() == i)
+        return false;
+
+    const int sizeClass = i->second;
+    m_inUse.erase(i);
+    m_inUseSize -= sizeClass;
+    m_free[sizeClass].push_back(block);
+    m_freeSize += sizeClass;
+    trim(getKeepLimit());
+    return true;
+}
+
+void CFrameArena::SetBudget(int64 budget)
+{
+    assert(budget >= 0);
+    AutoLock lock(m_access);
+    m_budget = budget;
+    trim(getKeepLimit());
+}
+
+int64 CFrameArena::GetBudget() const
+{
+    AutoLock lock(m_access);
+    return m_budget;
+}
+
+int64 CFrameArena::GetHeadroom() const
+{
+    AutoLock lock(m_access);
+    if (!m_budget)
+        return std::numeric_limits<int64>::max();
+
+    return std::max<int64>(m_budget - m_inUseSize, 0);
+}
+
+int64 CFrameArena::GetUsage() const
+{
+    AutoLock lock(m_access);
+    return m_inUseSize + m_freeSize;
+}
+
+void CFrameArena::trim(int64 limit)
+{
+    std::map<int, std::vector<void*> >::reverse_iterator i = m_free.rbegin();
+    while ((m_freeSize > limit) && (i != m_free.rend()))
+    {
+        std::vector<void*>& blocks = i->second;
+        while ((m_freeSize > limit) && !blocks.empty())
+        {
+            _aligned_free(blocks.back());
+            blocks.pop_back();
+            m_freeSize -= i->first;
+        }
+
+        ++i;
+    }
+}
+
+int64 CFrameArena::getKeepLimit() const
+{
+    if (!m_budget)
+        return m_inUseSize;
+
+    return std::max<int64>(m_budget - m_inUseSize, 0);
+}
\ No newline at end of file
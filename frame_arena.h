@@ -0,0 +1,66 @@
+#ifndef _FRAME_ARENA_H_
+#define _FRAME_ARENA_H_
+
+#include <map>
+#include <vector>
+
+#include "chromium/base/basictypes.h"
+#include "chromium/base/lock.h"
+
+// The picture memory of every libavcodec context in the process. Blocks are
+// rounded up to size classes, eighths of a power of two, so that streams of
+// similar sizes reuse each other's blocks instead of fragmenting the heap.
+// Freed blocks are kept for reuse up to the memory still in use, or up to
+// the budget when there is one.
+//
+// The budget is not a hard limit: decoding a picture never fails on it.
+// Software streams that start without room left for their pictures decode
+// on one thread, or with fewer frame threads where libavcodec has them, see
+// CCodecContext::ApplyThreadingPolicy(). DXVA2 streams go without the
+// software fallback, see CH264DXVADecoder::GetFallbackMemory(). Lowering the
+// budget gives back the blocks kept for reuse beyond it.
+class CFrameArena
+{
+public:
+    enum { ALIGNMENT = 64 };
+
+    static int GetSizeClass(int size);
+
+    CFrameArena();
+    ~CFrameArena();
+
+    // ALIGNMENT byte aligned. NULL only when out of memory.
+    void* Alloc(int size);
+
+    // False if |block| didn't come from Alloc().
+    bool Free(void* block);
+
+    // In bytes; 0 for no budget. Lowering it gives back the blocks kept for
+    // reuse that no longer fit.
+    void SetBudget(int64 budget);
+    int64 GetBudget() const;
+
+    // What is left of the budget after the blocks in use. The maximum int64
+    // without a budget.
+    int64 GetHeadroom() const;
+
+    // The blocks in use and those kept for reuse.
+    int64 GetUsage() const;
+
+private:
+    // Gives back kept blocks, the largest first, until no more than |limit|
+    // bytes are kept.
+    void trim(int64 limit);
+    int64 getKeepLimit() const;
+
+    mutable Lock m_access;
+    std::map<void*, int> m_inUse;   // Block to size class
+    std::map<int, std::vector<void*> > m_free;
+    int64 m_inUseSize;
+    int64 m_freeSize;
+    int64 m_budget;
+
+    DISALLOW_COPY_AND_ASSIGN(CFrameArena);
+};
+
+#endif  // _FRAME_ARENA_H_
\ No newline at end of file
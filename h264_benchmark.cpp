@@ -0,0 +1,817 @@
+// Standalone micro benchmarks for the decoder hot paths. Runs without a
+// DirectShow graph.
+//
+//   h264_benchmark scan [-nal <1|2|4>] [-loops <n>] <dump> [<dump> ...]
+//   h264_benchmark decode [-nal <1|2|4>] [-threads <n,n,...>] [-out <csp>]
+//                  <dump> [<dump> ...]
+//   h264_benchmark corpus [-save <file>] [-compare <file>] <directory>
+//
+// The dumps are raw access units, either Annex B (00 00 01 start codes) or
+// AVC1 (length prefixed, the prefix size given with -nal). The output color
+// space is one of yv12 (default), nv12 and yuy2.
+//
+// decode runs every dump through CCodecContext::Decode() and
+// CSWScale::Convert() once per thread count, as fast as they go, and through
+// the parsing the DXVA decoders do before they talk to the accelerator. The
+// accelerator itself needs a renderer pin, so it isn't part of this.
+//
+// corpus decodes the clips of a fixed list from |directory|. -save writes the
+// frame counts, output checksums and frame rates to a file that a later
+// -compare checks against; a changed checksum or a frame rate more than 10%
+// lower is reported and makes the exit code 1.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <initguid.h>
+#include <streams.h>
+#include <dvdmedia.h>
+#include <dxva.h>
+#include <psapi.h>
+
+#include "ffmpeg.h"
+#include "h264_nalu.h"
+#include "chromium/base/basictypes.h"
+#include "common/guid_def.h"
+#include "common/hardware_env.h"
+
+#pragma comment(lib, "psapi.lib")
+
+using std::string;
+using std::vector;
+using boost::shared_ptr;
+
+namespace
+{
+const int scanPadding = 32;
+
+struct TScanner
+{
+    const char* Name;
+    CH264NALU::FindStartcodeFunc Find;
+    int RequiredFeature;
+};
+
+const TScanner scanners[] =
+{
+    { "C", CH264NALU::FindStartcodeC, 0 },
+    { "SSE2", CH264NALU::FindStartcodeSSE2,
+      CHardwareEnv::PROCESSOR_FEATURE_SSE2 },
+    { "SSSE3", CH264NALU::FindStartcodeSSSE3,
+      CHardwareEnv::PROCESSOR_FEATURE_SSSE3 },
+};
+
+double getSeconds()
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return static_cast<double>(counter.QuadPart) / frequency.QuadPart;
+}
+
+bool loadFile(const char* path, vector<BYTE>* data)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data->assign(size + scanPadding, 0);
+    const bool ok = (fread(&(*data)[0], 1, size, f) == static_cast<size_t>(size));
+    fclose(f);
+    data->resize(size);
+    return ok;
+}
+
+int countNALUnits(const vector<BYTE>& data, int NALSize,
+                  CH264NALU::FindStartcodeFunc find)
+{
+    CH264NALU block;
+    block.SetFindStartcode(find);
+    block.SetBuffer(&data[0], static_cast<int>(data.size()), NALSize);
+
+    int count = 0;
+    while (block.ReadNext())
+        count++;
+
+    return count;
+}
+
+//------------------------------------------------------------------------------
+// Decode benchmark.
+const int64 frameDuration = 400000; // 25 fps, in 100 ns units
+const int maxDrainCalls = 64;
+
+struct TAccessUnit
+{
+    int Offset;
+    int Size;
+};
+
+struct TClip
+{
+    vector<BYTE> Data;
+    int NALSize;
+    vector<TAccessUnit> Units;
+
+    // SPS and PPS with 16 bit length prefixes, the MPEG2VIDEOINFO layout of
+    // AVC1.
+    vector<BYTE> ParameterSets;
+};
+
+struct TStageSamples
+{
+    vector<double> Times;    // In us
+
+    void Add(double begin, double end) { Times.push_back((end - begin) * 1e6); }
+    double GetPercentile(int percent)
+    {
+        if (Times.empty())
+            return 0.0;
+
+        const int index = std::min(
+            static_cast<int>(Times.size()) - 1,
+            static_cast<int>(Times.size()) * percent / 100);
+        std::nth_element(Times.begin(), Times.begin() + index, Times.end());
+        return Times[index];
+    }
+};
+
+struct TDecodeResult
+{
+    int Frames;
+    double Elapsed;
+    uint32 Checksum;
+    TStageSamples Decode;
+    TStageSamples Convert;
+};
+
+struct TOutputFormat
+{
+    const char* Name;
+    const GUID* SubType;
+    DWORD FourCC;
+    int BitCount;
+};
+
+const TOutputFormat outputFormats[] =
+{
+    { "yv12", &MEDIASUBTYPE_YV12, MAKEFOURCC('Y', 'V', '1', '2'), 12 },
+    { "nv12", &MEDIASUBTYPE_NV12, MAKEFOURCC('N', 'V', '1', '2'), 12 },
+    { "yuy2", &MEDIASUBTYPE_YUY2, MAKEFOURCC('Y', 'U', 'Y', '2'), 16 },
+};
+
+// The corpus covers the entropy coders, both kinds of interlacing, pictures
+// cut in many slices and long reference lists.
+struct TCorpusClip
+{
+    const char* FileName;
+    int NALSize;
+    const char* Description;
+};
+
+const TCorpusClip corpus[] =
+{
+    { "cavlc_main.264", 0, "CAVLC, progressive" },
+    { "cabac_high.264", 0, "CABAC, 8x8 transform, scaling lists" },
+    { "paff.264", 0, "Field pictures" },
+    { "mbaff.264", 0, "MBAFF frames" },
+    { "many_slices.264", 0, "32 slices per picture" },
+    { "high_ref.264", 0, "16 reference frames, level 5.1" },
+    { "cabac_avc1.avc", 4, "AVC1 samples, 4 byte lengths" },
+};
+
+// Slices have first_mb_in_slice as the first syntax element, so a 1 bit
+// right after the NAL header means it is 0.
+bool isFirstSlice(CH264NALU* unit)
+{
+    return (unit->GetDataLength() > 1) && (unit->GetDataBuffer()[1] & 0x80);
+}
+
+bool isSlice(KNALUType type)
+{
+    return (NALU_TYPE_SLICE == type) || (NALU_TYPE_IDR == type);
+}
+
+void addParameterSet(CH264NALU* unit, vector<BYTE>* parameterSets)
+{
+    const int size = unit->GetDataLength();
+    parameterSets->push_back(static_cast<BYTE>(size >> 8));
+    parameterSets->push_back(static_cast<BYTE>(size));
+    parameterSets->insert(parameterSets->end(), unit->GetDataBuffer(),
+                          unit->GetDataBuffer() + size);
+}
+
+// Cuts the dump where a new access unit starts: at an AUD, SEI, SPS or PPS,
+// or at the first slice of a picture, once the current unit has a slice.
+void splitAccessUnits(TClip* clip)
+{
+    CH264NALU unit;
+    unit.SetBuffer(&clip->Data[0], static_cast<int>(clip->Data.size()),
+                   clip->NALSize);
+
+    bool hasSPS = false;
+    bool hasPPS = false;
+    bool hasSlice = false;
+    int begin = 0;
+    while (unit.ReadNext())
+    {
+        const KNALUType type = unit.GetType();
+        const bool startsUnit = ((type >= NALU_TYPE_SEI) &&
+            (type <= NALU_TYPE_AUD)) || (isSlice(type) && isFirstSlice(&unit));
+        if (startsUnit && hasSlice)
+        {
+            TAccessUnit accessUnit = { begin, unit.GetNALPos() - begin };
+            clip->Units.push_back(accessUnit);
+            begin = unit.GetNALPos();
+            hasSlice = false;
+        }
+
+        hasSlice |= isSlice(type);
+        if (clip->NALSize && (NALU_TYPE_SPS == type) && !hasSPS)
+        {
+            addParameterSet(&unit, &clip->ParameterSets);
+            hasSPS = true;
+        }
+        else if (clip->NALSize && (NALU_TYPE_PPS == type) && !hasPPS)
+        {
+            addParameterSet(&unit, &clip->ParameterSets);
+            hasPPS = true;
+        }
+    }
+
+    const int end = static_cast<int>(clip->Data.size());
+    if (end > begin)
+    {
+        TAccessUnit accessUnit = { begin, end - begin };
+        clip->Units.push_back(accessUnit);
+    }
+}
+
+bool loadClip(const char* path, int NALSize, TClip* clip)
+{
+    clip->NALSize = NALSize;
+    if (!loadFile(path, &clip->Data) || clip->Data.empty())
+        return false;
+
+    splitAccessUnits(clip);
+    return !clip->Units.empty();
+}
+
+// What a splitter would connect with: MPEG2VIDEOINFO, with the parameter sets
+// and NAL length size for AVC1.
+void buildInputType(const TClip& clip, CMediaType* mediaType)
+{
+    const int sequenceSize = static_cast<int>(clip.ParameterSets.size());
+    MPEG2VIDEOINFO* info = reinterpret_cast<MPEG2VIDEOINFO*>(
+        mediaType->AllocFormatBuffer(
+            FIELD_OFFSET(MPEG2VIDEOINFO, dwSequenceHeader) + sequenceSize));
+    memset(info, 0, mediaType->FormatLength());
+    info->hdr.AvgTimePerFrame = frameDuration;
+    info->hdr.bmiHeader.biSize = sizeof(info->hdr.bmiHeader);
+    info->hdr.bmiHeader.biCompression = clip.NALSize ?
+        MAKEFOURCC('a', 'v', 'c', '1') : MAKEFOURCC('H', '2', '6', '4');
+    info->dwFlags = clip.NALSize;
+    info->cbSequenceHeader = sequenceSize;
+    if (sequenceSize)
+        memcpy(info->dwSequenceHeader, &clip.ParameterSets[0], sequenceSize);
+
+    mediaType->SetType(&MEDIATYPE_Video);
+    mediaType->SetSubtype(clip.NALSize ? &MEDIASUBTYPE_AVC1 :
+                                         &MEDIASUBTYPE_H264);
+    mediaType->SetFormatType(&FORMAT_MPEG2Video);
+}
+
+// A committed one-buffer allocator whose sample carries the output type, the
+// way CSWScale::Init() finds it on a sample from the renderer.
+class COutputSample
+{
+public:
+    COutputSample() : m_allocator(NULL), m_sample(NULL), m_size(0) {}
+    ~COutputSample() { reset(); }
+
+    bool Init(const TOutputFormat& format, int width, int height)
+    {
+        reset();
+        CMediaType outType;
+        VIDEOINFOHEADER* info = reinterpret_cast<VIDEOINFOHEADER*>(
+            outType.AllocFormatBuffer(sizeof(VIDEOINFOHEADER)));
+        memset(info, 0, sizeof(*info));
+        info->AvgTimePerFrame = frameDuration;
+        info->bmiHeader.biSize = sizeof(info->bmiHeader);
+        info->bmiHeader.biWidth = width;
+        info->bmiHeader.biHeight = height;
+        info->bmiHeader.biPlanes = 1;
+        info->bmiHeader.biBitCount = static_cast<WORD>(format.BitCount);
+        info->bmiHeader.biCompression = format.FourCC;
+        info->bmiHeader.biSizeImage = width * height * format.BitCount / 8;
+        outType.SetType(&MEDIATYPE_Video);
+        outType.SetSubtype(format.SubType);
+        outType.SetFormatType(&FORMAT_VideoInfo);
+        outType.SetSampleSize(info->bmiHeader.biSizeImage);
+
+        HRESULT r = S_OK;
+        m_allocator = new CMemAllocator(L"Benchmark", NULL, &r);
+        m_allocator->AddRef();
+        ALLOCATOR_PROPERTIES request = { 1, info->bmiHeader.biSizeImage, 16,
+                                         0 };
+        ALLOCATOR_PROPERTIES actual;
+        if (FAILED(r) ||
+            FAILED(m_allocator->SetProperties(&request, &actual)) ||
+            FAILED(m_allocator->Commit()) ||
+            FAILED(m_allocator->GetBuffer(&m_sample, NULL, NULL, 0)))
+            return false;
+
+        m_size = info->bmiHeader.biSizeImage;
+        return SUCCEEDED(m_sample->SetMediaType(&outType));
+    }
+
+    IMediaSample* Get() { return m_sample; }
+    int GetSize() const { return m_size; }
+
+private:
+    void reset()
+    {
+        if (m_sample)
+        {
+            m_sample->Release();
+            m_sample = NULL;
+        }
+
+        if (m_allocator)
+        {
+            m_allocator->Decommit();
+            m_allocator->Release();
+            m_allocator = NULL;
+        }
+    }
+
+    CMemAllocator* m_allocator;
+    IMediaSample* m_sample;
+    int m_size;
+};
+
+// FNV-1a over the converted pictures.
+uint32 updateChecksum(uint32 checksum, const BYTE* data, int size)
+{
+    for (int i = 0; i < size; ++i)
+        checksum = (checksum ^ data[i]) * 16777619U;
+
+    return checksum;
+}
+
+bool decodeClip(const TClip& clip, int threads, const TOutputFormat& format,
+                bool checksum, TDecodeResult* result)
+{
+    CMediaType inputType;
+    buildInputType(clip, &inputType);
+    shared_ptr<CCodecContext> codec = CFFMPEG::get()->CreateCodec(inputType);
+    if (!codec)
+        return false;
+
+    TThreadingPolicy policy = codec->GetThreadingPolicy();
+    if (threads)
+    {
+        policy.MaxThreads = threads;
+        policy.SliceThreads = (threads > 1);
+        policy.FrameThreads = policy.FrameThreads && (threads > 1);
+        codec->SetThreadingPolicy(policy);
+    }
+    codec->ApplyThreadingPolicy();
+
+    const int padding = CFFMPEG::GetInputBufferPaddingSize();
+    vector<BYTE> input;
+    CVideoFrame frame;
+    CSWScale scale;
+    COutputSample output;
+    bool outputReady = false;
+    result->Frames = 0;
+    result->Checksum = 2166136261U;
+
+    const double begin = getSeconds();
+    const int unitCount = static_cast<int>(clip.Units.size());
+    for (int i = 0; i < unitCount + maxDrainCalls; ++i)
+    {
+        // Past the end, empty packets take out the pictures libavcodec still
+        // holds for reordering.
+        const bool draining = (i >= unitCount);
+        const int size = draining ? 0 : clip.Units[i].Size;
+        input.assign(size + padding, 0);
+        if (size)
+            memcpy(&input[0], &clip.Data[clip.Units[i].Offset], size);
+
+        codec->UpdateTime(i * frameDuration, (i + 1) * frameDuration);
+        const double decodeBegin = getSeconds();
+        codec->Decode(&frame, &input[0], size);
+        result->Decode.Add(decodeBegin, getSeconds());
+        if (!frame.IsComplete())
+        {
+            if (draining)
+                break;
+
+            continue;
+        }
+
+        if (!outputReady)
+        {
+            outputReady = output.Init(format, codec->GetWidth(),
+                                      codec->GetHeight()) &&
+                scale.Init(*codec, output.Get());
+            if (!outputReady)
+                return false;
+        }
+
+        BYTE* buf;
+        output.Get()->GetPointer(&buf);
+        const double convertBegin = getSeconds();
+        if (!scale.Convert(frame, buf))
+            return false;
+
+        result->Convert.Add(convertBegin, getSeconds());
+        result->Frames++;
+        if (checksum)
+        {
+            result->Checksum =
+                updateChecksum(result->Checksum, buf, output.GetSize());
+        }
+    }
+
+    result->Elapsed = getSeconds() - begin;
+    return true;
+}
+
+// The CPU side of the DXVA decoders: libavcodec parses every access unit,
+// filling the long slice controls, without decoding the pictures.
+bool parseClip(const TClip& clip, TStageSamples* samples, double* elapsed)
+{
+    CMediaType inputType;
+    buildInputType(clip, &inputType);
+    shared_ptr<CCodecContext> codec = CFFMPEG::get()->CreateCodec(inputType);
+    if (!codec)
+        return false;
+
+    const int padding = CFFMPEG::GetInputBufferPaddingSize();
+    vector<BYTE> input;
+    CH264NALIndex index;
+    vector<DXVA_Slice_H264_Long> slices;
+    const double begin = getSeconds();
+    for (int i = 0; i < static_cast<int>(clip.Units.size()); ++i)
+    {
+        const int size = clip.Units[i].Size;
+        input.assign(size + padding, 0);
+        memcpy(&input[0], &clip.Data[clip.Units[i].Offset], size);
+
+        const double parseBegin = getSeconds();
+        index.Build(&input[0], size, clip.NALSize);
+        if (static_cast<int>(slices.size()) < index.GetSliceCount())
+        {
+            DXVA_Slice_H264_Long emptySlice = {0};
+            slices.resize(index.GetSliceCount(), emptySlice);
+            codec->SetSliceLong(&slices[0]);
+        }
+
+        int framePOC;
+        int outPOC;
+        int64 startTime;
+        codec->UpdateTime(i * frameDuration, (i + 1) * frameDuration);
+        codec->PreDecodeBuffer(&input[0], size, &framePOC, &outPOC,
+                               &startTime);
+        samples->Add(parseBegin, getSeconds());
+    }
+
+    *elapsed = getSeconds() - begin;
+    return true;
+}
+
+void printStage(const char* name, TStageSamples* samples)
+{
+    printf("    %-8s p50 %8.0f  p90 %8.0f  p99 %8.0f  max %8.0f us\n", name,
+           samples->GetPercentile(50), samples->GetPercentile(90),
+           samples->GetPercentile(99), samples->GetPercentile(100));
+}
+
+void printPeakMemory()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                             sizeof(counters)))
+    {
+        printf("  peak working set %.1f MB, peak private %.1f MB\n",
+               counters.PeakWorkingSetSize / 1048576.0,
+               counters.PeakPagefileUsage / 1048576.0);
+    }
+}
+
+const TOutputFormat* findOutputFormat(const char* name)
+{
+    for (int i = 0; i < arraysize(outputFormats); ++i)
+        if (!strcmp(outputFormats[i].Name, name))
+            return &outputFormats[i];
+
+    return NULL;
+}
+
+// "1,2,4" into a list; by default 1 and then doubling up to the number of
+// logical processors.
+vector<int> parseThreadCounts(const char* list)
+{
+    vector<int> counts;
+    for (const char* p = list; p && *p; )
+    {
+        const int n = atoi(p);
+        if (n > 0)
+            counts.push_back(n);
+
+        p = strchr(p, ',');
+        if (p)
+            p++;
+    }
+
+    if (counts.empty())
+    {
+        const int processors =
+            CHardwareEnv::get()->GetNumOfLogicalProcessors();
+        for (int n = 1; n < processors; n *= 2)
+            counts.push_back(n);
+
+        counts.push_back(processors);
+    }
+
+    return counts;
+}
+
+int runDecode(int argc, char** argv)
+{
+    int NALSize = 0;
+    const char* threadList = NULL;
+    const TOutputFormat* format = &outputFormats[0];
+    vector<const char*> files;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-nal") && (i + 1 < argc))
+            NALSize = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-threads") && (i + 1 < argc))
+            threadList = argv[++i];
+        else if (!strcmp(argv[i], "-out") && (i + 1 < argc))
+            format = findOutputFormat(argv[++i]);
+        else
+            files.push_back(argv[i]);
+    }
+
+    if (files.empty() || !format)
+        return 1;
+
+    const vector<int> threadCounts = parseThreadCounts(threadList);
+    for (int i = 0; i < static_cast<int>(files.size()); ++i)
+    {
+        TClip clip;
+        if (!loadClip(files[i], NALSize, &clip))
+        {
+            printf("%s: cannot read\n", files[i]);
+            continue;
+        }
+
+        printf("%s (%s, %d access units)\n", files[i],
+               NALSize ? "AVC1" : "Annex B",
+               static_cast<int>(clip.Units.size()));
+
+        TStageSamples parse;
+        double parseTime;
+        if (parseClip(clip, &parse, &parseTime))
+        {
+            printf("  DXVA parse %9.1f fps\n",
+                   clip.Units.size() / parseTime);
+            printStage("parse", &parse);
+        }
+
+        double baseline = 0.0;
+        for (int j = 0; j < static_cast<int>(threadCounts.size()); ++j)
+        {
+            TDecodeResult result;
+            if (!decodeClip(clip, threadCounts[j], *format, false, &result))
+            {
+                printf("  %2d threads: decoding failed\n", threadCounts[j]);
+                break;
+            }
+
+            const double fps = result.Frames / result.Elapsed;
+            if (!j)
+                baseline = fps;
+
+            printf("  %2d threads %9.1f fps  x%.2f  (%d frames)\n",
+                   threadCounts[j], fps, fps / baseline, result.Frames);
+            printStage("decode", &result.Decode);
+            printStage("convert", &result.Convert);
+        }
+
+        printPeakMemory();
+    }
+
+    return 0;
+}
+
+struct TBaseline
+{
+    string FileName;
+    int Frames;
+    uint32 Checksum;
+    double FPS;
+};
+
+vector<TBaseline> loadBaselines(const char* path)
+{
+    vector<TBaseline> baselines;
+    FILE* f = path ? fopen(path, "r") : NULL;
+    if (!f)
+        return baselines;
+
+    char name[MAX_PATH];
+    TBaseline b;
+    while (fscanf(f, "%259s %d %x %lf", name, &b.Frames, &b.Checksum,
+                  &b.FPS) == 4)
+    {
+        b.FileName = name;
+        baselines.push_back(b);
+    }
+
+    fclose(f);
+    return baselines;
+}
+
+const TBaseline* findBaseline(const vector<TBaseline>& baselines,
+                              const char* fileName)
+{
+    for (int i = 0; i < static_cast<int>(baselines.size()); ++i)
+        if (baselines[i].FileName == fileName)
+            return &baselines[i];
+
+    return NULL;
+}
+
+int runCorpus(int argc, char** argv)
+{
+    const char* savePath = NULL;
+    const char* comparePath = NULL;
+    const char* directory = NULL;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-save") && (i + 1 < argc))
+            savePath = argv[++i];
+        else if (!strcmp(argv[i], "-compare") && (i + 1 < argc))
+            comparePath = argv[++i];
+        else
+            directory = argv[i];
+    }
+
+    if (!directory)
+        return 1;
+
+    const vector<TBaseline> baselines = loadBaselines(comparePath);
+    if (comparePath && baselines.empty())
+    {
+        printf("%s: no baselines\n", comparePath);
+        return 1;
+    }
+
+    FILE* saveFile = savePath ? fopen(savePath, "w") : NULL;
+    if (savePath && !saveFile)
+    {
+        printf("%s: cannot write\n", savePath);
+        return 1;
+    }
+
+    bool regressed = false;
+    for (int i = 0; i < arraysize(corpus); ++i)
+    {
+        const string path = string(directory) + "\\" + corpus[i].FileName;
+        TClip clip;
+        TDecodeResult result;
+        if (!loadClip(path.c_str(), corpus[i].NALSize, &clip) ||
+            !decodeClip(clip, 0, outputFormats[0], true, &result))
+        {
+            printf("%-16s FAILED  (%s)\n", corpus[i].FileName,
+                   corpus[i].Description);
+            regressed = true;
+            continue;
+        }
+
+        const double fps = result.Frames / result.Elapsed;
+        printf("%-16s %5d frames %9.1f fps  %08x  (%s)", corpus[i].FileName,
+               result.Frames, fps, result.Checksum, corpus[i].Description);
+        if (saveFile)
+        {
+            fprintf(saveFile, "%s %d %08x %.1f\n", corpus[i].FileName,
+                    result.Frames, result.Checksum, fps);
+        }
+
+        const TBaseline* b = findBaseline(baselines, corpus[i].FileName);
+        if (b && ((b->Frames != result.Frames) ||
+                  (b->Checksum != result.Checksum)))
+        {
+            printf("  MISMATCH");
+            regressed = true;
+        }
+        else if (b && (fps < b->FPS * 0.9))
+        {
+            printf("  SLOWER (%.1f fps before)", b->FPS);
+            regressed = true;
+        }
+        printf("\n");
+    }
+
+    if (saveFile)
+        fclose(saveFile);
+
+    printPeakMemory();
+    return regressed ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------
+int runScan(int argc, char** argv)
+{
+    int NALSize = 0;
+    int loops = 100;
+    vector<const char*> files;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-nal") && (i + 1 < argc))
+            NALSize = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-loops") && (i + 1 < argc))
+            loops = std::max(1, atoi(argv[++i]));
+        else
+            files.push_back(argv[i]);
+    }
+
+    if (files.empty())
+        return 1;
+
+    for (int i = 0; i < static_cast<int>(files.size()); ++i)
+    {
+        vector<BYTE> data;
+        if (!loadFile(files[i], &data) || data.empty())
+        {
+            printf("%s: cannot read\n", files[i]);
+            continue;
+        }
+
+        printf("%s (%s, %d bytes)\n", files[i], NALSize ? "AVC1" : "Annex B",
+               static_cast<int>(data.size()));
+
+        const int expected =
+            countNALUnits(data, NALSize, CH264NALU::FindStartcodeC);
+        const int features = CHardwareEnv::get()->GetProcessorFeatures();
+        double baseline = 0.0;
+        for (int j = 0; j < arraysize(scanners); ++j)
+        {
+            if ((features & scanners[j].RequiredFeature) !=
+                scanners[j].RequiredFeature)
+                continue;
+
+            int count = countNALUnits(data, NALSize, scanners[j].Find);
+            const double begin = getSeconds();
+            for (int k = 0; k < loops; ++k)
+                count = countNALUnits(data, NALSize, scanners[j].Find);
+
+            const double elapsed = getSeconds() - begin;
+            if (!j)
+                baseline = elapsed;
+
+            printf("  %-6s %5d NALUs %9.1f MB/s  x%.2f%s\n", scanners[j].Name,
+                   count, data.size() * loops / elapsed / 1048576.0,
+                   baseline / elapsed,
+                   (count != expected) ? "  MISMATCH" : "");
+        }
+    }
+
+    return 0;
+}
+}
+
+int main(int argc, char** argv)
+{
+    if ((argc >= 2) && !strcmp(argv[1], "scan"))
+        return runScan(argc - 2, argv + 2);
+
+    if ((argc >= 2) && !strcmp(argv[1], "decode"))
+        return runDecode(argc - 2, argv + 2);
+
+    if ((argc >= 2) && !strcmp(argv[1], "corpus"))
+        return runCorpus(argc - 2, argv + 2);
+
+    printf("usage: h264_benchmark scan [-nal <1|2|4>] [-loops <n>] "
+           "<dump> [<dump> ...]\n"
+           "       h264_benchmark decode [-nal <1|2|4>] "
+           "[-threads <n,n,...>] [-out <yv12|nv12|yuy2>] "
+           "<dump> [<dump> ...]\n"
+           "       h264_benchmark corpus [-save <file>] [-compare <file>] "
+           "<directory>\n");
+    return 1;
+}
\ No newline at end of file
@@ -1,16 +1,27 @@
 #include "h264_decoder.h"
 
+#include <algorithm>
 #include <limits>
 
 #include <initguid.h>
+#include <evr.h>
+#include <emmintrin.h>
+#include <mmsystem.h>
 
+#include "decoder_stats.h"
+#include "decoder_trace.h"
 #include "ffmpeg.h"
+#include "frame_arena.h"
 #include "h264_detail.h"
+#include "h264_nalu.h"
 #include "common/hardware_env.h"
 #include "common/debug_util.h"
+#include "common/dshow_util.h"
 #include "common/intrusive_ptr_helper.h"
 #include "chromium/base/platform_thread.h"
 
+#pragma comment(lib, "winmm.lib")
+
 using std::vector;
 using boost::shared_ptr;
 using boost::intrusive_ptr;
@@ -18,156 +29,221 @@ using boost::intrusive_ptr;
 namespace
 {
 const int compBufferCount = 18;
-const int maxSlices = 16;
-
-#define TRY_EXECUTE(x)\
-{\
-    const int maxRetry = 50;\
-    int retry = 0;\
-    do\
-    {\
-        r = x;\
-        if ((SUCCEEDED(r)) || (r != E_PENDING))\
-             break;\
-\
-        PlatformThread::YieldCurrentThread();\
-    } while (++retry < maxRetry);\
-}
-}
-
-enum KNALUType
-{
-    NALU_TYPE_SLICE = 1,
-    NALU_TYPE_DPA = 2,
-    NALU_TYPE_DPB = 3,
-    NALU_TYPE_DPC = 4,
-    NALU_TYPE_IDR = 5,
-    NALU_TYPE_SEI = 6,
-    NALU_TYPE_SPS = 7,
-    NALU_TYPE_PPS = 8,
-    NALU_TYPE_AUD = 9,
-    NALU_TYPE_EOSEQ = 10,
-    NALU_TYPE_EOSTREAM = 11,
-    NALU_TYPE_FILL = 12
-};
 
-class CH264NALU
-{
-public:
-    KNALUType GetType() const { return unitType; };
-    bool IsRefFrame() const { return (referenceIdc != 0); };
+// Buffers that go into one execution: the picture parameters, the
+// bitstream, the slice control and the quantization matrix, with room to
+// spare.
+const int maxExecBuffers = 8;
+const int initialSlices = 16;
 
-    int GetDataLength() const { return m_curPos - m_dataPos; };
-    const BYTE* GetDataBuffer() { return m_buffer + m_dataPos; };
-    int GetRoundedDataLength() const
-    {
-        int size = m_curPos - m_dataPos;
-        return size + 128 - (size % 128);
-    }
+// Slots are tracked in 32 bit masks, indexed by the frame number libavcodec
+// tags the pictures with.
+const int maxPictureSlots = 32;
 
-    int GetLength() const { return m_curPos - m_startPos; };
-    const BYTE* GetNALBuffer() { return m_buffer + m_startPos; };
-    bool IsEOF() const { return m_curPos >= m_size; };
+// Bitstream buffers are filled up to a multiple of this size.
+const int bitstreamAlignment = 128;
 
-    void SetBuffer (const void* buffer, int size, int NALSize);
-    bool ReadNext();
-    int GetRawDataSize() const { return m_size; }
-    const void* GetRawDataBuffer() const { return m_buffer; }
+// Beyond these a GOP is not kept for the software decoder, and the
+// accelerator is on its own until the next IDR picture.
+const int maxGOPUnits = 600;
+const int maxGOPSize = 16 * 1024 * 1024;
 
-private:
-    bool moveToNextStartcode();
-
-    int forbiddenBit;       // should be always FALSE
-    int referenceIdc;       // NALU_PRIORITY_xxxx
-    KNALUType unitType;     // NALU_TYPE_xxxx    
-
-    int m_startPos;         // NALU start (including startcode / size)
-    int m_dataPos;          // Useful part
-    unsigned m_dataLen;     // Length of the NAL unit (Excluding the start
-                            // code, which does not belong to the NALU)
-
-    const BYTE* m_buffer;
-    int m_curPos;
-    int m_nextRTP;
-    int m_size;
-    int m_NALSize;
-};
+bool hasAnnexBStartcode(const CH264NALIndex::TNALUnitDesc& unit,
+                        const BYTE* NALStart)
+{
+    return ((unit.DataPos - unit.NALPos) == 3) && !NALStart[0] &&
+        !NALStart[1] && (1 == NALStart[2]);
+}
+
+// What the trace events of a picture carry.
+int getCurrentPOC(const DXVA_PicParams_H264& picParams)
+{
+    return picParams.CurrFieldOrderCnt[picParams.CurrPic.AssociatedFlag];
+}
+
+int getExecuteSize(const DXVA_BufferDescription* desc, int count)
+{
+    int size = 0;
+    for (int i = 0; i < count; ++i)
+        size += desc[i].dwDataSize;
+
+    return size;
+}
 
-void CH264NALU::SetBuffer(const void* buffer, int size, int NALSize)
+// The Direct3D surface behind a sample of the DXVA2 allocator.
+HRESULT getSampleSurface(IMediaSample* sample,
+                         intrusive_ptr<IDirect3DSurface9>* surface)
 {
-    m_buffer = reinterpret_cast<const BYTE*>(buffer);
-    m_size = size;
-    m_NALSize = NALSize;
-    m_curPos = 0;
-    m_nextRTP = 0;
+    intrusive_ptr<IMFGetService> service;
+    HRESULT r = sample->QueryInterface(__uuidof(IMFGetService),
+                                       reinterpret_cast<void**>(&service));
+    if (FAILED(r))
+        return r;
 
-    m_startPos = 0;
-    m_dataPos = 0;
+    return service->GetService(MR_BUFFER_SERVICE, __uuidof(IDirect3DSurface9),
+                               reinterpret_cast<void**>(surface));
 }
 
-bool CH264NALU::moveToNextStartcode()
+bool hasSSE2()
 {
-    int buffEnd =
-        (m_nextRTP > 0) ? std::min(m_nextRTP, m_size - 4) : m_size - 4;
+    static const bool sse2 =
+        !!(CHardwareEnv::get()->GetProcessorFeatures() &
+            CHardwareEnv::PROCESSOR_FEATURE_SSE2);
+    return sse2;
+}
 
-    for (int i = m_curPos; i < buffEnd; i++)
+// The bitstream buffers live in write-combined memory the CPU never reads
+// back, so fill them with non-temporal stores that bypass the cache.
+void streamCopy(void* dest, const void* source, int size)
+{
+    int8* d = reinterpret_cast<int8*>(dest);
+    const int8* s = reinterpret_cast<const int8*>(source);
+    const int head = (16 - (reinterpret_cast<intptr_t>(d) & 15)) & 15;
+    if (!hasSSE2() || (size < head + 64))
     {
-        if ((*(reinterpret_cast<const DWORD*>(m_buffer + i)) & 0x00FFFFFF) ==
-            0x00010000)
-        {
-            // Find next AnnexB Nal
-            m_curPos = i;
-            return true;
-        }
+        if (size > 0)
+            memcpy(d, s, size);
+
+        return;
     }
 
-    if (m_NALSize && (m_nextRTP < m_size))
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+    for (; size >= 64; size -= 64, d += 64, s += 64)
     {
-        m_curPos = m_nextRTP;
-        return true;
+        const __m128i* from = reinterpret_cast<const __m128i*>(s);
+        __m128i* to = reinterpret_cast<__m128i*>(d);
+        const __m128i a = _mm_loadu_si128(from);
+        const __m128i b = _mm_loadu_si128(from + 1);
+        const __m128i c = _mm_loadu_si128(from + 2);
+        const __m128i e = _mm_loadu_si128(from + 3);
+        _mm_stream_si128(to, a);
+        _mm_stream_si128(to + 1, b);
+        _mm_stream_si128(to + 2, c);
+        _mm_stream_si128(to + 3, e);
     }
 
-    m_curPos = m_size;
-    return false;
+    if (size)
+        memcpy(d, s, size);
 }
 
-bool CH264NALU::ReadNext()
+// Orders the streaming stores before the buffer is handed to the driver.
+void streamCopyDone()
 {
-    if (m_curPos >= m_size)
-        return false;
+    if (hasSSE2())
+        _mm_sfence();
+}
+
+int64 getMicroseconds()
+{
+    static LARGE_INTEGER frequency = {0};
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (counter.QuadPart / frequency.QuadPart) * 1000000 +
+        (counter.QuadPart % frequency.QuadPart) * 1000000 /
+            frequency.QuadPart;
+}
 
-    if (m_NALSize && (m_curPos == m_nextRTP))
+// Waits for the accelerator in three stages: yield the time slice for the
+// spin budget, then sleep with an exponentially growing interval, then give
+// up once the timeout has passed.
+class CAcceleratorWait
+{
+public:
+    explicit CAcceleratorWait(const CH264DXVADecoder::TWaitPolicy& policy)
+        : m_policy(policy)
+        , m_begin(getMicroseconds())
+        , m_spins(0)
+        , m_sleeps(0)
+        , m_backoff(1)
+        , m_timerPeriodSet(false)
     {
-        // RTP Nalu type : (XX XX) XX XX NAL..., with XX XX XX XX or XX XX equal
-        // to NAL size
-        m_startPos = m_curPos;
-        m_dataPos = m_curPos + m_NALSize;
-        int temp = 0;
-        for (int i = 0; i < m_NALSize; ++i)
-            temp = (temp << 8) + m_buffer[m_curPos++];
+    }
 
-        m_nextRTP += temp + m_NALSize;
-        moveToNextStartcode();
+    ~CAcceleratorWait()
+    {
+        endTimerPeriod();
     }
-    else
+
+    bool Spin()
+    {
+        if (m_spins >= m_policy.SpinCount)
+            return false;
+
+        m_spins++;
+        PlatformThread::YieldCurrentThread();
+        return true;
+    }
+
+    bool Sleep()
     {
-        // Remove trailing bits
-        while (!m_buffer[m_curPos] &&
-            ((*(reinterpret_cast<const DWORD*>(m_buffer + m_curPos)) &
-                0x00FFFFFF) != 0x00010000))
-            m_curPos++;
+        const int elapsed =
+            static_cast<int>((getMicroseconds() - m_begin) / 1000);
+        if (elapsed >= m_policy.Timeout)
+            return false;
+
+        // Lets the backoff sleeps last what they ask for instead of a whole
+        // scheduler tick. The resolution is system-wide, so it is only held
+        // while waiting.
+        if (!m_timerPeriodSet)
+        {
+            timeBeginPeriod(1);
+            m_timerPeriodSet = true;
+        }
 
-        // AnnexB Nalu : 00 00 01 NAL...
-        m_startPos = m_curPos;
-        m_curPos += 3;
-        m_dataPos = m_curPos;
-        moveToNextStartcode();
+        m_sleeps++;
+        PlatformThread::Sleep(std::min(m_backoff, m_policy.Timeout - elapsed));
+        m_backoff = std::min(m_backoff * 2, m_policy.MaxBackoff);
+        return true;
     }
 
-    forbiddenBit = (m_buffer[m_dataPos]>>7) & 1;
-    referenceIdc = (m_buffer[m_dataPos]>>5) & 3;
-    unitType = static_cast<KNALUType>(m_buffer[m_dataPos] & 0x1f);
-    return true;
+    void Finish(HRESULT r, CH264DXVADecoder::TWaitStats* stats,
+                CDecoderStats* counters)
+    {
+        assert(stats);
+        endTimerPeriod();
+        if (counters)
+            counters->AddBeginFrameWait(m_spins + m_sleeps, FAILED(r));
+
+        if (FAILED(r))
+            stats->Failed++;
+        else if (m_sleeps)
+            stats->Slept++;
+        else if (m_spins)
+            stats->Spun++;
+        else
+            stats->Immediate++;
+
+        stats->Spins += m_spins;
+        stats->Sleeps += m_sleeps;
+
+        const int64 waited = getMicroseconds() - m_begin;
+        stats->WaitTime += waited;
+        stats->MaxWaitTime = std::max(stats->MaxWaitTime, waited);
+    }
+
+private:
+    void endTimerPeriod()
+    {
+        if (m_timerPeriodSet)
+        {
+            timeEndPeriod(1);
+            m_timerPeriodSet = false;
+        }
+    }
+
+    const CH264DXVADecoder::TWaitPolicy& m_policy;
+    int64 m_begin;
+    int m_spins;
+    int m_sleeps;
+    int m_backoff;
+    bool m_timerPeriodSet;
+};
 }
 
 //------------------------------------------------------------------------------
@@ -203,6 +279,10 @@ CH264Decoder::~CH264Decoder()
 CH264Decoder::CH264Decoder(const GUID& decoderID, CCodecContext* preDecode)
     : m_decoderID(decoderID)
     , m_preDecode(preDecode)
+    , m_stats(NULL)
+    , m_skipMode(SKIP_NONE)
+    , m_deliverFrom(std::numeric_limits<int64>::min())
+    , m_degradation(DEGRADE_NONE)
     , m_flushed(false)
     , m_fieldSurface(-1)
     , m_fieldSample()
@@ -211,6 +291,12 @@ CH264Decoder::CH264Decoder(const GUID& decoderID, CCodecContext* preDecode)
     assert(preDecode);
 }
 
+void CH264Decoder::SetSkipMode(KSkipMode mode, int64 deliverFrom)
+{
+    m_skipMode = mode;
+    m_deliverFrom = deliverFrom;
+}
+
 void CH264Decoder::Flush()
 {
     m_flushed = true;
@@ -220,152 +306,334 @@ void CH264Decoder::Flush()
 }
 
 //------------------------------------------------------------------------------
+// Hands out the memory of YV12 output samples as libavcodec picture buffers.
+// A sample stays referenced for as long as libavcodec keeps the picture,
+// which can be long after it was delivered.
+class CH264SWDecoder::CSampleFrameAllocator : public CFrameBufferAllocator
+{
+public:
+    CSampleFrameAllocator(IMemAllocator* allocator, int width, int height,
+                          int stride)
+        : m_allocator(allocator)
+        , m_width(width)
+        , m_height(height)
+        , m_stride(stride)
+        , m_buffers()
+    {
+        assert(allocator);
+    }
+
+    virtual bool AllocFrameBuffer(int width, int height, TFrameBuffer* buffer)
+    {
+        if ((width != m_width) || (height != m_height))
+            return false;
+
+        const int lumaSize = m_stride * m_height;
+        intrusive_ptr<IMediaSample> sample = getSample();
+        BYTE* data;
+        if (sample && SUCCEEDED(sample->GetPointer(&data)))
+        {
+            sample->SetActualDataLength(lumaSize * 3 / 2);
+        }
+        else
+        {
+            // libavcodec refuses a stride change in the middle of a stream,
+            // so the pictures that don't get a sample still have the layout
+            // of one. They go out through a conversion instead.
+            sample = NULL;
+            data = reinterpret_cast<BYTE*>(
+                CFFMPEG::get()->GetFrameArena()->Alloc(
+                    lumaSize * 3 / 2 + CFrameArena::ALIGNMENT));
+            if (!data)
+                return false;
+        }
+
+        // YV12 stores the Cr plane before the Cb plane.
+        buffer->Plane[0] = data;
+        buffer->Plane[1] = data + lumaSize + lumaSize / 4;
+        buffer->Plane[2] = data + lumaSize;
+        buffer->Stride[0] = m_stride;
+        buffer->Stride[1] = m_stride / 2;
+        buffer->Stride[2] = m_stride / 2;
+        m_buffers.push_back(TBuffer(data, sample));
+        return true;
+    }
+
+    virtual void ReleaseFrameBuffer(const void* plane)
+    {
+        for (int i = 0; i < static_cast<int>(m_buffers.size()); ++i)
+        {
+            if (m_buffers[i].first == plane)
+            {
+                if (!m_buffers[i].second)
+                    CFFMPEG::get()->GetFrameArena()->Free(
+                        const_cast<void*>(plane));
+
+                m_buffers[i] = m_buffers.back();
+                m_buffers.pop_back();
+                return;
+            }
+        }
+
+        assert(false);
+    }
+
+    IMediaSample* Find(const void* plane) const
+    {
+        for (int i = 0; i < static_cast<int>(m_buffers.size()); ++i)
+            if (m_buffers[i].first == plane)
+                return m_buffers[i].second.get();
+
+        return NULL;
+    }
+
+private:
+    typedef std::pair<const void*, intrusive_ptr<IMediaSample> > TBuffer;
+
+    // A sample the picture can be decoded into, or NULL.
+    intrusive_ptr<IMediaSample> getSample()
+    {
+        // Never wait: the samples held as reference pictures may be all the
+        // allocator has.
+        intrusive_ptr<IMediaSample> sample;
+        HRESULT r = m_allocator->GetBuffer(
+            reinterpret_cast<IMediaSample**>(&sample), NULL, NULL,
+            AM_GBF_NOWAIT);
+        if (FAILED(r))
+            return NULL;
+
+        // A format change attached to the sample may move the planes.
+        AM_MEDIA_TYPE* mediaType = NULL;
+        if (S_OK == sample->GetMediaType(&mediaType))
+        {
+            DeleteMediaType(mediaType);
+            return NULL;
+        }
+
+        BYTE* data;
+        r = sample->GetPointer(&data);
+        if (FAILED(r) || (reinterpret_cast<intptr_t>(data) & 15) ||
+            (sample->GetSize() < m_stride * m_height * 3 / 2))
+            return NULL;
+
+        return sample;
+    }
+
+    intrusive_ptr<IMemAllocator> m_allocator;
+    int m_width;
+    int m_height;
+    int m_stride;
+    std::vector<TBuffer> m_buffers;
+};
+
 CH264SWDecoder::CH264SWDecoder(CCodecContext* preDecode)
     : CH264Decoder(GUID_NULL, preDecode)
     , m_frame(new CVideoFrame)
     , m_scale(new CSWScale)
+    , m_directRender()
 {
 }
 
 CH264SWDecoder::~CH264SWDecoder()
 {
+    SetDirectRender(NULL, NULL);
 }
 
 bool CH264SWDecoder::Init(const DDPIXELFORMAT& pixelFormat,
                           int64 averageTimePerFrame)
 {
-    getPreDecode()->SetThreadNumber(
-        CHardwareEnv::get()->GetNumOfLogicalProcessors());
+    getPreDecode()->ApplyThreadingPolicy();
     return true;
 }
 
 HRESULT CH264SWDecoder::Decode(const void* data, int size, int64 start,
-                               int64 stop, IMediaSample* outSample,
-                               int* bytesUsed)
+                               int64 stop, int* bytesUsed)
 {
-    if (!m_scale->Init(*getPreDecode(), outSample))
-        return E_FAIL;
+    assert(bytesUsed);
+    int usedBytes;
+    {
+        CStageTimer timer(getStats(), H264_STAGE_PRE_DECODE);
+        CTraceScope trace(H264_TRACE_PRE_DECODE, -1, -1, -1, size);
+        usedBytes = getPreDecode()->Decode(m_frame.get(), data, size);
+    }
+    if (usedBytes < 0)
+        return S_FALSE;
 
-    int usedBytes = getPreDecode()->Decode(m_frame.get(), data, size);
-    if (!m_frame->IsComplete()) // Not enough data to build a frame.
-        return S_OK;
+    if (getStats() && m_frame->IsComplete())
+        getStats()->AddDecoded();
+
+    int64 frameStart;
+    if (m_frame->IsComplete() && m_frame->GetTime(&frameStart, NULL) &&
+        isBeforeDeliveryStart(frameStart))
+        m_frame->SetComplete(false);
+
+    // Saves the conversion and the delivery.
+    if (m_frame->IsComplete() && !m_frame->IsReference() &&
+        (getDegradation() >= DEGRADE_SKIP_CONVERT))
+    {
+        m_frame->SetComplete(false);
+        if (getStats())
+            getStats()->AddDropped();
+    }
+
+    *bytesUsed = usedBytes;
+    return S_OK;
+}
+
+bool CH264SWDecoder::IsFrameReady() const
+{
+    return m_frame->IsComplete();
+}
+
+HRESULT CH264SWDecoder::DisplayNextFrame(IMediaSample* sample)
+{
+    if (!m_frame->IsComplete())
+        return S_FALSE;
+
+    if (!m_scale->Init(*getPreDecode(), sample))
+        return E_FAIL;
 
     BYTE* buf;
-    HRESULT r = outSample->GetPointer(&buf);
+    HRESULT r = sample->GetPointer(&buf);
     if (FAILED(r))
         return r;
 
     if (!m_scale->Convert(*m_frame, buf))
         return E_FAIL;
 
-    *bytesUsed = usedBytes;
+    m_frame->SetComplete(false);
     return S_OK;
 }
 
-//------------------------------------------------------------------------------
-CH264DXVA1Decoder::CDXVABuffers::CDXVABuffers(IAMVideoAccelerator* accel)
-    : m_bufInfo()
-    , m_bufDesc()
-    , m_accel(accel)
+void CH264SWDecoder::SetSkipMode(KSkipMode mode, int64 deliverFrom)
 {
-    assert(accel);
+    CH264Decoder::SetSkipMode(mode, deliverFrom);
+    applySkipLevels();
 }
 
-CH264DXVA1Decoder::CDXVABuffers::~CDXVABuffers()
+void CH264SWDecoder::SetDegradation(KDegradation level)
 {
-    Clear();
+    CH264Decoder::SetDegradation(level);
+    applySkipLevels();
 }
 
-HRESULT CH264DXVA1Decoder::CDXVABuffers::AllocExecBuffer(
-    int compType, int bufIndex, const void* nonBitStreamData, int size,
-    void** DXVABuffer)
+void CH264SWDecoder::applySkipLevels()
 {
-    void* allocated;
-    LONG stride;
-    HRESULT r = m_accel->GetBuffer(compType, bufIndex, FALSE, &allocated,
-                                   &stride);
-    assert(SUCCEEDED(r));
-    if (SUCCEEDED(r))
-    {
-        assert((compType != DXVA_BITSTREAM_DATA_BUFFER) || DXVABuffer);
-        if (compType != DXVA_BITSTREAM_DATA_BUFFER)
-            memcpy(allocated, nonBitStreamData, size);
-        else if (DXVABuffer)
-            *DXVABuffer = allocated;
-
-        AMVABUFFERINFO info = {0};
-        info.dwTypeIndex = compType;
-        info.dwDataSize = size;
-        m_bufInfo.push_back(info);
-
-        DXVA_BufferDescription desc = {0};
-        desc.dwTypeIndex = compType;
-        desc.dwDataSize = size;
-        m_bufDesc.push_back(desc);
-        return true;
-    }
-
-    return r;
+    const KDiscardLevel levels[] = {
+        DISCARD_DEFAULT, DISCARD_NON_REF, DISCARD_NON_KEY
+    };
+    KDiscardLevel skipFrame = levels[getSkipMode()];
+    if (getDegradation() >= DEGRADE_SKIP_DECODE)
+        skipFrame = std::max(skipFrame, DISCARD_NON_REF);
+
+    getPreDecode()->SetSkipFrame(skipFrame);
+    getPreDecode()->SetSkipLoopFilter(
+        (getDegradation() >= DEGRADE_LOOP_FILTER) ?
+            DISCARD_NON_REF : DISCARD_DEFAULT);
 }
 
-void CH264DXVA1Decoder::CDXVABuffers::ReviseLastDataSize(int size)
+void CH264SWDecoder::Flush()
 {
-    vector<AMVABUFFERINFO>::reverse_iterator i = m_bufInfo.rbegin();
-    if (i != m_bufInfo.rend())
-        i->dwDataSize = size;
-
-    vector<DXVA_BufferDescription>::reverse_iterator j = m_bufDesc.rbegin();
-    if (j != m_bufDesc.rend())
-        j->dwDataSize = size;
+    m_frame->SetComplete(false);
+    CH264Decoder::Flush();
 }
 
-void CH264DXVA1Decoder::CDXVABuffers::Clear()
+bool CH264SWDecoder::SetDirectRender(IMemAllocator* allocator,
+                                     const AM_MEDIA_TYPE* outType)
 {
-    for (int i = 0; i < static_cast<int>(m_bufInfo.size()); ++i)
+    if (m_directRender)
     {
-        HRESULT r = m_accel->ReleaseBuffer(m_bufInfo[i].dwTypeIndex,
-                                           m_bufInfo[i].dwBufferIndex);
-        assert(SUCCEEDED(r));
+        // Have libavcodec give back every picture in sample memory first.
+        getPreDecode()->FlushBuffers();
+        getPreDecode()->SetFrameBufferAllocator(NULL);
+        m_frame->SetComplete(false);
+        m_directRender.reset();
     }
 
-    m_bufInfo.clear();
-    m_bufDesc.clear();
-}
+    if (!allocator || !outType || (MEDIASUBTYPE_YV12 != outType->subtype))
+        return false;
 
-AMVABUFFERINFO* CH264DXVA1Decoder::CDXVABuffers::GetBufferInfo()
-{
-    return &m_bufInfo[0];
+    BITMAPINFOHEADER header;
+    if (!ExtractBitmapInfoFromMediaType(*outType, &header))
+        return false;
+
+    // libavcodec writes whole macroblocks and expects 16 byte aligned rows
+    // in every plane.
+    const int width = getPreDecode()->GetWidth();
+    const int height = getPreDecode()->GetHeight();
+    const int stride = header.biWidth;
+    if ((abs(header.biHeight) != height) || (height % 16) || (stride % 32) ||
+        (stride < ((width + 15) & ~15)))
+        return false;
+
+    m_directRender.reset(
+        new CSampleFrameAllocator(allocator, width, height, stride));
+    getPreDecode()->SetFrameBufferAllocator(m_directRender.get());
+    return true;
 }
 
-DXVA_BufferDescription* CH264DXVA1Decoder::CDXVABuffers::GetBufferDesc()
+HRESULT CH264SWDecoder::GetDirectSample(IMediaSample** sample)
 {
-    return &m_bufDesc[0];
+    assert(sample);
+    if (!m_directRender || !m_frame->IsComplete())
+        return S_FALSE;
+
+    IMediaSample* found = m_directRender->Find(m_frame->GetBuffer());
+    if (!found)
+        return S_FALSE;
+
+    found->AddRef();
+    *sample = found;
+    m_frame->SetComplete(false);
+    return S_OK;
 }
 
-CH264DXVA1Decoder::CH264DXVA1Decoder(const GUID& decoderID,
-                                     CCodecContext* preDecode,
-                                     IAMVideoAccelerator* accel,
-                                     int picEntryCount)
+//------------------------------------------------------------------------------
+CH264DXVADecoder::CH264DXVADecoder(const GUID& decoderID,
+                                   CCodecContext* preDecode,
+                                   int picEntryCount)
     : CH264Decoder(decoderID, preDecode)
-    , m_accel(accel)
     , m_picParams()
+    , m_scalingMatrix()
+    , m_scalingMatrixSent(false)
+    , m_parameterSets()
     , m_sliceLong()
     , m_sliceShort()
     , m_useLongSlice(false)
     , m_decodedPics()
-    , m_execBuffers(accel)
+    , m_freeSlots()
+    , m_pendingDisplay()
+    , m_displayedRefs(0)
+    , m_NALIndex(new CH264NALIndex)
+    , m_chunks()
+    , m_maxSlices(initialSlices)
+    , m_bitstreamBufferSize(std::numeric_limits<int>::max())
+    , m_sliceControlBufferSize(std::numeric_limits<int>::max())
+    , m_chunksStale(false)
+    , m_waitPolicy()
+    , m_waitStats()
+    , m_frameReady(false)
     , m_outPOC(-1)
     , m_outStart(std::numeric_limits<int64>::min())
+    , m_outputLag(false)
+    , m_laggedOutPOC(std::numeric_limits<int>::min())
+    , m_laggedOutStart(std::numeric_limits<int64>::min())
     , m_lastFrameTime(0)
     , m_estTimePerFrame(1)
+    , m_fallback()
+    , m_fallbackFrame(new CVideoFrame)
+    , m_gop()
+    , m_gopCount(0)
+    , m_gopSize(0)
+    , m_gopComplete(false)
+    , m_softwareMode(false)
+    , m_lastOutStart(std::numeric_limits<int64>::min())
 {
-    assert(accel);
-
     DXVA_Slice_H264_Long emptySliceLong = {0};
-    m_sliceLong.resize(maxSlices, emptySliceLong);
+    m_sliceLong.resize(initialSlices, emptySliceLong);
 
     DXVA_Slice_H264_Short emptySliceShort = {0};
-    m_sliceShort.resize(maxSlices, emptySliceShort);
+    m_sliceShort.resize(initialSlices, emptySliceShort);
 
     memset(&m_picParams, 0, sizeof(m_picParams));
     const int vendor = CHardwareEnv::get()->GetVideoCardVendor();
@@ -387,166 +655,225 @@ CH264DXVA1Decoder::CH264DXVA1Decoder(const GUID& decoderID,
         m_picParams.RefFrameList[i].Index7Bits = 127;
     }
 
-    m_decodedPics.resize(picEntryCount);
-}
+    m_decodedPics.resize(std::min(picEntryCount, maxPictureSlots));
+    resetPictureSlots();
 
-CH264DXVA1Decoder::~CH264DXVA1Decoder()
-{
+    m_waitPolicy.SpinCount = 50;
+    m_waitPolicy.MaxBackoff = 4;
+    m_waitPolicy.Timeout = 250;
+    memset(&m_waitStats, 0, sizeof(m_waitStats));
 }
 
-bool CH264DXVA1Decoder::Init(const DDPIXELFORMAT& pixelFormat,
-                             int64 averageTimePerFrame)
+CH264DXVADecoder::~CH264DXVADecoder()
 {
-    assert(m_accel);
-
-    DXVA_ConfigPictureDecode configRequested;
-    memset(&configRequested, 0, sizeof(configRequested));
-    configRequested.guidConfigBitstreamEncryption = DXVA_NoEncrypt;
-    configRequested.guidConfigMBcontrolEncryption = DXVA_NoEncrypt;
-    configRequested.guidConfigResidDiffEncryption = DXVA_NoEncrypt;
-    configRequested.bConfigBitstreamRaw = 2;
-
-    writeDXVA_QueryOrReplyFunc(&configRequested.dwFunction,
-                               DXVA_QUERYORREPLYFUNCFLAG_DECODER_PROBE_QUERY,
-                               DXVA_PICTURE_DECODING_FUNCTION);
-    DXVA_ConfigPictureDecode config;
-    config.guidConfigBitstreamEncryption = DXVA_NoEncrypt;
-    config.guidConfigMBcontrolEncryption = DXVA_NoEncrypt;
-    config.guidConfigResidDiffEncryption = DXVA_NoEncrypt;
-    config.bConfigBitstreamRaw = 2;
-    HRESULT r = m_accel->Execute(configRequested.dwFunction, &configRequested,
-                                 sizeof(configRequested), &config,
-                                 sizeof(config), 0, NULL);
-    if (FAILED(r))
-        return false;
-
-    writeDXVA_QueryOrReplyFunc(&config.dwFunction,
-                               DXVA_QUERYORREPLYFUNCFLAG_DECODER_LOCK_QUERY,
-                               DXVA_PICTURE_DECODING_FUNCTION);
-    r = m_accel->Execute (config.dwFunction, &config, sizeof(config),
-                          &configRequested,
-                          sizeof(DXVA_ConfigPictureDecode), 0, NULL);
-
-    AMVAUncompDataInfo dataInfo;
-    DWORD d = compBufferCount;
-    dataInfo.dwUncompWidth = getPreDecode()->GetWidth();
-    dataInfo.dwUncompHeight = getPreDecode()->GetHeight();
-    memcpy(&dataInfo.ddUncompPixelFormat, &pixelFormat, sizeof(pixelFormat));
-    AMVACompBufferInfo compBufInfo[compBufferCount];
-    r = m_accel->GetCompBufferInfo(&GetDecoderID(), &dataInfo, &d, compBufInfo);
-    if (FAILED(r))
-        return false;
-
-    getPreDecode()->SetSliceLong(&m_sliceLong[0]);
-    m_useLongSlice = (config.bConfigBitstreamRaw != 2);
-    m_estTimePerFrame = averageTimePerFrame;
-    return true;
 }
 
-HRESULT CH264DXVA1Decoder::Decode(const void* data, int size, int64 start,
-                                  int64 stop, IMediaSample* outSample,
-                                  int* bytesUsed)
+HRESULT CH264DXVADecoder::Decode(const void* data, int size, int64 start,
+                                 int64 stop, int* bytesUsed)
 {
     assert(data);
     assert(bytesUsed);
     assert(getPreDecode());
 
+    // libavcodec fills the long slice controls while parsing, so make room
+    // for every slice of the access unit first.
+    m_NALIndex->Build(data, size, getPreDecode()->GetNALLength());
+    if (m_fallback)
+    {
+        const bool IDR = hasIDRPicture();
+        keepAccessUnit(data, size, start, stop, IDR);
+        if (m_softwareMode && IDR)
+            leaveSoftware();
+    }
+
+    // More slices than macroblocks: libavcodec would write past the end of
+    // the slice controls, so the picture is not even parsed.
+    if (!reserveSlices(m_NALIndex->GetSliceCount()))
+    {
+        if (m_softwareMode && FAILED(decodeSoftware(data, size, start, stop)))
+            setFlushed(true);
+
+        return S_FALSE;
+    }
+
     int framePOC;
     int outPOC;
     int64 startTime;
-    getPreDecode()->PreDecodeBuffer(data, size, &framePOC, &outPOC, &startTime);
-    TRACE(L"\n Predecode done. framePOC: %d, outPOC: %d, start: %.4f",
-          framePOC, outPOC, startTime / 10000000.0f);
+    {
+        CStageTimer timer(getStats(), H264_STAGE_PRE_DECODE);
+        CTraceScope trace(H264_TRACE_PRE_DECODE, -1,
+                          m_NALIndex->GetSliceCount(), -1, size);
+        getPreDecode()->PreDecodeBuffer(data, size, &framePOC, &outPOC,
+                                        &startTime);
+        trace.SetPOC(framePOC);
+    }
 
     // If parsing fail (probably no PPS/SPS), continue anyway it may arrived
     // later (happen on truncated streams).
+    HRESULT r = h264_detail::UpdateParameterSets(getPreDecode(),
+                                                 &m_parameterSets);
+    if (FAILED(r))
+        return S_FALSE;
+
+    // The fields taken from the SPS and PPS, and the scaling matrix, are only
+    // rebuilt when one of them changes.
+    const bool parameterSetsChanged = (S_OK == r);
     int fieldType;
     int sliceType;
-    if (FAILED(h264_detail::BuildPicParams(getPreDecode(), &m_picParams,
-                                           &fieldType, &sliceType)))
+    if (FAILED(h264_detail::BuildPicParams(getPreDecode(), parameterSetsChanged,
+                                           &m_picParams, &fieldType,
+                                           &sliceType)))
+    {
+        m_parameterSets.Valid = false;
         return S_FALSE;
+    }
 
-    DXVA_Qmatrix_H264 scalingMatrix;
-    if (FAILED(h264_detail::BuildScalingMatrix(getPreDecode(), &scalingMatrix)))
-        return S_FALSE;
+    if (parameterSetsChanged)
+    {
+        m_scalingMatrixSent = false;
+        if (FAILED(h264_detail::BuildScalingMatrix(getPreDecode(),
+                                                   &m_scalingMatrix)))
+        {
+            m_parameterSets.Valid = false;
+            return S_FALSE;
+        }
+    }
 
     // Wait I frame after a flush.
     if (getFlushed() && !m_picParams.IntraPicFlag)
+    {
+        if (getStats())
+            getStats()->AddSkippedAfterFlush();
+
         return S_FALSE;
+    }
 
-    int surfaceIndex;
-    intrusive_ptr<IMediaSample> sampleToDeliver;
-    HRESULT r = getFreeSurfaceIndex(&surfaceIndex, &sampleToDeliver);
-    if (FAILED(r))
-        return r;
+    // libavcodec has parsed the picture either way, so its reference lists
+    // stay right; the pictures left out just never get a surface.
+    if (((SKIP_NON_REF == getSkipMode()) && !m_picParams.RefPicFlag) ||
+        ((SKIP_NON_KEY == getSkipMode()) && !m_picParams.IntraPicFlag))
+        return S_FALSE;
 
-    h264_detail::SetCurrentPicIndex(surfaceIndex, &m_picParams, getPreDecode());
+    if ((getDegradation() >= DEGRADE_SKIP_DECODE) && !m_picParams.RefPicFlag)
+    {
+        if (getStats())
+            getStats()->AddDropped();
 
-    r = beginFrame(surfaceIndex);
-    if (FAILED(r))
-        return r;
+        return S_FALSE;
+    }
 
-    m_picParams.StatusReportFeedbackNumber++;
+    // libavcodec has parsed the picture, but the software decoder still has
+    // to decode it.
+    if (m_softwareMode)
+    {
+        // The accelerator joins in again from the next intra picture.
+        if (FAILED(decodeSoftware(data, size, start, stop)))
+        {
+            setFlushed(true);
+            return S_FALSE;
+        }
 
-    // Send picture parameters
-    r = m_execBuffers.AllocExecBuffer(DXVA_PICTURE_DECODE_BUFFER, 0,
-                                      &m_picParams, sizeof(m_picParams), NULL);
-    if (FAILED(r))
-        return r;
+        setFlushed(false);
+        *bytesUsed = size;
+        return S_OK;
+    }
 
-    r = execute();
-    if (FAILED(r))
-        return r;
+    if (planBitStreamChunks(*m_NALIndex) <= 0)
+        return recoverInSoftware(size, bytesUsed) ? S_OK : S_FALSE;
+
+    int surfaceIndex;
+    intrusive_ptr<IMediaSample> sampleToDeliver;
+    r = getFreeSurface(&surfaceIndex, &sampleToDeliver);
+    if (VFW_E_TIMEOUT == r)
+        return recoverInSoftware(size, bytesUsed) ? S_OK : S_FALSE;
 
-    // Add bitstream, slice control and quantization matrix.
-    void* DXVABuffer = NULL;
-    r = m_execBuffers.AllocExecBuffer(DXVA_BITSTREAM_DATA_BUFFER, 0, NULL, 0,
-                                      &DXVABuffer);
     if (FAILED(r))
         return r;
 
-    int slice = buildBitStreamAndRefFrameSlice(data, size, DXVABuffer);
-    if (slice < 0)
-        return S_FALSE;
+    h264_detail::SetCurrentPicIndex(surfaceIndex, &m_picParams, getPreDecode());
 
-    const void* execBuf = m_useLongSlice ?
-        reinterpret_cast<const void*>(&m_sliceLong[0]) :
-        reinterpret_cast<const void*>(&m_sliceShort[0]);
-    int execBufSize =
-        m_useLongSlice ?
-            sizeof(m_sliceLong[0]) * slice :
-            sizeof(m_sliceShort[0]) * slice;
-    r = m_execBuffers.AllocExecBuffer(DXVA_SLICE_CONTROL_BUFFER, 0, execBuf,
-                                      execBufSize, NULL);
+    r = beginFrame(surfaceIndex);
     if (FAILED(r))
         return r;
 
-    r = m_execBuffers.AllocExecBuffer(DXVA_INVERSE_QUANTIZATION_MATRIX_BUFFER,
-                                      0, &scalingMatrix, sizeof(scalingMatrix),
-                                      NULL);
-    if (FAILED(r))
-        return r;
+    // The picture was planned before beginFrame() told the buffer sizes.
+    if (m_chunksStale)
+    {
+        m_chunksStale = false;
+        if (planBitStreamChunks(*m_NALIndex) <= 0)
+        {
+            endFrame(surfaceIndex);
+            return recoverInSoftware(size, bytesUsed) ? S_OK : S_FALSE;
+        }
+    }
 
-    // Decode bitstream
-    r = execute();
+    m_picParams.StatusReportFeedbackNumber++;
+
+    r = submitPicture(m_scalingMatrix, m_scalingMatrixSent);
     if (FAILED(r))
-        return r;
+    {
+        endFrame(surfaceIndex);
+        return recoverInSoftware(size, bytesUsed) ? S_OK : r;
+    }
+
+    m_scalingMatrixSent = true;
 
     r = endFrame(surfaceIndex);
+    if (FAILED(r) && recoverInSoftware(size, bytesUsed))
+        return S_OK;
 
     bool added = addToStandby(surfaceIndex, sampleToDeliver,
                               m_picParams.RefPicFlag, start, stop,
                               m_picParams.field_pic_flag, fieldType, sliceType,
                               framePOC);
     h264_detail::UpdateRefFramesList(&m_picParams, getPreDecode());
-    clearUnusedRefFrames();
+    clearUnusedRefFrames(getPreDecode()->GetRefFrameMask());
+    if (getStats())
+    {
+        const int count = getPictureCount();
+        getStats()->SetSurfaceOccupancy(
+            count - static_cast<int>(m_freeSlots.size()), count);
+    }
+
     if (added)
     {
-        r = displayNextFrame(outSample);
-        if (outPOC != std::numeric_limits<int>::min())
+        if (getStats())
+            getStats()->AddDecoded();
+
+        m_frameReady = true;
+        if (getPreDecode()->IsLowLatency())
+        {
+            // Straight out, without waiting for libavcodec to name it.
+            const CDecodedPic& pic = m_decodedPics[surfaceIndex];
+            m_outPOC = pic.CodecSpecific;
+            m_outStart = pic.Start;
+            m_laggedOutPOC = std::numeric_limits<int>::min();
+        }
+        else if (outPOC != std::numeric_limits<int>::min())
+        {
+            if (m_outputLag)
+            {
+                m_laggedOutPOC = outPOC;
+                m_laggedOutStart = startTime;
+            }
+            else
+            {
+                m_outPOC = outPOC;
+                m_outStart = startTime;
+            }
+        }
+
+        // Taken out of the display order here, so that the caller doesn't ask
+        // for an output sample.
+        if ((m_outStart != std::numeric_limits<int64>::min()) &&
+            isBeforeDeliveryStart(m_outStart))
         {
-            m_outPOC = outPOC;
-            m_outStart = startTime;
+            const int index = findEarliestFrame();
+            if (index >= 0)
+                markDisplayed(index);
+
+            applyOutputLag();
+            m_frameReady = false;
         }
     }
 
@@ -555,105 +882,275 @@ HRESULT CH264DXVA1Decoder::Decode(const void* data, int size, int64 start,
     return S_OK;
 }
 
-void CH264DXVA1Decoder::Flush()
+void CH264DXVADecoder::Flush()
 {
-    for (int i = 0; i < static_cast<int>(m_decodedPics.size()); ++i)
-        m_decodedPics[i].Reinit();
-
+    m_frameReady = false;
+    resetPictureSlots();
     m_outPOC = -1;
+    m_laggedOutPOC = std::numeric_limits<int>::min();
     m_lastFrameTime = 0;
+    m_gopCount = 0;
+    m_gopSize = 0;
+    m_gopComplete = false;
+    m_softwareMode = false;
+    m_lastOutStart = std::numeric_limits<int64>::min();
+    m_fallbackFrame->SetComplete(false);
+    if (m_fallback)
+        m_fallback->FlushBuffers();
+
     CH264Decoder::Flush();
 }
 
-HRESULT CH264DXVA1Decoder::getFreeSurfaceIndex(
-    int* surfaceIndex, intrusive_ptr<IMediaSample>* sampleToDeliver)
+void CH264DXVADecoder::SetFallback(const shared_ptr<CCodecContext>& fallback)
 {
-    assert(surfaceIndex);
-    assert(sampleToDeliver);
+    m_fallback = fallback;
+    m_softwareMode = false;
+    m_gopCount = 0;
+    m_gopSize = 0;
+    m_gopComplete = false;
+}
 
-    if (getFieldSurface() != -1)
-    {
-        *surfaceIndex = getFieldSurface();
-        *sampleToDeliver = getFieldSample();
-        setFieldSample(NULL);
-        return S_FALSE;
-    }
+int64 CH264DXVADecoder::GetFallbackMemory(const CCodecContext& codec)
+{
+    return codec.GetDecodeMemory() + maxGOPSize;
+}
 
-    int findResult = -1;
-    int minDisplay = std::numeric_limits<int>::max();
-    for (int i = 0; i < static_cast<int>(m_decodedPics.size()); ++i)
+void CH264DXVADecoder::SetWaitPolicy(const TWaitPolicy& policy)
+{
+    m_waitPolicy = policy;
+    m_waitPolicy.SpinCount = std::max(0, m_waitPolicy.SpinCount);
+    m_waitPolicy.MaxBackoff = std::max(1, m_waitPolicy.MaxBackoff);
+    m_waitPolicy.Timeout = std::max(0, m_waitPolicy.Timeout);
+}
+
+void CH264DXVADecoder::setAcceleratorConfig(bool useLongSlice,
+                                            int bitstreamBufferSize,
+                                            int sliceControlBufferSize,
+                                            int64 averageTimePerFrame)
+{
+    // No picture can have more slices than macroblocks.
+    const int mbCount = ((getPreDecode()->GetWidth() + 15) / 16) *
+        ((getPreDecode()->GetHeight() + 15) / 16);
+    m_maxSlices = std::max(initialSlices, mbCount);
+
+    setBufferSizes(bitstreamBufferSize, sliceControlBufferSize);
+    m_chunksStale = false;
+    getPreDecode()->SetSliceLong(&m_sliceLong[0]);
+    m_useLongSlice = useLongSlice;
+    m_estTimePerFrame = averageTimePerFrame;
+}
+
+void CH264DXVADecoder::setBufferSizes(int bitstreamBufferSize,
+                                      int sliceControlBufferSize)
+{
+    const int bitstream = (bitstreamBufferSize > bitstreamAlignment) ?
+        bitstreamBufferSize : std::numeric_limits<int>::max();
+    const int sliceControl = (sliceControlBufferSize > 0) ?
+        sliceControlBufferSize : std::numeric_limits<int>::max();
+    if ((bitstream == m_bitstreamBufferSize) &&
+        (sliceControl == m_sliceControlBufferSize))
+        return;
+
+    m_bitstreamBufferSize = bitstream;
+    m_sliceControlBufferSize = sliceControl;
+    m_chunksStale = true;
+}
+
+int CH264DXVADecoder::buildBitStreamAndRefFrameSlice(
+    const TBitstreamChunk& chunk, void* dest)
+{
+    assert(dest);
+
+    CStageTimer timer(getStats(), H264_STAGE_BITSTREAM_BUILD);
+    CTraceScope trace(H264_TRACE_BITSTREAM_BUILD, getCurrentPOC(m_picParams),
+                      chunk.SliceCount, m_picParams.CurrPic.Index7Bits,
+                      chunk.Size);
+    const CH264NALIndex& index = *m_NALIndex;
+    int8* destCursor = reinterpret_cast<int8*>(dest);
+    int dataOffset = 0;
+
+    // Annex B slices that follow each other in the input already carry their
+    // start codes, so each such run goes up in a single streaming copy. Only
+    // length-prefixed NALUs need the start code patched in.
+    const BYTE* runStart = NULL;
+    int runLength = 0;
+    int lastNALLength = 0;
+    for (int i = chunk.FirstUnit; i < chunk.EndUnit; ++i)
     {
-        if (!m_decodedPics[i].InUse &&
-            (m_decodedPics[i].DisplayCount < minDisplay))
+        const CH264NALIndex::TNALUnitDesc& unit = index.Get(i);
+        if ((NALU_TYPE_SLICE != unit.Type) && (NALU_TYPE_IDR != unit.Type))
+            continue;
+
+        const int NALLength = unit.DataLength + 3;
+        const BYTE* NALStart = index.GetBuffer() + unit.NALPos;
+        if (hasAnnexBStartcode(unit, NALStart))
+        {
+            if (runStart && (runStart + runLength == NALStart))
+            {
+                runLength += NALLength;
+            }
+            else
+            {
+                streamCopy(destCursor - runLength, runStart, runLength);
+                runStart = NALStart;
+                runLength = NALLength;
+            }
+        }
+        else
         {
-            minDisplay = m_decodedPics[i].DisplayCount;
-            findResult  = i;
+            streamCopy(destCursor - runLength, runStart, runLength);
+            runStart = NULL;
+            runLength = 0;
+
+            // For AVC1, put startcode 0x000001
+            destCursor[0] = 0;
+            destCursor[1] = 0;
+            destCursor[2] = 1;
+
+            // Copy NALU
+            streamCopy(destCursor + 3, index.GetBuffer() + unit.DataPos,
+                       unit.DataLength);
         }
+
+        dataOffset += NALLength;
+        destCursor += NALLength;
+        lastNALLength = NALLength;
     }
 
-    if (findResult != -1)
+    streamCopy(destCursor - runLength, runStart, runLength);
+    streamCopyDone();
+
+    // Complete with zero padding (buffer size should be a multiple of 128).
+    // Assigned rather than added, as a picture may be built again after a
+    // refused submission.
+    int padding  = bitstreamAlignment - (dataOffset % bitstreamAlignment);
+    memset(destCursor, 0, padding);
+    const int lastSlice = chunk.FirstSlice + chunk.SliceCount - 1;
+    m_sliceLong[lastSlice].SliceBytesInBuffer = lastNALLength + padding;
+    m_sliceShort[lastSlice].SliceBytesInBuffer = lastNALLength + padding;
+    return dataOffset + padding;
+}
+
+const void* CH264DXVADecoder::getSliceControl(const TBitstreamChunk& chunk,
+                                              int* size) const
+{
+    assert(size);
+    if (m_useLongSlice)
     {
-        *surfaceIndex = findResult;
-        return S_OK;
+        *size = sizeof(m_sliceLong[0]) * chunk.SliceCount;
+        return &m_sliceLong[chunk.FirstSlice];
     }
 
-    assert(false);
-    Flush();
-    return E_UNEXPECTED;
+    *size = sizeof(m_sliceShort[0]) * chunk.SliceCount;
+    return &m_sliceShort[chunk.FirstSlice];
 }
 
-HRESULT CH264DXVA1Decoder::beginFrame(int surfaceIndex)
+int CH264DXVADecoder::getFreeSlot() const
 {
-    AMVABeginFrameInfo info;
-    info.dwDestSurfaceIndex = surfaceIndex;
-    info.dwSizeInputData = sizeof(surfaceIndex);
-    info.pInputData = &surfaceIndex;
-    info.dwSizeOutputData = 0;
-    info.pOutputData = NULL;
+    return m_freeSlots.empty() ? -1 : m_freeSlots.front();
+}
 
-    HRESULT r;
-    for (int i = 0; i < 20; ++i)
+int CH264DXVADecoder::findEarliestFrame()
+{
+    typedef std::multimap<int, int>::const_iterator TIter;
+    std::pair<TIter, TIter> range = m_pendingDisplay.equal_range(m_outPOC);
+    int index = -1;
+    int64 earliest = std::numeric_limits<int64>::max();
+    for (TIter i = range.first; i != range.second; ++i)
     {
-        TRY_EXECUTE(m_accel->BeginFrame(&info));
-        if (SUCCEEDED(r))
-            TRY_EXECUTE(m_accel->QueryRenderStatus(0xFFFFFFFF, 0, 0));
-
-        if (SUCCEEDED(r))
-            break;
+        if (m_decodedPics[i->second].Start < earliest)
+        {
+            index = i->second;
+            earliest = m_decodedPics[i->second].Start;
+        }
+    }
 
-        // Don't use PlatformThread::YieldCurrentThread() here, or the frames
-        // will probably get interleaved.
-        PlatformThread::Sleep(1);
+    if (index >= 0)
+    {
+        if (std::numeric_limits<int64>::min() == m_outStart)
+        {
+            // If start time not set (no PTS for example), guess presentation
+            // time.
+            m_outStart = m_lastFrameTime;
+        }
+        m_decodedPics[index].Start = m_outStart;
+        m_decodedPics[index].Stop = m_outStart + m_estTimePerFrame;
+        m_lastFrameTime = m_outStart + m_estTimePerFrame;
     }
 
-    return r;
+    return index;
 }
 
-HRESULT CH264DXVA1Decoder::endFrame(int surfaceIndex)
+void CH264DXVADecoder::applyOutputLag()
 {
-    AMVAEndFrameInfo endFrameInfo;
-    endFrameInfo.dwSizeMiscData = sizeof(surfaceIndex);
-    endFrameInfo.pMiscData = &surfaceIndex;
-    return m_accel->EndFrame(&endFrameInfo);
+    if (std::numeric_limits<int>::min() == m_laggedOutPOC)
+        return;
+
+    m_outPOC = m_laggedOutPOC;
+    m_outStart = m_laggedOutStart;
+    m_laggedOutPOC = std::numeric_limits<int>::min();
 }
 
-HRESULT CH264DXVA1Decoder::execute()
+void CH264DXVADecoder::markDisplayed(int index)
 {
-    DWORD func = 0x01000000;
-    int32 result;
-    HRESULT r = m_accel->Execute(
-        func, m_execBuffers.GetBufferDesc(),
-        sizeof(DXVA_BufferDescription) * m_execBuffers.GetSize(),
-        &result, sizeof(result), m_execBuffers.GetSize(),
-        m_execBuffers.GetBufferInfo());
-    assert(SUCCEEDED(r));
+    removePendingDisplay(index);
 
-    m_execBuffers.Clear();
-    return r;
+    CDecodedPic& pic = m_decodedPics[index];
+    pic.Displayed = true;
+    m_lastOutStart = pic.Start;
+    if (pic.RefPicture)
+        m_displayedRefs |= 1U << index;
+    else
+        freePictureSlot(index);
 }
 
-bool CH264DXVA1Decoder::updateRefFrameSliceLong(int slice, int dataOffset,
-                                                int sliceLength)
+void CH264DXVADecoder::setTypeSpecificFlags(const CDecodedPic& pic,
+                                            IMediaSample* sample)
+{
+    assert(sample);
+    intrusive_ptr<IMediaSample2> sample2;
+    HRESULT r = sample->QueryInterface(IID_IMediaSample2,
+                                       reinterpret_cast<void**>(&sample2));
+    if (FAILED(r))
+        return;
+
+    AM_SAMPLE2_PROPERTIES props;
+    if(SUCCEEDED(sample2->GetProperties(sizeof(props),
+                                        reinterpret_cast<BYTE*>(&props))))
+    {
+        props.dwTypeSpecificFlags &= ~0x7F;
+        CCodecContext::ReviseTypeSpecFlags(pic.FirstFieldType, pic.SliceType,
+                                           &props.dwTypeSpecificFlags);
+
+        sample2->SetProperties(sizeof(props),
+                               reinterpret_cast<BYTE*>(&props));
+    }
+}
+
+bool CH264DXVADecoder::reserveSlices(int sliceCount)
+{
+    const int current = static_cast<int>(m_sliceLong.size());
+    if (sliceCount <= current)
+        return true;
+
+    const int capacity = std::min(std::max(sliceCount, current * 2),
+                                  m_maxSlices);
+    if (capacity <= current)
+        return false;
+
+    DXVA_Slice_H264_Long emptySliceLong = {0};
+    m_sliceLong.resize(capacity, emptySliceLong);
+
+    DXVA_Slice_H264_Short emptySliceShort = {0};
+    m_sliceShort.resize(capacity, emptySliceShort);
+
+    // The storage has moved.
+    getPreDecode()->SetSliceLong(&m_sliceLong[0]);
+    return capacity >= sliceCount;
+}
+
+bool CH264DXVADecoder::updateRefFrameSliceLong(int slice, int dataOffset,
+                                               int sliceLength)
 {
     if (slice >= static_cast<int>(m_sliceLong.size()))
         return false;
@@ -675,8 +1172,8 @@ bool CH264DXVA1Decoder::updateRefFrameSliceLong(int slice, int dataOffset,
     return true;
 }
 
-bool CH264DXVA1Decoder::updateRefFrameSliceShort(int slice, int dataOffset,
-                                                 int sliceLength)
+bool CH264DXVADecoder::updateRefFrameSliceShort(int slice, int dataOffset,
+                                                int sliceLength)
 {
     if (slice >= static_cast<int>(m_sliceShort.size()))
         return false;
@@ -686,66 +1183,74 @@ bool CH264DXVA1Decoder::updateRefFrameSliceShort(int slice, int dataOffset,
     return true;
 }
 
-int CH264DXVA1Decoder::buildBitStreamAndRefFrameSlice(const void* data,
-                                                      int size, void* dest)
+int CH264DXVADecoder::planBitStreamChunks(const CH264NALIndex& index)
 {
-    assert(data);
-    assert(dest);
+    bool (CH264DXVADecoder::*updateFunc)(int, int, int) =
+        m_useLongSlice ?
+            &CH264DXVADecoder::updateRefFrameSliceLong :
+            &CH264DXVADecoder::updateRefFrameSliceShort;
 
-    CH264NALU block;
-    block.SetBuffer(data, size, getPreDecode()->GetNALLength());
+    const int sliceControlSize = m_useLongSlice ?
+        sizeof(m_sliceLong[0]) : sizeof(m_sliceShort[0]);
+    const int maxSlicesPerChunk =
+        std::max(1, m_sliceControlBufferSize / sliceControlSize);
 
-    bool (CH264DXVA1Decoder::*updateFunc)(int, int, int) =
-        m_useLongSlice ?
-            &CH264DXVA1Decoder::updateRefFrameSliceLong :
-            &CH264DXVA1Decoder::updateRefFrameSliceShort;
+    // Keep room for the trailing padding of each chunk.
+    const int maxChunkSize = m_bitstreamBufferSize - bitstreamAlignment;
 
-    int8* destCursor = reinterpret_cast<int8*>(dest);
-    int dataOffset = 0;
+    m_chunks.clear();
+    TBitstreamChunk chunk = {0};
     int slice = 0;
-    while (block.ReadNext())
+    for (int i = 0; i < index.GetCount(); ++i)
     {
-        if ((NALU_TYPE_SLICE == block.GetType()) ||
-            (NALU_TYPE_IDR == block.GetType()))
-        {
-            // Skip the NALU if the data length is below 0.
-            if (block.GetDataLength() < 0)
-                break;
-
-            // For AVC1, put startcode 0x000001
-            destCursor[0] = 0;
-            destCursor[1] = 0;
-            destCursor[2] = 1;
+        const CH264NALIndex::TNALUnitDesc& unit = index.Get(i);
+        if ((NALU_TYPE_SLICE != unit.Type) && (NALU_TYPE_IDR != unit.Type))
+            continue;
 
-            // Copy NALU
-            memcpy(destCursor + 3, block.GetDataBuffer(),
-                   block.GetDataLength());
+        // Skip the NALU if the data length is below 0.
+        if (unit.DataLength < 0)
+            break;
 
-            // Update slice control buffer
-            int NALLength = block.GetDataLength() + 3;
-            if (!(this->*updateFunc)(slice, dataOffset, NALLength))
-                break;
+        // A slice can't be split across bitstream buffers.
+        const int NALLength = unit.DataLength + 3;
+        if (NALLength > maxChunkSize)
+            return -1;
 
-            dataOffset += NALLength;
-            destCursor += NALLength;
-            slice++;
+        if (chunk.SliceCount &&
+            ((chunk.Size + NALLength > maxChunkSize) ||
+                (chunk.SliceCount >= maxSlicesPerChunk)))
+        {
+            m_chunks.push_back(chunk);
+            chunk.FirstSlice = slice;
+            chunk.SliceCount = 0;
+            chunk.Size = 0;
         }
+
+        // Update slice control buffer. Decode() has made room for every
+        // slice, so this only fails on a corrupt index.
+        if (!(this->*updateFunc)(slice, chunk.Size, NALLength))
+            return -1;
+
+        if (!chunk.SliceCount)
+            chunk.FirstUnit = i;
+
+        chunk.EndUnit = i + 1;
+        chunk.SliceCount++;
+        chunk.Size += NALLength;
+        slice++;
     }
 
-    // Complete with zero padding (buffer size should be a multiple of 128)
-    int padding  = 128 - (dataOffset % 128);
-    memset(destCursor, 0, padding);
-    m_sliceLong[slice - 1].SliceBytesInBuffer += padding;
-    m_sliceShort[slice - 1].SliceBytesInBuffer += padding;
-    m_execBuffers.ReviseLastDataSize(dataOffset + padding);
+    if (chunk.SliceCount)
+        m_chunks.push_back(chunk);
+
     return slice;
 }
 
-bool CH264DXVA1Decoder::addToStandby(int surfaceIndex,
-                                     const intrusive_ptr<IMediaSample>& sample,
-                                     bool isRefPicture, int64 start, int64 stop,
-                                     bool isField, int fieldType, int sliceType,
-                                     int codecSpecific)
+bool CH264DXVADecoder::addToStandby(int surfaceIndex,
+                                    const intrusive_ptr<IMediaSample>& sample,
+                                    bool isRefPicture, int64 start, int64 stop,
+                                    bool isField, int fieldType, int sliceType,
+                                    int codecSpecific)
 {
     CDecodedPic& ref = m_decodedPics[surfaceIndex];
     if (isField && (-1 == getFieldSurface()))
@@ -777,26 +1282,48 @@ bool CH264DXVA1Decoder::addToStandby(int surfaceIndex,
         ref.CodecSpecific = codecSpecific;
     }
 
+    // Normally the front, unless a first field is still waiting for its
+    // second one.
+    std::deque<int>::iterator slot =
+        std::find(m_freeSlots.begin(), m_freeSlots.end(), surfaceIndex);
+    assert(slot != m_freeSlots.end());
+    m_freeSlots.erase(slot);
+    m_pendingDisplay.insert(std::make_pair(ref.CodecSpecific, surfaceIndex));
+
     setFieldSurface(-1);
     return true;
 }
 
-void CH264DXVA1Decoder::clearUnusedRefFrames()
+void CH264DXVADecoder::resetPictureSlots()
 {
+    m_freeSlots.clear();
     for (int i = 0; i < static_cast<int>(m_decodedPics.size()); ++i)
-        if (m_decodedPics[i].RefPicture && m_decodedPics[i].Displayed)
-            if (!getPreDecode()->IsRefFrameInUse(i))
-                removeRefFrame(i);
+    {
+        m_decodedPics[i].Reinit();
+        m_freeSlots.push_back(i);
+    }
+
+    m_pendingDisplay.clear();
+    m_displayedRefs = 0;
 }
 
-void CH264DXVA1Decoder::removeRefFrame(int surfaceIndex)
+void CH264DXVADecoder::clearUnusedRefFrames(uint32 refFrameMask)
+{
+    uint32 unused = m_displayedRefs & ~refFrameMask;
+    for (int i = 0; unused; ++i, unused >>= 1)
+        if (unused & 1)
+            removeRefFrame(i);
+}
+
+void CH264DXVADecoder::removeRefFrame(int surfaceIndex)
 {
     m_decodedPics[surfaceIndex].RefPicture = false;
+    m_displayedRefs &= ~(1U << surfaceIndex);
     if (m_decodedPics[surfaceIndex].Displayed)
         freePictureSlot(surfaceIndex);
 }
 
-void CH264DXVA1Decoder::freePictureSlot(int surfaceIndex)
+void CH264DXVADecoder::freePictureSlot(int surfaceIndex)
 {
     CDecodedPic& ref = m_decodedPics[surfaceIndex];
     ref.DisplayCount = incrementDispCount();
@@ -804,62 +1331,573 @@ void CH264DXVA1Decoder::freePictureSlot(int surfaceIndex)
     ref.Displayed = false;
     ref.CodecSpecific = -1;
     ref.SetSample(NULL);
+    m_freeSlots.push_back(surfaceIndex);
 }
 
-int CH264DXVA1Decoder::findEarliestFrame()
+void CH264DXVADecoder::removePendingDisplay(int surfaceIndex)
 {
-    int index = -1;
-    int64 earliest = std::numeric_limits<int64>::max();
-    for (int i = 0; i < static_cast<int>(m_decodedPics.size()); ++i)
+    typedef std::multimap<int, int>::iterator TIter;
+    std::pair<TIter, TIter> range =
+        m_pendingDisplay.equal_range(m_decodedPics[surfaceIndex].CodecSpecific);
+    for (TIter i = range.first; i != range.second; ++i)
     {
-        if (m_decodedPics[i].InUse && !m_decodedPics[i].Displayed)
+        if (i->second == surfaceIndex)
         {
-            if ((m_decodedPics[i].CodecSpecific == m_outPOC) &&
-                (m_decodedPics[i].Start < earliest))
-            {
-                index  = i;
-                earliest = m_decodedPics[i].Start;
-            }
+            m_pendingDisplay.erase(i);
+            return;
         }
     }
 
-    if (index >= 0)
-    {
-        if (std::numeric_limits<int64>::min() == m_outStart)
-        {
-            // If start time not set (no PTS for example), guess presentation
-            // time.
-            m_outStart = m_lastFrameTime;
-        }
-        m_decodedPics[index].Start = m_outStart;
-        m_decodedPics[index].Stop = m_outStart + m_estTimePerFrame;
-        m_lastFrameTime = m_outStart + m_estTimePerFrame;
-    }
+    assert(false);
+}
 
-    return index;
+bool CH264DXVADecoder::hasIDRPicture() const
+{
+    for (int i = 0; i < m_NALIndex->GetCount(); ++i)
+        if (NALU_TYPE_IDR == m_NALIndex->Get(i).Type)
+            return true;
+
+    return false;
 }
 
-void CH264DXVA1Decoder::setTypeSpecificFlags(const CDecodedPic& pic,
-                                             IMediaSample* sample)
+void CH264DXVADecoder::keepAccessUnit(const void* data, int size, int64 start,
+                                      int64 stop, bool IDR)
 {
-    assert(sample);
-    intrusive_ptr<IMediaSample2> sample2;
-    HRESULT r = sample->QueryInterface(IID_IMediaSample2,
-                                       reinterpret_cast<void**>(&sample2));
-    if (FAILED(r))
+    if (IDR)
+    {
+        m_gopCount = 0;
+        m_gopSize = 0;
+        m_gopComplete = true;
+    }
+
+    if (!m_gopComplete)
         return;
 
-    AM_SAMPLE2_PROPERTIES props;
-    if(SUCCEEDED(sample2->GetProperties(sizeof(props),
-                                        reinterpret_cast<BYTE*>(&props))))
+    if ((m_gopCount >= maxGOPUnits) || (m_gopSize + size > maxGOPSize))
     {
-        props.dwTypeSpecificFlags &= ~0x7F;
-        CCodecContext::ReviseTypeSpecFlags(pic.FirstFieldType, pic.SliceType,
-                                           &props.dwTypeSpecificFlags);
+        m_gopComplete = false;
+        return;
+    }
 
-        sample2->SetProperties(sizeof(props),
-                               reinterpret_cast<BYTE*>(&props));
+    if (m_gopCount == static_cast<int>(m_gop.size()))
+        m_gop.resize(m_gopCount + 1);
+
+    // libavcodec reads past the end of the data.
+    const int padding = CFFMPEG::GetInputBufferPaddingSize();
+    TAccessUnit& unit = m_gop[m_gopCount++];
+    unit.Data.resize(size + padding);
+    memcpy(&unit.Data[0], data, size);
+    memset(&unit.Data[size], 0, padding);
+    unit.Size = size;
+    unit.Start = start;
+    unit.Stop = stop;
+    m_gopSize += size;
+}
+
+bool CH264DXVADecoder::recoverInSoftware(int size, int* bytesUsed)
+{
+    if (!m_fallback || !m_gopComplete)
+        return false;
+
+    // The pictures the accelerator has not shown yet are decoded again.
+    m_frameReady = false;
+    resetPictureSlots();
+    setFieldSurface(-1);
+    setFieldSample(NULL);
+    m_fallback->FlushBuffers();
+    m_fallbackFrame->SetComplete(false);
+    m_softwareMode = true;
+    for (int i = 0; i < m_gopCount; ++i)
+    {
+        const TAccessUnit& unit = m_gop[i];
+        if (FAILED(decodeSoftware(&unit.Data[0], unit.Size, unit.Start,
+                                  unit.Stop)))
+            break;
+    }
+
+    // Without the software decoder, the accelerator starts over from the
+    // next intra picture, as after a flush.
+    if (!m_softwareMode)
+    {
+        setFlushed(true);
+        return false;
+    }
+
+    setFlushed(false);
+    *bytesUsed = size;
+    return true;
+}
+
+void CH264DXVADecoder::leaveSoftware()
+{
+    // Empty packets take out the pictures held back for reordering.
+    vector<uint8> empty(CFFMPEG::GetInputBufferPaddingSize(), 0);
+    HRESULT r = S_OK;
+    do
+    {
+        m_fallback->Decode(m_fallbackFrame.get(), &empty[0], 0);
+        if (!m_fallbackFrame->IsComplete())
+            break;
+
+        r = outputSoftwarePicture();
+    } while (SUCCEEDED(r));
+
+    if (m_fallback)
+        m_fallback->FlushBuffers();
+
+    m_fallbackFrame->SetComplete(false);
+    m_softwareMode = false;
+    m_outPOC = -1;
+    m_outStart = std::numeric_limits<int64>::min();
+    m_laggedOutPOC = std::numeric_limits<int>::min();
+}
+
+HRESULT CH264DXVADecoder::decodeSoftware(const void* data, int size,
+                                         int64 start, int64 stop)
+{
+    m_fallback->UpdateTime(start, stop);
+    const int8* dataStart = reinterpret_cast<const int8*>(data);
+    int dataRemaining = size;
+    while (dataRemaining > 0)
+    {
+        const int usedBytes =
+            m_fallback->Decode(m_fallbackFrame.get(), dataStart,
+                               dataRemaining);
+        if (usedBytes < 0)
+            return S_FALSE;
+
+        if (m_fallbackFrame->IsComplete())
+        {
+            HRESULT r = outputSoftwarePicture();
+            if (FAILED(r))
+                return r;
+        }
+
+        if (!usedBytes)
+            break;
+
+        dataRemaining -= usedBytes;
+        dataStart += usedBytes;
+    }
+
+    return S_OK;
+}
+
+HRESULT CH264DXVADecoder::outputSoftwarePicture()
+{
+    m_fallbackFrame->SetComplete(false);
+    int64 start;
+    m_fallbackFrame->GetTime(&start, NULL);
+    if (std::numeric_limits<int64>::min() == start)
+        start = m_lastFrameTime;
+
+    // Already shown by the accelerator.
+    if ((m_lastOutStart != std::numeric_limits<int64>::min()) &&
+        (start <= m_lastOutStart))
+        return S_OK;
+
+    const int64 stop = start + m_estTimePerFrame;
+    m_lastFrameTime = stop;
+    m_lastOutStart = start;
+    if (isBeforeDeliveryStart(start))
+        return S_OK;
+
+    HRESULT r = queueSoftwarePicture(*m_fallback, *m_fallbackFrame, start,
+                                     stop);
+    if (FAILED(r))
+    {
+        m_softwareMode = false;
+        m_fallback.reset();
+        return r;
+    }
+
+    if (getStats())
+    {
+        if (S_OK == r)
+            getStats()->AddDecoded();
+        else
+            getStats()->AddDropped();
     }
+
+    return S_OK;
+}
+
+//------------------------------------------------------------------------------
+CH264DXVA1Decoder::CDXVABuffers::CDXVABuffers(IAMVideoAccelerator* accel)
+    : m_bufInfo(maxExecBuffers)
+    , m_bufDesc(maxExecBuffers)
+    , m_size(0)
+    , m_bufferCounts(compBufferCount, 1)
+    , m_nextIndex(compBufferCount, 0)
+    , m_accel(accel)
+{
+    assert(accel);
+}
+
+CH264DXVA1Decoder::CDXVABuffers::~CDXVABuffers()
+{
+    Clear();
+}
+
+void CH264DXVA1Decoder::CDXVABuffers::SetBufferCounts(
+    const AMVACompBufferInfo* info, int typeCount)
+{
+    assert(info);
+    typeCount = std::min(typeCount, compBufferCount);
+    for (int i = 0; i < typeCount; ++i)
+    {
+        m_bufferCounts[i] =
+            std::max(1, static_cast<int>(info[i].dwNumCompBuffers));
+        m_nextIndex[i] = 0;
+    }
+}
+
+HRESULT CH264DXVA1Decoder::CDXVABuffers::AllocExecBuffer(
+    int compType, const void* nonBitStreamData, int size, void** DXVABuffer)
+{
+    assert((compType >= 0) && (compType < compBufferCount));
+    if (m_size >= static_cast<int>(m_bufInfo.size()))
+        return E_OUTOFMEMORY;
+
+    // Take the buffers of a type in turn, so that the one the accelerator may
+    // still be reading from the previous execution isn't waited for.
+    const int bufIndex = m_nextIndex[compType];
+    void* allocated;
+    LONG stride;
+    HRESULT r = m_accel->GetBuffer(compType, bufIndex, FALSE, &allocated,
+                                   &stride);
+    assert(SUCCEEDED(r));
+    if (FAILED(r))
+        return r;
+
+    m_nextIndex[compType] = (bufIndex + 1) % m_bufferCounts[compType];
+
+    assert((compType != DXVA_BITSTREAM_DATA_BUFFER) || DXVABuffer);
+    if (compType != DXVA_BITSTREAM_DATA_BUFFER)
+        memcpy(allocated, nonBitStreamData, size);
+    else if (DXVABuffer)
+        *DXVABuffer = allocated;
+
+    AMVABUFFERINFO& info = m_bufInfo[m_size];
+    memset(&info, 0, sizeof(info));
+    info.dwTypeIndex = compType;
+    info.dwBufferIndex = bufIndex;
+    info.dwDataSize = size;
+
+    DXVA_BufferDescription& desc = m_bufDesc[m_size];
+    memset(&desc, 0, sizeof(desc));
+    desc.dwTypeIndex = compType;
+    desc.dwBufferIndex = bufIndex;
+    desc.dwDataSize = size;
+    m_size++;
+    return S_OK;
+}
+
+void CH264DXVA1Decoder::CDXVABuffers::ReviseLastDataSize(int size)
+{
+    if (!m_size)
+        return;
+
+    m_bufInfo[m_size - 1].dwDataSize = size;
+    m_bufDesc[m_size - 1].dwDataSize = size;
+}
+
+void CH264DXVA1Decoder::CDXVABuffers::Clear()
+{
+    for (int i = 0; i < m_size; ++i)
+    {
+        HRESULT r = m_accel->ReleaseBuffer(m_bufInfo[i].dwTypeIndex,
+                                           m_bufInfo[i].dwBufferIndex);
+        assert(SUCCEEDED(r));
+    }
+
+    m_size = 0;
+}
+
+AMVABUFFERINFO* CH264DXVA1Decoder::CDXVABuffers::GetBufferInfo()
+{
+    return &m_bufInfo[0];
+}
+
+DXVA_BufferDescription* CH264DXVA1Decoder::CDXVABuffers::GetBufferDesc()
+{
+    return &m_bufDesc[0];
+}
+
+CH264DXVA1Decoder::CH264DXVA1Decoder(const GUID& decoderID,
+                                     CCodecContext* preDecode,
+                                     IAMVideoAccelerator* accel,
+                                     int picEntryCount)
+    : CH264DXVADecoder(decoderID, preDecode, picEntryCount)
+    , m_accel(accel)
+    , m_batchExecute(true)
+    , m_batchConfirmed(false)
+    , m_execBuffers(accel)
+{
+    assert(accel);
+    setOutputLag(true);
+}
+
+CH264DXVA1Decoder::~CH264DXVA1Decoder()
+{
+}
+
+bool CH264DXVA1Decoder::Init(const DDPIXELFORMAT& pixelFormat,
+                             int64 averageTimePerFrame)
+{
+    assert(m_accel);
+
+    DXVA_ConfigPictureDecode configRequested;
+    memset(&configRequested, 0, sizeof(configRequested));
+    configRequested.guidConfigBitstreamEncryption = DXVA_NoEncrypt;
+    configRequested.guidConfigMBcontrolEncryption = DXVA_NoEncrypt;
+    configRequested.guidConfigResidDiffEncryption = DXVA_NoEncrypt;
+    configRequested.bConfigBitstreamRaw = 2;
+
+    writeDXVA_QueryOrReplyFunc(&configRequested.dwFunction,
+                               DXVA_QUERYORREPLYFUNCFLAG_DECODER_PROBE_QUERY,
+                               DXVA_PICTURE_DECODING_FUNCTION);
+    DXVA_ConfigPictureDecode config;
+    config.guidConfigBitstreamEncryption = DXVA_NoEncrypt;
+    config.guidConfigMBcontrolEncryption = DXVA_NoEncrypt;
+    config.guidConfigResidDiffEncryption = DXVA_NoEncrypt;
+    config.bConfigBitstreamRaw = 2;
+    HRESULT r = m_accel->Execute(configRequested.dwFunction, &configRequested,
+                                 sizeof(configRequested), &config,
+                                 sizeof(config), 0, NULL);
+    if (FAILED(r))
+        return false;
+
+    writeDXVA_QueryOrReplyFunc(&config.dwFunction,
+                               DXVA_QUERYORREPLYFUNCFLAG_DECODER_LOCK_QUERY,
+                               DXVA_PICTURE_DECODING_FUNCTION);
+    r = m_accel->Execute (config.dwFunction, &config, sizeof(config),
+                          &configRequested,
+                          sizeof(DXVA_ConfigPictureDecode), 0, NULL);
+
+    AMVAUncompDataInfo dataInfo;
+    DWORD d = compBufferCount;
+    dataInfo.dwUncompWidth = getPreDecode()->GetWidth();
+    dataInfo.dwUncompHeight = getPreDecode()->GetHeight();
+    memcpy(&dataInfo.ddUncompPixelFormat, &pixelFormat, sizeof(pixelFormat));
+    AMVACompBufferInfo compBufInfo[compBufferCount];
+    r = m_accel->GetCompBufferInfo(&GetDecoderID(), &dataInfo, &d, compBufInfo);
+    if (FAILED(r))
+        return false;
+
+    m_execBuffers.SetBufferCounts(compBufInfo, d);
+
+    int bitstreamBufferSize = 0;
+    if (d > DXVA_BITSTREAM_DATA_BUFFER)
+        bitstreamBufferSize =
+            compBufInfo[DXVA_BITSTREAM_DATA_BUFFER].dwBytesToAllocate;
+
+    int sliceControlBufferSize = 0;
+    if (d > DXVA_SLICE_CONTROL_BUFFER)
+        sliceControlBufferSize =
+            compBufInfo[DXVA_SLICE_CONTROL_BUFFER].dwBytesToAllocate;
+
+    setAcceleratorConfig(config.bConfigBitstreamRaw != 2, bitstreamBufferSize,
+                         sliceControlBufferSize, averageTimePerFrame);
+    return true;
+}
+
+HRESULT CH264DXVA1Decoder::DisplayNextFrame(IMediaSample* sample)
+{
+    if (!IsFrameReady())
+        return S_FALSE;
+
+    clearFrameReady();
+    HRESULT r = displayNextFrame(sample);
+    applyOutputLag();
+    return r;
+}
+
+HRESULT CH264DXVA1Decoder::getFreeSurface(
+    int* surfaceIndex, intrusive_ptr<IMediaSample>* sampleToDeliver)
+{
+    assert(surfaceIndex);
+    assert(sampleToDeliver);
+
+    if (getFieldSurface() != -1)
+    {
+        *surfaceIndex = getFieldSurface();
+        *sampleToDeliver = getFieldSample();
+        setFieldSample(NULL);
+        return S_FALSE;
+    }
+
+    // Taken off the list only once addToStandby() marks it in use.
+    const int slot = getFreeSlot();
+    if (slot >= 0)
+    {
+        *surfaceIndex = slot;
+        return S_OK;
+    }
+
+    assert(false);
+    Flush();
+    return E_UNEXPECTED;
+}
+
+HRESULT CH264DXVA1Decoder::beginFrame(int surfaceIndex)
+{
+    AMVABeginFrameInfo info;
+    info.dwDestSurfaceIndex = surfaceIndex;
+    info.dwSizeInputData = sizeof(surfaceIndex);
+    info.pInputData = &surfaceIndex;
+    info.dwSizeOutputData = 0;
+    info.pOutputData = NULL;
+
+    CTraceScope trace(H264_TRACE_BEGIN_FRAME, getCurrentPOC(getPicParams()),
+                      -1, surfaceIndex, -1);
+    CAcceleratorWait wait(GetWaitPolicy());
+    HRESULT r;
+    do
+    {
+        do
+            r = m_accel->BeginFrame(&info);
+        while ((E_PENDING == r) && wait.Spin());
+
+        if (SUCCEEDED(r))
+        {
+            do
+                r = m_accel->QueryRenderStatus(0xFFFFFFFF, 0, 0);
+            while ((E_PENDING == r) && wait.Spin());
+        }
+
+        if (SUCCEEDED(r))
+            break;
+
+        // Don't use PlatformThread::YieldCurrentThread() here, or the frames
+        // will probably get interleaved.
+    } while (wait.Sleep());
+
+    wait.Finish(r, getMutableWaitStats(), getStats());
+    return r;
+}
+
+HRESULT CH264DXVA1Decoder::endFrame(int surfaceIndex)
+{
+    AMVAEndFrameInfo endFrameInfo;
+    endFrameInfo.dwSizeMiscData = sizeof(surfaceIndex);
+    endFrameInfo.pMiscData = &surfaceIndex;
+    return m_accel->EndFrame(&endFrameInfo);
+}
+
+HRESULT CH264DXVA1Decoder::submitPicture(
+    const DXVA_Qmatrix_H264& scalingMatrix, bool scalingMatrixSent)
+{
+    // A DXVA1 accelerator keeps the last matrix it was given for the pictures
+    // that come without one, so it only goes out when the parameter sets
+    // change it.
+    const DXVA_Qmatrix_H264* const matrix =
+        scalingMatrixSent ? NULL : &scalingMatrix;
+    int executed = 0;
+    HRESULT r = submitPictureBuffers(matrix, m_batchExecute, &executed);
+    if (FAILED(r) && m_batchExecute && !m_batchConfirmed && !executed)
+    {
+        // The driver doesn't take the picture parameters along with the
+        // bitstream. Stay with separate executions from now on.
+        m_batchExecute = false;
+        r = submitPictureBuffers(matrix, false, &executed);
+    }
+
+    if (SUCCEEDED(r))
+        m_batchConfirmed = true;
+
+    return r;
+}
+
+HRESULT CH264DXVA1Decoder::submitPictureBuffers(
+    const DXVA_Qmatrix_H264* scalingMatrix, bool batched, int* executed)
+{
+    assert(executed);
+    *executed = 0;
+
+    // Send picture parameters
+    HRESULT r = m_execBuffers.AllocExecBuffer(DXVA_PICTURE_DECODE_BUFFER,
+                                              &getPicParams(),
+                                              sizeof(DXVA_PicParams_H264),
+                                              NULL);
+    if (SUCCEEDED(r) && !batched)
+    {
+        r = execute();
+        if (SUCCEEDED(r))
+            (*executed)++;
+    }
+
+    // Add bitstream, slice control and quantization matrix. Pictures that
+    // don't fit in one bitstream buffer go through several executions, the
+    // first of which also carries the picture parameters when batched. The
+    // matrix holds for the whole picture, so only the first one carries it,
+    // if it goes out at all.
+    const vector<TBitstreamChunk>& chunks = getChunks();
+    for (int i = 0; SUCCEEDED(r) && (i < static_cast<int>(chunks.size()));
+         ++i)
+    {
+        r = executeBitStreamChunk(chunks[i], i ? NULL : scalingMatrix);
+        if (SUCCEEDED(r))
+            (*executed)++;
+    }
+
+    // Give back whatever a failed step left allocated.
+    m_execBuffers.Clear();
+    return r;
+}
+
+HRESULT CH264DXVA1Decoder::execute()
+{
+    DWORD func = 0x01000000;
+    int32 result;
+    HRESULT r;
+    {
+        CStageTimer timer(getStats(), H264_STAGE_EXECUTE);
+        CTraceScope trace(H264_TRACE_EXECUTE, getCurrentPOC(getPicParams()),
+                          -1, getPicParams().CurrPic.Index7Bits,
+                          getExecuteSize(m_execBuffers.GetBufferDesc(),
+                                         m_execBuffers.GetSize()));
+        r = m_accel->Execute(
+            func, m_execBuffers.GetBufferDesc(),
+            sizeof(DXVA_BufferDescription) * m_execBuffers.GetSize(),
+            &result, sizeof(result), m_execBuffers.GetSize(),
+            m_execBuffers.GetBufferInfo());
+    }
+
+    m_execBuffers.Clear();
+    return r;
+}
+
+HRESULT CH264DXVA1Decoder::executeBitStreamChunk(
+    const TBitstreamChunk& chunk, const DXVA_Qmatrix_H264* scalingMatrix)
+{
+    void* DXVABuffer = NULL;
+    HRESULT r = m_execBuffers.AllocExecBuffer(DXVA_BITSTREAM_DATA_BUFFER,
+                                              NULL, 0, &DXVABuffer);
+    if (FAILED(r))
+        return r;
+
+    m_execBuffers.ReviseLastDataSize(
+        buildBitStreamAndRefFrameSlice(chunk, DXVABuffer));
+
+    int execBufSize;
+    const void* execBuf = getSliceControl(chunk, &execBufSize);
+    r = m_execBuffers.AllocExecBuffer(DXVA_SLICE_CONTROL_BUFFER, execBuf,
+                                      execBufSize, NULL);
+    if (FAILED(r))
+        return r;
+
+    if (scalingMatrix)
+    {
+        r = m_execBuffers.AllocExecBuffer(
+            DXVA_INVERSE_QUANTIZATION_MATRIX_BUFFER, scalingMatrix,
+            sizeof(*scalingMatrix), NULL);
+        if (FAILED(r))
+            return r;
+    }
+
+    // Decode bitstream
+    return execute();
 }
 
 HRESULT CH264DXVA1Decoder::displayNextFrame(IMediaSample* sample)
@@ -869,7 +1907,7 @@ HRESULT CH264DXVA1Decoder::displayNextFrame(IMediaSample* sample)
         return S_FALSE;
 
     HRESULT r = S_FALSE;
-    CDecodedPic& picRef = m_decodedPics[earliest];
+    CDecodedPic& picRef = getPicture(earliest);
     if (picRef.Start >= 0)
     {
         // For DXVA1, query a media sample at the last time (only one in the
@@ -881,9 +1919,473 @@ HRESULT CH264DXVA1Decoder::displayNextFrame(IMediaSample* sample)
             r = m_accel->DisplayFrame(earliest, sample);
     }
 
-    picRef.Displayed = true;
-    if (!picRef.RefPicture)
-        freePictureSlot(earliest);
+    markDisplayed(earliest);
+    return r;
+}
+
+//------------------------------------------------------------------------------
+CH264DXVA2Decoder::CH264DXVA2Decoder(const GUID& decoderID,
+                                     CCodecContext* preDecode,
+                                     IDirect3DDeviceManager9* deviceManager)
+    : CH264DXVADecoder(decoderID, preDecode, maxPictureSlots)
+    , m_deviceManager(deviceManager)
+    , m_device(NULL)
+    , m_service()
+    , m_videoDesc()
+    , m_config()
+    , m_accel()
+    , m_allocator(NULL)
+    , m_surfaces()
+    , m_bufferDesc()
+    , m_bufferSizesKnown(false)
+    , m_upload(new CSWScale)
+    , m_softwarePictures()
+{
+    assert(deviceManager);
+    memset(&m_videoDesc, 0, sizeof(m_videoDesc));
+    memset(&m_config, 0, sizeof(m_config));
+}
+
+CH264DXVA2Decoder::~CH264DXVA2Decoder()
+{
+    ReleaseSurfaces();
+    m_service = NULL;
+    if (m_device)
+        m_deviceManager->CloseDeviceHandle(m_device);
+}
+
+bool CH264DXVA2Decoder::Init(const DDPIXELFORMAT& pixelFormat,
+                             int64 averageTimePerFrame)
+{
+    if (m_service)
+        return true;
+
+    if (!m_device)
+    {
+        HRESULT r = m_deviceManager->OpenDeviceHandle(&m_device);
+        if (FAILED(r))
+        {
+            m_device = NULL;
+            return false;
+        }
+    }
+
+    intrusive_ptr<IDirectXVideoDecoderService> service;
+    HRESULT r = m_deviceManager->GetVideoService(
+        m_device, __uuidof(IDirectXVideoDecoderService),
+        reinterpret_cast<void**>(&service));
+    if (FAILED(r))
+        return false;
+
+    memset(&m_videoDesc, 0, sizeof(m_videoDesc));
+    m_videoDesc.SampleWidth = getPreDecode()->GetWidth();
+    m_videoDesc.SampleHeight = getPreDecode()->GetHeight();
+    m_videoDesc.Format = static_cast<D3DFORMAT>(MAKEFOURCC('N', 'V', '1', '2'));
+    if (averageTimePerFrame > 0)
+    {
+        m_videoDesc.InputSampleFreq.Numerator = 10000000;
+        m_videoDesc.InputSampleFreq.Denominator =
+            static_cast<UINT>(averageTimePerFrame);
+        m_videoDesc.OutputFrameFreq = m_videoDesc.InputSampleFreq;
+    }
+
+    UINT configCount = 0;
+    DXVA2_ConfigPictureDecode* configs = NULL;
+    r = service->GetDecoderConfigurations(GetDecoderID(), &m_videoDesc, NULL,
+                                          &configCount, &configs);
+    if (FAILED(r))
+        return false;
+
+    // Short slice controls leave the slice header parsing to the driver,
+    // which is what most of them are best at.
+    int chosen = -1;
+    for (UINT i = 0; i < configCount; ++i)
+    {
+        if (DXVA_NoEncrypt != configs[i].guidConfigBitstreamEncryption)
+            continue;
+
+        if (2 == configs[i].ConfigBitstreamRaw)
+        {
+            chosen = i;
+            break;
+        }
+
+        if ((1 == configs[i].ConfigBitstreamRaw) && (chosen < 0))
+            chosen = i;
+    }
+
+    if (chosen >= 0)
+        m_config = configs[chosen];
+
+    CoTaskMemFree(configs);
+    if (chosen < 0)
+        return false;
+
+    m_service = service;
+
+    // The buffer sizes are only known from IDirectXVideoDecoder::GetBuffer(),
+    // see probeBufferSizes().
+    setAcceleratorConfig(m_config.ConfigBitstreamRaw != 2, 0, 0,
+                         averageTimePerFrame);
+    return true;
+}
+
+bool CH264DXVA2Decoder::IsFrameReady() const
+{
+    return CH264DXVADecoder::IsFrameReady() || !m_softwarePictures.empty();
+}
+
+void CH264DXVA2Decoder::Flush()
+{
+    m_softwarePictures.clear();
+    CH264DXVADecoder::Flush();
+}
+
+HRESULT CH264DXVA2Decoder::GetDirectSample(IMediaSample** sample)
+{
+    assert(sample);
+    if (!m_softwarePictures.empty())
+    {
+        *sample = m_softwarePictures.front().get();
+        (*sample)->AddRef();
+        m_softwarePictures.pop_front();
+        return S_OK;
+    }
+
+    if (!IsFrameReady())
+        return S_FALSE;
+
+    clearFrameReady();
+    int earliest = findEarliestFrame();
+    if (earliest < 0)
+        return S_FALSE;
+
+    HRESULT r = S_FALSE;
+    CDecodedPic& picRef = getPicture(earliest);
+    IMediaSample* decoded = picRef.GetSample().get();
+    if ((picRef.Start >= 0) && decoded)
+    {
+        decoded->SetTime(&picRef.Start, &picRef.Stop);
+        decoded->SetMediaTime(NULL, NULL);
+        decoded->SetSyncPoint(TRUE);
+        setTypeSpecificFlags(picRef, decoded);
+        decoded->AddRef();
+        *sample = decoded;
+        r = S_OK;
+    }
+
+    markDisplayed(earliest);
+    return r;
+}
+
+HRESULT CH264DXVA2Decoder::CreateSurfaces(IMemAllocator* allocator, int count,
+                                          IDirect3DSurface9** surfaces)
+{
+    assert(allocator);
+    assert(surfaces);
+    if (!m_service)
+        return E_UNEXPECTED;
+
+    if ((count < 1) || (count > getPictureCount()))
+        return E_INVALIDARG;
+
+    ReleaseSurfaces();
+
+    // Whole macroblocks are decoded, so the surfaces are rounded up to them.
+    const int width = (getPreDecode()->GetWidth() + 15) & ~15;
+    const int height = (getPreDecode()->GetHeight() + 15) & ~15;
+    HRESULT r = m_service->CreateSurface(width, height, count - 1,
+                                         m_videoDesc.Format, D3DPOOL_DEFAULT,
+                                         0, DXVA2_VideoDecoderRenderTarget,
+                                         surfaces, NULL);
+    if (FAILED(r))
+        return r;
+
+    r = m_service->CreateVideoDecoder(GetDecoderID(), &m_videoDesc, &m_config,
+                                      surfaces, count,
+                                      reinterpret_cast<IDirectXVideoDecoder**>(
+                                          &m_accel));
+    if (FAILED(r))
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            surfaces[i]->Release();
+            surfaces[i] = NULL;
+        }
+
+        return r;
+    }
+
+    m_surfaces.assign(surfaces, surfaces + count);
+    m_allocator = allocator;
+    m_bufferSizesKnown = false;
+    return S_OK;
+}
+
+void CH264DXVA2Decoder::ReleaseSurfaces()
+{
+    // The allocator can't decommit while the samples are held.
+    m_softwarePictures.clear();
+    m_accel = NULL;
+    m_bufferSizesKnown = false;
+    m_surfaces.clear();
+    m_allocator = NULL;
+}
+
+HRESULT CH264DXVA2Decoder::getFreeSurface(
+    int* surfaceIndex, intrusive_ptr<IMediaSample>* sampleToDeliver)
+{
+    assert(surfaceIndex);
+    assert(sampleToDeliver);
+    if (!m_allocator || !m_accel)
+        return E_UNEXPECTED;
+
+    if (getFieldSurface() != -1)
+    {
+        *surfaceIndex = getFieldSurface();
+        *sampleToDeliver = getFieldSample();
+        setFieldSample(NULL);
+        return S_FALSE;
+    }
+
+    // The allocator only hands out samples nobody holds, so the surface is
+    // neither waiting for display nor a reference picture. The references,
+    // the pictures held back and the samples the renderer keeps can take all
+    // of them, and this runs under the filter's decode lock, which the
+    // quality messages need too: the wait is bounded like BeginFrame's.
+    CAcceleratorWait wait(GetWaitPolicy());
+    intrusive_ptr<IMediaSample> sample;
+    HRESULT r;
+    do
+    {
+        do
+            r = m_allocator->GetBuffer(
+                reinterpret_cast<IMediaSample**>(&sample), NULL, NULL,
+                AM_GBF_NOWAIT);
+        while ((VFW_E_TIMEOUT == r) && wait.Spin());
+
+        if (VFW_E_TIMEOUT != r)
+            break;
+    } while (wait.Sleep());
+
+    if (FAILED(r))
+        return r;
+
+    intrusive_ptr<IDirect3DSurface9> surface;
+    r = getSampleSurface(sample.get(), &surface);
+    if (FAILED(r))
+        return r;
+
+    for (int i = 0; i < static_cast<int>(m_surfaces.size()); ++i)
+    {
+        if (m_surfaces[i] == surface)
+        {
+            assert(!getPicture(i).InUse);
+            *surfaceIndex = i;
+            *sampleToDeliver = sample;
+            return S_OK;
+        }
+    }
+
+    assert(false);
+    return E_UNEXPECTED;
+}
+
+HRESULT CH264DXVA2Decoder::beginFrame(int surfaceIndex)
+{
+    assert(surfaceIndex < static_cast<int>(m_surfaces.size()));
+
+    // E_PENDING while the surface is still being read by the renderer.
+    CTraceScope trace(H264_TRACE_BEGIN_FRAME, getCurrentPOC(getPicParams()),
+                      -1, surfaceIndex, -1);
+    CAcceleratorWait wait(GetWaitPolicy());
+    HRESULT r;
+    do
+    {
+        do
+            r = m_accel->BeginFrame(m_surfaces[surfaceIndex].get(), NULL);
+        while ((E_PENDING == r) && wait.Spin());
+
+        if (E_PENDING != r)
+            break;
+    } while (wait.Sleep());
+
+    wait.Finish(r, getMutableWaitStats(), getStats());
+    if (SUCCEEDED(r) && !m_bufferSizesKnown)
+        probeBufferSizes();
 
     return r;
+}
+
+HRESULT CH264DXVA2Decoder::submitPicture(
+    const DXVA_Qmatrix_H264& scalingMatrix, bool scalingMatrixSent)
+{
+    // |scalingMatrixSent| doesn't help here: every DXVA2 execution is decoded
+    // from its own buffers, and the H.264 drivers take the matrix with each
+    // picture parameters buffer rather than keep one from an earlier call.
+    const vector<TBitstreamChunk>& chunks = getChunks();
+    HRESULT r = S_OK;
+    for (int i = 0; SUCCEEDED(r) && (i < static_cast<int>(chunks.size())); ++i)
+        r = executeBitStreamChunk(chunks[i], scalingMatrix);
+
+    return r;
+}
+
+HRESULT CH264DXVA2Decoder::endFrame(int surfaceIndex)
+{
+    return m_accel->EndFrame(NULL);
+}
+
+HRESULT CH264DXVA2Decoder::queueSoftwarePicture(const CCodecContext& codec,
+                                                const CVideoFrame& frame,
+                                                int64 start, int64 stop)
+{
+    if (!m_allocator)
+        return E_UNEXPECTED;
+
+    // The samples queued here are not free for the allocator to hand out, so
+    // waiting for one could wait for good.
+    intrusive_ptr<IMediaSample> sample;
+    HRESULT r = m_allocator->GetBuffer(
+        reinterpret_cast<IMediaSample**>(&sample), NULL, NULL, AM_GBF_NOWAIT);
+    if (FAILED(r))
+        return S_FALSE;
+
+    intrusive_ptr<IDirect3DSurface9> surface;
+    r = getSampleSurface(sample.get(), &surface);
+    if (FAILED(r))
+        return r;
+
+    D3DSURFACE_DESC desc;
+    r = surface->GetDesc(&desc);
+    if (FAILED(r))
+        return r;
+
+    D3DLOCKED_RECT locked;
+    r = surface->LockRect(&locked, NULL, 0);
+    if (FAILED(r))
+        return r;
+
+    // The chroma plane of an NV12 surface follows the luma plane, at the
+    // same pitch.
+    bool converted;
+    {
+        CStageTimer timer(getStats(), H264_STAGE_CONVERT);
+        converted = m_upload->Init(codec, MEDIASUBTYPE_NV12, locked.Pitch,
+                                   desc.Height) &&
+            m_upload->Convert(frame, locked.pBits);
+    }
+    surface->UnlockRect();
+    if (!converted)
+        return E_FAIL;
+
+    sample->SetTime(&start, &stop);
+    sample->SetMediaTime(NULL, NULL);
+    sample->SetSyncPoint(TRUE);
+    const_cast<CVideoFrame&>(frame).SetTypeSpecificFlags(sample.get());
+    m_softwarePictures.push_back(sample);
+    return S_OK;
+}
+
+void CH264DXVA2Decoder::probeBufferSizes()
+{
+    // Looked at within the first frame, as drivers only hand out buffers
+    // between BeginFrame() and EndFrame().
+    int sizes[2] = {0};
+    const int types[2] =
+    {
+        DXVA2_BitStreamDateBufferType, DXVA2_SliceControlBufferType
+    };
+    for (int i = 0; i < arraysize(types); ++i)
+    {
+        void* buffer;
+        UINT bufferSize;
+        if (SUCCEEDED(m_accel->GetBuffer(types[i], &buffer, &bufferSize)))
+        {
+            sizes[i] = static_cast<int>(bufferSize);
+            m_accel->ReleaseBuffer(types[i]);
+        }
+    }
+
+    setBufferSizes(sizes[0], sizes[1]);
+    m_bufferSizesKnown = true;
+}
+
+HRESULT CH264DXVA2Decoder::copyToBuffer(int type, const void* data, int size)
+{
+    void* buffer;
+    UINT bufferSize;
+    HRESULT r = m_accel->GetBuffer(type, &buffer, &bufferSize);
+    if (FAILED(r))
+        return r;
+
+    if (size <= static_cast<int>(bufferSize))
+        memcpy(buffer, data, size);
+
+    m_accel->ReleaseBuffer(type);
+    if (size > static_cast<int>(bufferSize))
+        return E_OUTOFMEMORY;
+
+    DXVA2_DecodeBufferDesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.CompressedBufferType = type;
+    desc.DataSize = size;
+    m_bufferDesc.push_back(desc);
+    return S_OK;
+}
+
+HRESULT CH264DXVA2Decoder::executeBitStreamChunk(
+    const TBitstreamChunk& chunk, const DXVA_Qmatrix_H264& scalingMatrix)
+{
+    // Every execution carries the picture parameters, so that a picture split
+    // over several bitstream buffers needs no special casing.
+    m_bufferDesc.clear();
+    HRESULT r = copyToBuffer(DXVA2_PictureParametersBufferType,
+                             &getPicParams(), sizeof(DXVA_PicParams_H264));
+    if (FAILED(r))
+        return r;
+
+    r = copyToBuffer(DXVA2_InverseQuantizationMatrixBufferType, &scalingMatrix,
+                     sizeof(scalingMatrix));
+    if (FAILED(r))
+        return r;
+
+    void* buffer;
+    UINT bufferSize;
+    r = m_accel->GetBuffer(DXVA2_BitStreamDateBufferType, &buffer, &bufferSize);
+    if (FAILED(r))
+        return r;
+
+    int size = 0;
+    if (chunk.Size + bitstreamAlignment <= static_cast<int>(bufferSize))
+        size = buildBitStreamAndRefFrameSlice(chunk, buffer);
+
+    m_accel->ReleaseBuffer(DXVA2_BitStreamDateBufferType);
+    if (!size)
+        return E_OUTOFMEMORY;
+
+    DXVA2_DecodeBufferDesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.CompressedBufferType = DXVA2_BitStreamDateBufferType;
+    desc.DataSize = size;
+    m_bufferDesc.push_back(desc);
+
+    // After the bitstream, which pads the last slice.
+    int sliceControlSize;
+    const void* sliceControl = getSliceControl(chunk, &sliceControlSize);
+    r = copyToBuffer(DXVA2_SliceControlBufferType, sliceControl,
+                     sliceControlSize);
+    if (FAILED(r))
+        return r;
+
+    DXVA2_DecodeExecuteParams params;
+    memset(&params, 0, sizeof(params));
+    params.NumCompBuffers = static_cast<UINT>(m_bufferDesc.size());
+    params.pCompressedBuffers = &m_bufferDesc[0];
+
+    CStageTimer timer(getStats(), H264_STAGE_EXECUTE);
+    CTraceScope trace(H264_TRACE_EXECUTE, getCurrentPOC(getPicParams()),
+                      chunk.SliceCount, getPicParams().CurrPic.Index7Bits,
+                      chunk.Size);
+    return m_accel->Execute(&params);
 }
\ No newline at end of file
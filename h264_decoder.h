@@ -1,6 +1,8 @@
 #ifndef _H264_DECODER_H_
 #define _H264_DECODER_H_
 
+#include <deque>
+#include <map>
 #include <vector>
 
 #include <boost/intrusive_ptr.hpp>
@@ -12,26 +14,88 @@
 #include <d3dx9.h>
 #include <videoacc.h>
 #include <dxva.h>
+#include <dxva2api.h>
 
 #include "chromium/base/basictypes.h"
+#include "h264_detail.h"
 
 class CCodecContext;
+class CDecoderStats;
 class CH264Decoder
 {
 public:
+    // Which pictures Decode() leaves out, for scrubbing and thumbnailing.
+    enum KSkipMode
+    {
+        SKIP_NONE = 0,
+        SKIP_NON_REF = 1,   // Pictures no other picture refers to
+        SKIP_NON_KEY = 2    // All but I pictures
+    };
+
+    // Load shedding when the downstream falls behind. Each level also does
+    // what the ones below it do.
+    enum KDegradation
+    {
+        DEGRADE_NONE = 0,
+        DEGRADE_LOOP_FILTER = 1,    // No deblocking of non-reference pictures
+        DEGRADE_SKIP_CONVERT = 2,   // Non-reference pictures decoded only
+        DEGRADE_SKIP_DECODE = 3,    // Non-reference pictures left out
+        DEGRADE_LEVEL_COUNT = 4
+    };
+
     CH264Decoder(const GUID& decoderID, CCodecContext* preDecode);
     virtual ~CH264Decoder();
 
     const GUID& GetDecoderID() const { return m_decoderID; }
 
+    // Where the decoder counts its pictures and times its stages; NULL for
+    // nowhere. Must outlive the decoder.
+    void SetStats(CDecoderStats* stats) { m_stats = stats; }
+
+    // Pictures that start before |deliverFrom| are still decoded, since later
+    // ones may refer to them, but never become ready.
+    // std::numeric_limits<int64>::min() delivers everything. Takes effect
+    // from the next Decode().
+    virtual void SetSkipMode(KSkipMode mode, int64 deliverFrom);
+
+    // The levels that concern the output of software decoding do nothing for
+    // the DXVA decoders.
+    virtual void SetDegradation(KDegradation level) { m_degradation = level; }
+
     virtual bool Init(const DDPIXELFORMAT& pixelFormat,
                       int64 averageTimePerFrame) = 0;
     virtual HRESULT Decode(const void* data, int size, int64 start, int64 stop,
-                           IMediaSample* outSample, int* bytesUsed) = 0;
-    virtual HRESULT DisplayNextFrame(IMediaSample* sample) { return E_NOTIMPL; }
+                           int* bytesUsed) = 0;
+
+    // A picture is waiting for DisplayNextFrame(). The caller only acquires
+    // an output sample once this is true.
+    virtual bool IsFrameReady() const = 0;
+
+    // Returns S_FALSE if there was nothing to display and |sample| is
+    // untouched.
+    virtual HRESULT DisplayNextFrame(IMediaSample* sample) = 0;
     virtual void Flush();
     virtual bool NeedCustomizeAllocator() { return false; }
 
+    // False if DisplayNextFrame() already presented the sample itself.
+    virtual bool NeedDeliverSample() { return true; }
+
+    // Lets the decoder write pictures straight into samples taken from
+    // |allocator| when |outType| has a compatible layout. NULL turns it off.
+    virtual bool SetDirectRender(IMemAllocator* allocator,
+                                 const AM_MEDIA_TYPE* outType)
+    {
+        return false;
+    }
+
+    // S_OK if the ready picture already lives in |*sample|, which then
+    // replaces the DisplayNextFrame() call. S_FALSE otherwise.
+    virtual HRESULT GetDirectSample(IMediaSample** sample) { return S_FALSE; }
+
+    // True if the samples from GetDirectSample() carry their presentation
+    // times, rather than taking those of the input sample.
+    virtual bool HasOwnTimeStamps() const { return false; }
+
 protected:
     struct TDeocdedPicDesc
     {
@@ -73,10 +137,21 @@ protected:
     }
     void setFieldSample(IMediaSample* s) { m_fieldSample = s; }
     int incrementDispCount() { return m_displayCount++; }
+    CDecoderStats* getStats() { return m_stats; }
+    KSkipMode getSkipMode() const { return m_skipMode; }
+    KDegradation getDegradation() const { return m_degradation; }
+    bool isBeforeDeliveryStart(int64 start) const
+    {
+        return start < m_deliverFrom;
+    }
 
 private:
     GUID m_decoderID;
     CCodecContext* m_preDecode;
+    CDecoderStats* m_stats;
+    KSkipMode m_skipMode;
+    int64 m_deliverFrom;
+    KDegradation m_degradation;
     bool m_flushed;
     int m_fieldSurface;
     boost::intrusive_ptr<IMediaSample> m_fieldSample;
@@ -95,15 +170,242 @@ public:
     virtual bool Init(const DDPIXELFORMAT& pixelFormat,
                       int64 averageTimePerFrame);
     virtual HRESULT Decode(const void* data, int size, int64 start, int64 stop,
-                           IMediaSample* outSample, int* bytesUsed);
+                           int* bytesUsed);
+    virtual bool IsFrameReady() const;
+    virtual HRESULT DisplayNextFrame(IMediaSample* sample);
+    virtual void Flush();
+    virtual bool SetDirectRender(IMemAllocator* allocator,
+                                 const AM_MEDIA_TYPE* outType);
+    virtual HRESULT GetDirectSample(IMediaSample** sample);
+    virtual void SetSkipMode(KSkipMode mode, int64 deliverFrom);
+    virtual void SetDegradation(KDegradation level);
 
 private:
+    class CSampleFrameAllocator;
+
+    void applySkipLevels();
+
     boost::scoped_ptr<CVideoFrame> m_frame;
     boost::scoped_ptr<CSWScale> m_scale;
+    boost::scoped_ptr<CSampleFrameAllocator> m_directRender;
 };
 
 //------------------------------------------------------------------------------
-class CH264DXVA1Decoder : public CH264Decoder
+// Parsing, picture slot bookkeeping and reordering shared by the DXVA1 and
+// DXVA2 decoders; the subclasses only talk to their accelerator.
+class CH264NALIndex;
+class CH264DXVADecoder : public CH264Decoder
+{
+public:
+    // How beginFrame() waits while the accelerator has no surface to decode
+    // into.
+    struct TWaitPolicy
+    {
+        int SpinCount;      // Yields before the first sleep
+        int MaxBackoff;     // Upper bound of the doubling sleep, in ms
+        int Timeout;        // Give up after this long, in ms
+    };
+
+    struct TWaitStats
+    {
+        int64 Immediate;    // Surface available on the first try
+        int64 Spun;         // Available within the spin budget
+        int64 Slept;        // Available after sleeping
+        int64 Failed;       // Timed out or refused
+        int64 Spins;
+        int64 Sleeps;
+        int64 WaitTime;     // Total time spent in beginFrame(), in us
+        int64 MaxWaitTime;  // In us
+    };
+
+    CH264DXVADecoder(const GUID& decoderID, CCodecContext* preDecode,
+                     int picEntryCount);
+    virtual ~CH264DXVADecoder();
+
+    virtual HRESULT Decode(const void* data, int size, int64 start, int64 stop,
+                           int* bytesUsed);
+    virtual bool IsFrameReady() const { return m_frameReady; }
+    virtual void Flush();
+
+    void SetWaitPolicy(const TWaitPolicy& policy);
+    const TWaitPolicy& GetWaitPolicy() const { return m_waitPolicy; }
+    const TWaitStats& GetWaitStats() const { return m_waitStats; }
+
+    // A software decoder fed the same stream, for the GOPs the accelerator
+    // turns down: the access units since the last IDR picture are kept, and
+    // when a picture is refused they are decoded again in software, up to the
+    // next IDR picture. Needs a subclass that can show software decoded
+    // pictures. NULL turns it off.
+    void SetFallback(const boost::shared_ptr<CCodecContext>& fallback);
+
+    // What a fallback for |codec| can hold at most: its pictures and the
+    // access units kept since the last IDR picture.
+    static int64 GetFallbackMemory(const CCodecContext& codec);
+
+protected:
+    // Slices of a picture that go to the accelerator in one execution.
+    struct TBitstreamChunk
+    {
+        int FirstUnit;      // Range in the NAL index
+        int EndUnit;
+        int FirstSlice;
+        int SliceCount;
+        int Size;           // Excluding padding
+    };
+
+    // The accelerator side of Decode(). getFreeSurface() returns S_FALSE for
+    // the second field of a picture, which goes to the surface of the first,
+    // and VFW_E_TIMEOUT when none came free within the wait policy, which
+    // drops the picture.
+    virtual HRESULT getFreeSurface(
+        int* surfaceIndex, boost::intrusive_ptr<IMediaSample>* sample) = 0;
+    virtual HRESULT beginFrame(int surfaceIndex) = 0;
+
+    // |scalingMatrixSent| is true once the accelerator has taken the matrix
+    // since it last changed, so the subclasses that may leave it out can.
+    virtual HRESULT submitPicture(const DXVA_Qmatrix_H264& scalingMatrix,
+                                  bool scalingMatrixSent) = 0;
+    virtual HRESULT endFrame(int surfaceIndex) = 0;
+
+    // From Init() of the subclasses. Sizes are in bytes; 0 for no limit.
+    void setAcceleratorConfig(bool useLongSlice, int bitstreamBufferSize,
+                              int sliceControlBufferSize,
+                              int64 averageTimePerFrame);
+
+    // For accelerators that only tell their buffer sizes later; may be
+    // called from beginFrame(), and the picture is then planned again.
+    void setBufferSizes(int bitstreamBufferSize, int sliceControlBufferSize);
+
+    const DXVA_PicParams_H264& getPicParams() const { return m_picParams; }
+    const std::vector<TBitstreamChunk>& getChunks() const { return m_chunks; }
+    int buildBitStreamAndRefFrameSlice(const TBitstreamChunk& chunk,
+                                       void* dest);
+    const void* getSliceControl(const TBitstreamChunk& chunk,
+                                int* size) const;
+
+    int getPictureCount() const
+    {
+        return static_cast<int>(m_decodedPics.size());
+    }
+    CDecodedPic& getPicture(int index) { return m_decodedPics[index]; }
+
+    // The free slot that has been free the longest, or -1.
+    int getFreeSlot() const;
+
+    // The next picture in display order, with its time stamps filled in, or
+    // -1. markDisplayed() then releases it unless it is still a reference.
+    int findEarliestFrame();
+    void markDisplayed(int index);
+    void clearFrameReady() { m_frameReady = false; }
+
+    // With the lag, the picture libavcodec names for display while parsing
+    // an access unit is only taken up by applyOutputLag(), which DXVA1 calls
+    // after displaying the one named before, as it always has. Without it,
+    // the picture named is the next one displayed. Low latency streams
+    // never lag.
+    void setOutputLag(bool lag) { m_outputLag = lag; }
+    void applyOutputLag();
+    void setTypeSpecificFlags(const CDecodedPic& pic, IMediaSample* sample);
+    TWaitStats* getMutableWaitStats() { return &m_waitStats; }
+
+    // Takes a picture of the software decoder, in display order. S_FALSE
+    // drops it, for want of a sample; other failures end the hybrid
+    // decoding.
+    virtual HRESULT queueSoftwarePicture(const CCodecContext& codec,
+                                         const CVideoFrame& frame,
+                                         int64 start, int64 stop)
+    {
+        return E_NOTIMPL;
+    }
+
+private:
+    // An access unit kept for the software decoder, with its padding.
+    struct TAccessUnit
+    {
+        std::vector<uint8> Data;
+        int Size;
+        int64 Start;
+        int64 Stop;
+    };
+
+    bool reserveSlices(int sliceCount);
+    bool updateRefFrameSliceLong(int slice, int dataOffset, int sliceLength);
+    bool updateRefFrameSliceShort(int slice, int dataOffset, int sliceLength);
+    int planBitStreamChunks(const CH264NALIndex& index);
+    bool addToStandby(int surfaceIndex,
+                      const boost::intrusive_ptr<IMediaSample>& sample,
+                      bool isRefPicture, int64 start, int64 stop, bool isField,
+                      int fieldType, int sliceType, int codecSpecific);
+    void resetPictureSlots();
+    void clearUnusedRefFrames(uint32 refFrameMask);
+    void removeRefFrame(int surfaceIndex);
+    void freePictureSlot(int surfaceIndex);
+    void removePendingDisplay(int surfaceIndex);
+    bool hasIDRPicture() const;
+    void keepAccessUnit(const void* data, int size, int64 start, int64 stop,
+                        bool IDR);
+
+    // Decodes the kept access units, the current one included, in software
+    // and stays there until the next IDR picture. False if the GOP could not
+    // be kept whole, or software decoding failed as well.
+    bool recoverInSoftware(int size, int* bytesUsed);
+    void leaveSoftware();
+    HRESULT decodeSoftware(const void* data, int size, int64 start,
+                           int64 stop);
+    HRESULT outputSoftwarePicture();
+
+    DXVA_PicParams_H264 m_picParams;
+    DXVA_Qmatrix_H264 m_scalingMatrix;
+    bool m_scalingMatrixSent;
+    h264_detail::TParameterSetCache m_parameterSets;
+    std::vector<DXVA_Slice_H264_Long> m_sliceLong;
+    std::vector<DXVA_Slice_H264_Short> m_sliceShort;
+    bool m_useLongSlice;
+    std::vector<CDecodedPic> m_decodedPics;
+
+    // Slots that are not in use, in the order they were freed, which is the
+    // order of their DisplayCount.
+    std::deque<int> m_freeSlots;
+
+    // Slots in use and not displayed yet, by POC.
+    std::multimap<int, int> m_pendingDisplay;
+
+    // Bit per slot that was displayed but is still held as a reference.
+    uint32 m_displayedRefs;
+    boost::scoped_ptr<CH264NALIndex> m_NALIndex;
+    std::vector<TBitstreamChunk> m_chunks;
+    int m_maxSlices;
+    int m_bitstreamBufferSize;
+    int m_sliceControlBufferSize;
+    bool m_chunksStale;     // Planned for other buffer sizes
+    TWaitPolicy m_waitPolicy;
+    TWaitStats m_waitStats;
+    bool m_frameReady;
+    int m_outPOC;
+    int64 m_outStart;
+    bool m_outputLag;
+    int m_laggedOutPOC;     // std::numeric_limits<int>::min() for none
+    int64 m_laggedOutStart;
+    int64 m_lastFrameTime;
+    int64 m_estTimePerFrame;
+    boost::shared_ptr<CCodecContext> m_fallback;
+    boost::scoped_ptr<CVideoFrame> m_fallbackFrame;
+
+    // The GOP so far; the first |m_gopCount| entries are in use, the others
+    // keep their buffers for the next GOP.
+    std::vector<TAccessUnit> m_gop;
+    int m_gopCount;
+    int m_gopSize;
+    bool m_gopComplete;
+    bool m_softwareMode;
+
+    // Start of the last picture shown, so that the software decoder doesn't
+    // show the ones the accelerator did again.
+    int64 m_lastOutStart;
+};
+
+//------------------------------------------------------------------------------
+class CH264DXVA1Decoder : public CH264DXVADecoder
 {
 public:
     CH264DXVA1Decoder(const GUID& decoderID, CCodecContext* preDecode,
@@ -112,10 +414,16 @@ public:
 
     virtual bool Init(const DDPIXELFORMAT& pixelFormat,
                       int64 averageTimePerFrame);
-    virtual HRESULT Decode(const void* data, int size, int64 start, int64 stop,
-                           IMediaSample* outSample, int* bytesUsed);
-    virtual HRESULT DisplayNextFrame(IMediaSample* sample) { return S_OK; }
-    virtual void Flush();
+    virtual HRESULT DisplayNextFrame(IMediaSample* sample);
+    virtual bool NeedDeliverSample() { return false; }
+
+protected:
+    virtual HRESULT getFreeSurface(
+        int* surfaceIndex, boost::intrusive_ptr<IMediaSample>* sample);
+    virtual HRESULT beginFrame(int surfaceIndex);
+    virtual HRESULT submitPicture(const DXVA_Qmatrix_H264& scalingMatrix,
+                                  bool scalingMatrixSent);
+    virtual HRESULT endFrame(int surfaceIndex);
 
 private:
     class CDXVABuffers
@@ -124,51 +432,109 @@ private:
         explicit CDXVABuffers(IAMVideoAccelerator* accel);
         ~CDXVABuffers();
 
-        int GetSize() const { return m_bufInfo.size(); }
-        HRESULT AllocExecBuffer(int compType, int bufIndex,
-                                const void* nonBitStreamData, int size,
-                                void** DXVABuffer);
+        // How many buffers of each type the accelerator has, as reported by
+        // GetCompBufferInfo().
+        void SetBufferCounts(const AMVACompBufferInfo* info, int typeCount);
+
+        int GetSize() const { return m_size; }
+        HRESULT AllocExecBuffer(int compType, const void* nonBitStreamData,
+                                int size, void** DXVABuffer);
         void ReviseLastDataSize(int size);
         void Clear();
         AMVABUFFERINFO* GetBufferInfo();
         DXVA_BufferDescription* GetBufferDesc();
 
     private:
+        // Sized once; only the first |m_size| entries are in use.
         std::vector<AMVABUFFERINFO> m_bufInfo;
         std::vector<DXVA_BufferDescription> m_bufDesc;
+        int m_size;
+
+        // Per buffer type, indexed by DXVA buffer type.
+        std::vector<int> m_bufferCounts;
+        std::vector<int> m_nextIndex;
         IAMVideoAccelerator* m_accel;
     };
 
-    HRESULT getFreeSurfaceIndex(
-        int* surfaceIndex, boost::intrusive_ptr<IMediaSample>* sampleToDeliver);
-    HRESULT beginFrame(int surfaceIndex);
-    HRESULT endFrame(int surfaceIndex);
+    // A NULL |scalingMatrix| leaves out the inverse quantization buffer.
+    HRESULT submitPictureBuffers(const DXVA_Qmatrix_H264* scalingMatrix,
+                                 bool batched, int* executed);
     HRESULT execute();
-    bool updateRefFrameSliceLong(int slice, int dataOffset, int sliceLength);
-    bool updateRefFrameSliceShort(int slice, int dataOffset, int sliceLength);
-    int buildBitStreamAndRefFrameSlice(const void* data, int size, void* dest);
-    bool addToStandby(int surfaceIndex,
-                      const boost::intrusive_ptr<IMediaSample>& sample,
-                      bool isRefPicture, int64 start, int64 stop, bool isField,
-                      int fieldType, int sliceType, int codecSpecific);
-    void clearUnusedRefFrames();
-    void removeRefFrame(int surfaceIndex);
-    void freePictureSlot(int surfaceIndex);
-    int findEarliestFrame();
-    void setTypeSpecificFlags(const CDecodedPic& pic, IMediaSample* sample);
+
+    // A NULL |scalingMatrix| leaves out the inverse quantization buffer.
+    HRESULT executeBitStreamChunk(const TBitstreamChunk& chunk,
+                                  const DXVA_Qmatrix_H264* scalingMatrix);
     HRESULT displayNextFrame(IMediaSample* sample);
 
     boost::intrusive_ptr<IAMVideoAccelerator> m_accel;
-    DXVA_PicParams_H264 m_picParams;
-    std::vector<DXVA_Slice_H264_Long> m_sliceLong;
-    std::vector<DXVA_Slice_H264_Short> m_sliceShort;
-    bool m_useLongSlice;
-    std::vector<CDecodedPic> m_decodedPics;
+    bool m_batchExecute;
+    bool m_batchConfirmed;
     CDXVABuffers m_execBuffers;
-    int m_outPOC;
-    int64 m_outStart;
-    int64 m_lastFrameTime;
-    int64 m_estTimePerFrame;
+};
+
+//------------------------------------------------------------------------------
+// Decodes into the Direct3D surfaces of a CDXVA2Allocator, whose samples then
+// go downstream as they are; that is how the EVR takes hardware decoded
+// pictures.
+class CH264DXVA2Decoder : public CH264DXVADecoder
+{
+public:
+    CH264DXVA2Decoder(const GUID& decoderID, CCodecContext* preDecode,
+                      IDirect3DDeviceManager9* deviceManager);
+    virtual ~CH264DXVA2Decoder();
+
+    // Finds a decoder configuration; the accelerator itself is only created
+    // along with the surfaces. Does nothing once it has succeeded.
+    virtual bool Init(const DDPIXELFORMAT& pixelFormat,
+                      int64 averageTimePerFrame);
+    virtual bool IsFrameReady() const;
+    virtual HRESULT DisplayNextFrame(IMediaSample* sample) { return S_FALSE; }
+    virtual void Flush();
+    virtual HRESULT GetDirectSample(IMediaSample** sample);
+    virtual bool HasOwnTimeStamps() const { return true; }
+
+    // Called by the allocator when it is committed and decommitted. On
+    // success |surfaces| holds a reference to each surface for the samples of
+    // |allocator|, which must keep them in the same order.
+    HRESULT CreateSurfaces(IMemAllocator* allocator, int count,
+                           IDirect3DSurface9** surfaces);
+    void ReleaseSurfaces();
+
+protected:
+    virtual HRESULT getFreeSurface(
+        int* surfaceIndex, boost::intrusive_ptr<IMediaSample>* sample);
+    virtual HRESULT beginFrame(int surfaceIndex);
+    virtual HRESULT submitPicture(const DXVA_Qmatrix_H264& scalingMatrix,
+                                  bool scalingMatrixSent);
+    virtual HRESULT endFrame(int surfaceIndex);
+
+    // Writes the picture into the surface of a sample of the allocator.
+    virtual HRESULT queueSoftwarePicture(const CCodecContext& codec,
+                                         const CVideoFrame& frame,
+                                         int64 start, int64 stop);
+
+private:
+    // Feeds the buffer sizes of a new accelerator into the chunk planning.
+    void probeBufferSizes();
+    HRESULT copyToBuffer(int type, const void* data, int size);
+    HRESULT executeBitStreamChunk(const TBitstreamChunk& chunk,
+                                  const DXVA_Qmatrix_H264& scalingMatrix);
+
+    boost::intrusive_ptr<IDirect3DDeviceManager9> m_deviceManager;
+    HANDLE m_device;
+    boost::intrusive_ptr<IDirectXVideoDecoderService> m_service;
+    DXVA2_VideoDesc m_videoDesc;
+    DXVA2_ConfigPictureDecode m_config;
+    boost::intrusive_ptr<IDirectXVideoDecoder> m_accel;
+    IMemAllocator* m_allocator;
+    std::vector<boost::intrusive_ptr<IDirect3DSurface9> > m_surfaces;
+    std::vector<DXVA2_DecodeBufferDesc> m_bufferDesc;
+    bool m_bufferSizesKnown;
+    boost::scoped_ptr<CSWScale> m_upload;
+
+    // Software decoded pictures, which go out before any decoded by the
+    // accelerator.
+    std::deque<boost::intrusive_ptr<IMediaSample> > m_softwarePictures;
 };
 
 #endif  // _H264_DECODER_H_
\ No newline at end of file
@@ -1,15 +1,21 @@
 #include "h264_decoder_filter.h"
 
+#include <algorithm>
 #include <cassert>
 
 #include <initguid.h>
 #include <dvdmedia.h>
+#include <evr.h>
 
+#include "csp_convert.h"
+#include "decoder_trace.h"
+#include "dxva2_allocator.h"
 #include "ffmpeg.h"
+#include "frame_arena.h"
 #include "h264_decoder.h"
+#include "hw_capability_cache.h"
 #include "chromium/base/win_util.h"
 #include "common/dshow_util.h"
-#include "common/hardware_env.h"
 #include "common/intrusive_ptr_helper.h"
 #include "utils.h"
 
@@ -26,8 +32,169 @@ inline int getDecodeSurfacesCount()
 
 const wchar_t* outputPinName = L"CH264DecoderOutputPin";
 const wchar_t* inputPinName = L"CH264DecoderInputPin";
+
+const int defaultInputQueueDepth = 16;
+const int defaultOutputQueueDepth = 4;
+const int samplePoolCapacity = 2;
+
+// Output samples asked for on top of the reference frames when decoding
+// directly into them: the picture being decoded, one waiting for display and
+// one held downstream.
+const int directRenderExtraBuffers = 3;
+const int maxDirectRenderBuffers = 16 + directRenderExtraBuffers;
+
+// The class ID of the filter of |pin|, which keeps the answers of different
+// renderers apart in the capability cache. GUID_NULL if it has none.
+CLSID getRendererID(IPin* pin)
+{
+    CLSID rendererID = GUID_NULL;
+    PIN_INFO info;
+    if (!pin || FAILED(pin->QueryPinInfo(&info)))
+        return rendererID;
+
+    if (info.pFilter)
+    {
+        info.pFilter->GetClassID(&rendererID);
+        info.pFilter->Release();
+    }
+
+    return rendererID;
+}
+
+// Input buffers start on a multiple of this, for the SIMD start code scanners.
+const int inputAlignment = 16;
+
+// Staging grows in steps of this, so that slowly growing samples don't
+// reallocate each time.
+const int stagingGranularity = 64 * 1024;
+
+// Hides the padding from upstream: the buffers are that much longer than the
+// size agreed on, which upstream never fills.
+class CPaddedMemAllocator : public CMemAllocator
+{
+public:
+    explicit CPaddedMemAllocator(HRESULT* r)
+        : CMemAllocator(L"CPaddedMemAllocator", NULL, r)
+    {
+    }
+
+    virtual HRESULT __stdcall SetProperties(ALLOCATOR_PROPERTIES* request,
+                                            ALLOCATOR_PROPERTIES* actual)
+    {
+        CheckPointer(request, E_POINTER);
+        CheckPointer(actual, E_POINTER);
+
+        ALLOCATOR_PROPERTIES padded = *request;
+        padded.cbBuffer += CFFMPEG::GetInputBufferPaddingSize();
+        padded.cbAlign =
+            std::max(padded.cbAlign, static_cast<long>(inputAlignment));
+        HRESULT r = CMemAllocator::SetProperties(&padded, actual);
+        if (SUCCEEDED(r))
+            actual->cbBuffer -= CFFMPEG::GetInputBufferPaddingSize();
+
+        return r;
+    }
+};
+
+// How late, in 100 ns units, the renderer must report pictures for each
+// degradation level. A level is left again once the lateness falls below
+// half of its threshold.
+const REFERENCE_TIME degradationLateness[] =
+{
+    0,          // DEGRADE_NONE
+    200000,     // DEGRADE_LOOP_FILTER
+    600000,     // DEGRADE_SKIP_CONVERT
+    1500000     // DEGRADE_SKIP_DECODE
+};
+}
+
+CH264DecoderInputPin::CH264DecoderInputPin(CH264DecoderFilter* decoder,
+                                           HRESULT* r)
+    : CTransformInputPin(inputPinName, decoder, r, inputPinName)
+{
+}
+
+CH264DecoderInputPin::~CH264DecoderInputPin()
+{
+}
+
+HRESULT CH264DecoderInputPin::GetAllocator(IMemAllocator** allocator)
+{
+    CheckPointer(allocator, E_POINTER);
+    CAutoLock lock(m_pLock);
+    if (!m_pAllocator)
+    {
+        HRESULT r = S_OK;
+        CPaddedMemAllocator* padded = new CPaddedMemAllocator(&r);
+        if (FAILED(r))
+        {
+            delete padded;
+            return r;
+        }
+
+        m_pAllocator = padded;
+        m_pAllocator->AddRef();
+    }
+
+    m_pAllocator->AddRef();
+    *allocator = m_pAllocator;
+    return S_OK;
+}
+
+HRESULT CH264DecoderInputPin::GetAllocatorRequirements(
+    ALLOCATOR_PROPERTIES* props)
+{
+    CheckPointer(props, E_POINTER);
+
+    // Only the alignment matters; upstream knows the sizes.
+    memset(props, 0, sizeof(*props));
+    props->cbAlign = inputAlignment;
+    return S_OK;
+}
+
+//------------------------------------------------------------------------------
+CInputStagingBuffer::CInputStagingBuffer()
+    : m_buffer(NULL)
+    , m_capacity(0)
+{
+}
+
+CInputStagingBuffer::~CInputStagingBuffer()
+{
+    Free();
+}
+
+BYTE* CInputStagingBuffer::Stage(const BYTE* data, int size, int padding)
+{
+    assert(data);
+    const int required = size + padding;
+    if (required > m_capacity)
+    {
+        const int capacity = (required + stagingGranularity - 1) /
+            stagingGranularity * stagingGranularity;
+        BYTE* buffer =
+            reinterpret_cast<BYTE*>(_aligned_malloc(capacity, inputAlignment));
+        if (!buffer)
+            return NULL;
+
+        Free();
+        m_buffer = buffer;
+        m_capacity = capacity;
+    }
+
+    memcpy(m_buffer, data, size);
+    memset(m_buffer + size, 0, padding);
+    return m_buffer;
+}
+
+void CInputStagingBuffer::Free()
+{
+    _aligned_free(m_buffer);
+    m_buffer = NULL;
+    m_capacity = 0;
 }
 
+//------------------------------------------------------------------------------
 CH264DecoderOutputPin::CH264DecoderOutputPin(CH264DecoderFilter* decoder,
                                              HRESULT* r)
     : CTransformOutputPin(outputPinName, decoder, r, outputPinName)
@@ -60,6 +227,35 @@ HRESULT CH264DecoderOutputPin::NonDelegatingQueryInterface(const IID& ID,
     return CTransformOutputPin::NonDelegatingQueryInterface(ID, o);
 }
 
+HRESULT CH264DecoderOutputPin::DecideAllocator(IMemInputPin* pin,
+                                               IMemAllocator** allocator)
+{
+    IMemAllocator* DXVA2Allocator = m_decoder->GetDXVA2Allocator();
+    if (!DXVA2Allocator)
+        return CTransformOutputPin::DecideAllocator(pin, allocator);
+
+    if (!pin || !allocator)
+        return E_POINTER;
+
+    ALLOCATOR_PROPERTIES props;
+    memset(&props, 0, sizeof(props));
+    pin->GetAllocatorRequirements(&props);
+
+    // One sample per decoding surface.
+    props.cBuffers = getDecodeSurfacesCount();
+    HRESULT r = DecideBufferSize(DXVA2Allocator, &props);
+    if (FAILED(r))
+        return r;
+
+    r = pin->NotifyAllocator(DXVA2Allocator, FALSE);
+    if (FAILED(r))
+        return r;
+
+    DXVA2Allocator->AddRef();
+    *allocator = DXVA2Allocator;
+    return S_OK;
+}
+
 HRESULT CH264DecoderOutputPin::GetUncompSurfacesInfo(
     const GUID* profileID, AMVAUncompBufferInfo* uncompBufInfo)
 {
@@ -145,6 +341,62 @@ HRESULT CH264DecoderOutputPin::GetCreateVideoAcceleratorData(
     return r;
 }
 
+//------------------------------------------------------------------------------
+COutputSamplePool::COutputSamplePool(int capacity)
+    : m_access()
+    , m_samples()
+    , m_capacity(capacity)
+{
+    m_samples.reserve(capacity);
+}
+
+COutputSamplePool::~COutputSamplePool()
+{
+}
+
+HRESULT COutputSamplePool::Acquire(CBaseOutputPin* pin, REFERENCE_TIME* start,
+                                   REFERENCE_TIME* stop, DWORD flags,
+                                   IMediaSample** sample)
+{
+    assert(pin);
+    assert(sample);
+    {
+        AutoLock lock(m_access);
+        if (!m_samples.empty())
+        {
+            *sample = m_samples.back().get();
+            (*sample)->AddRef();
+            m_samples.pop_back();
+            return S_OK;
+        }
+    }
+
+    return pin->GetDeliveryBuffer(sample, start, stop, flags);
+}
+
+void COutputSamplePool::Recycle(IMediaSample* sample)
+{
+    assert(sample);
+
+    // A sample carrying a format change must reach the downstream filter.
+    AM_MEDIA_TYPE* mediaType = NULL;
+    if (S_OK == sample->GetMediaType(&mediaType))
+    {
+        DeleteMediaType(mediaType);
+        return;
+    }
+
+    AutoLock lock(m_access);
+    if (static_cast<int>(m_samples.size()) < m_capacity)
+        m_samples.push_back(sample);
+}
+
+void COutputSamplePool::Clear()
+{
+    AutoLock lock(m_access);
+    m_samples.clear();
+}
+
 //------------------------------------------------------------------------------
 namespace
 {
@@ -156,8 +408,12 @@ struct { const GUID& SubType; int16 PlaneCount; int16 BitCount; int FourCC; }
     { DXVA_ModeH264_F, 1, 12, MAKEFOURCC('d','x','v','a') },
 
     // Software formats
+    { MEDIASUBTYPE_NV12, 1, 12, MAKEFOURCC('N','V','1','2') },
     { MEDIASUBTYPE_YV12, 3, 12, MAKEFOURCC('Y','V','1','2') },
-    { MEDIASUBTYPE_YUY2, 1, 16, MAKEFOURCC('Y','U','Y','2') }
+    { MEDIASUBTYPE_YUY2, 1, 16, MAKEFOURCC('Y','U','Y','2') },
+
+    // 16-bit container, for renderers that take nothing else.
+    { MEDIASUBTYPE_P010, 1, 24, MAKEFOURCC('P','0','1','0') }
 };
 
 enum KDXVAH264Compatibility
@@ -167,96 +423,20 @@ enum KDXVAH264Compatibility
     DXVA_INCOMPATIBLE_SAR = 4
 };
 
-bool hasDriverVersionReached(LARGE_INTEGER version, int a, int b, int c, int d)
-{
-    if (HIWORD(version.HighPart) > a)
-        return true;
-    
-    if (HIWORD(version.HighPart) == a)
-    {
-        if (LOWORD(version.HighPart) > b)
-            return true;
-        
-        if (LOWORD(version.HighPart) == b)
-        {
-            if (HIWORD(version.LowPart) > c)
-                return true;
-
-            if (HIWORD(version.LowPart) == c)
-                if (LOWORD(version.LowPart) >= d)
-                    return true;
-        }
-    }
-
-    return false;
-}
-
-int checkHWCompatibilityForH264(int width, int height, int videoLevel,
-                                int refFrameCount)
+int checkHWCompatibilityForH264(const GUID& decoderID, int width, int height,
+                                int videoLevel, int refFrameCount)
 {
     int noLevel51Support = 1;
     int tooMuchRefFrames = 0;
-    int maxRefFrames = 0;
     if (videoLevel >= 0)
     {
-        int vendor = CHardwareEnv::get()->GetVideoCardVendor();
-        int device = CHardwareEnv::get()->GetVideoCardDeviceID();
-        LARGE_INTEGER videoDriverVersion;
-        videoDriverVersion.QuadPart =
-            CHardwareEnv::get()->GetVideoCardDriverVersion();
-
-        const int maxRefFramesDPB41 = std::min(11, 8388608 / (width * height));
-        maxRefFrames = maxRefFramesDPB41; // default value is calculate
-        if (CHardwareEnv::PCI_VENDOR_NVIDIA == vendor)
-        {
-            // nVidia cards support level 5.1 since drivers v6.14.11.7800 for
-            // XP and drivers v7.15.11.7800 for Vista/7
-            if (win_util::GetWinVersion() >= win_util::WINVERSION_VISTA)
-            {
-                if (hasDriverVersionReached(videoDriverVersion, 7, 15, 11,
-                                            7800))
-                {
-                    noLevel51Support = 0;
-
-                    // max ref frames is 16 for HD and 11 otherwise
-                    if (width >= 1280)
-                        maxRefFrames = 16;
-                    else
-                        maxRefFrames = 11;
-                }
-            }
-            else
-            {
-                if (hasDriverVersionReached(videoDriverVersion, 6, 14, 11,
-                                            7800))
-                {
-                    noLevel51Support = 0;
-
-                    // max ref frames is 14
-                    maxRefFrames = 14;
-                }
-            }
-        }
-        else if (CHardwareEnv::PCI_VENDOR_S3_GRAPHICS == vendor)
-        {
+        const CHWCapabilityCache::TLevelLimits limits =
+            CHWCapabilityCache::get()->GetLevelLimits(decoderID, width, height);
+        if (limits.Level51)
             noLevel51Support = 0;
-        }
-        else if (CHardwareEnv::PCI_VENDOR_ATI == vendor)
-        {
-            // HD4xxx and HD5xxx ATI cards support level 5.1 since drivers
-            // v8.14.1.6105 (Catalyst 10.4)
-            if ((0x68 == (device >> 8)) || (0x94 == (device >> 8)))
-            {
-                if (hasDriverVersionReached(videoDriverVersion, 8, 14, 1, 6105))
-                {
-                    noLevel51Support = 0;
-                    maxRefFrames = 16;
-                }
-            }
-        }
 
         // Check maximum allowed number reference frames.
-        if (refFrameCount > maxRefFrames)
+        if (refFrameCount > limits.MaxRefFrames)
             tooMuchRefFrames = 1;
     }
 
@@ -264,6 +444,75 @@ int checkHWCompatibilityForH264(int width, int height, int videoLevel,
     return (hasVideoLevelReached51 * noLevel51Support *
         DXVA_UNSUPPORTED_LEVEL) + (tooMuchRefFrames * DXVA_TOO_MUCH_REF_FRAMES);
 }
+
+// The bitmap header and the rectangles of a FORMAT_VideoInfo or
+// FORMAT_VideoInfo2 type.
+bool getVideoFormat(const CMediaType& mediaType, BITMAPINFOHEADER** header,
+                    RECT** source, RECT** target)
+{
+    BYTE* format = mediaType.Format();
+    if ((FORMAT_VideoInfo == *mediaType.FormatType()) &&
+        (mediaType.FormatLength() >= sizeof(VIDEOINFOHEADER)))
+    {
+        VIDEOINFOHEADER* info = reinterpret_cast<VIDEOINFOHEADER*>(format);
+        *header = &info->bmiHeader;
+        *source = &info->rcSource;
+        *target = &info->rcTarget;
+        return true;
+    }
+
+    if ((FORMAT_VideoInfo2 == *mediaType.FormatType()) &&
+        (mediaType.FormatLength() >= sizeof(VIDEOINFOHEADER2)))
+    {
+        VIDEOINFOHEADER2* info = reinterpret_cast<VIDEOINFOHEADER2*>(format);
+        *header = &info->bmiHeader;
+        *source = &info->rcSource;
+        *target = &info->rcTarget;
+        return true;
+    }
+
+    return false;
+}
+
+// The picture size the type was made for. The bitmap width of a type that
+// came back from a renderer may be its stride instead.
+bool getPictureSize(const CMediaType& mediaType, int* width, int* height)
+{
+    BITMAPINFOHEADER* header;
+    RECT* source;
+    RECT* target;
+    if (!getVideoFormat(mediaType, &header, &source, &target))
+        return false;
+
+    if (!IsRectEmpty(source))
+    {
+        *width = source->right - source->left;
+        *height = source->bottom - source->top;
+        return true;
+    }
+
+    *width = header->biWidth;
+    *height = abs(header->biHeight);
+    return true;
+}
+
+// Keeps the subtype, the bitmap orientation and the aspect ratio.
+bool resizeVideoType(int width, int height, CMediaType* mediaType)
+{
+    BITMAPINFOHEADER* header;
+    RECT* source;
+    RECT* target;
+    if (!getVideoFormat(*mediaType, &header, &source, &target))
+        return false;
+
+    header->biWidth = width;
+    header->biHeight = (header->biHeight < 0) ? -height : height;
+    header->biSizeImage = width * height * header->biBitCount >> 3;
+    SetRect(source, 0, 0, width, height);
+    SetRect(target, 0, 0, width, height);
+    mediaType->SetSampleSize(header->biSizeImage);
+    return true;
+}
 }
 
 CUnknown* CH264DecoderFilter::CreateInstance(IUnknown* aggregator, HRESULT *r)
@@ -275,6 +524,38 @@ CH264DecoderFilter::~CH264DecoderFilter()
 {
 }
 
+HRESULT CH264DecoderFilter::NonDelegatingQueryInterface(const IID& ID,
+                                                          void** o)
+{
+    if (!o)
+        return E_POINTER;
+
+    if (__uuidof(IH264DecoderStats) == ID)
+    {
+        IH264DecoderStats* i = this;
+        i->AddRef();
+        *o = i;
+        return S_OK;
+    }
+
+    return CTransformFilter::NonDelegatingQueryInterface(ID, o);
+}
+
+HRESULT CH264DecoderFilter::GetStats(TH264DecoderStats* stats)
+{
+    if (!stats)
+        return E_POINTER;
+
+    m_stats.Get(stats);
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::ResetStats()
+{
+    m_stats.Reset();
+    return S_OK;
+}
+
 HRESULT CH264DecoderFilter::CheckInputType(const CMediaType* inputType)
 {
     if (!inputType)
@@ -341,12 +622,27 @@ HRESULT CH264DecoderFilter::DecideBufferSize(IMemAllocator * allocator,
     requested.cbBuffer = header.biSizeImage;
     requested.cbPrefix = 0;
 
+    // Direct rendering keeps the reference pictures in output samples. Ask
+    // for room, but get along with fewer: pictures that find no free sample
+    // fall back to libavcodec's own buffers.
+    const int minBuffers = requested.cBuffers;
+    if (m_directRender)
+    {
+        const int refFrames =
+            m_preDecode ? m_preDecode->GetRefFrameCount() : -1;
+        requested.cBuffers = std::max<long>(
+            requested.cBuffers,
+            (refFrames > 0) ? refFrames + directRenderExtraBuffers :
+                maxDirectRenderBuffers);
+        requested.cbAlign = std::max<long>(requested.cbAlign, 16);
+    }
+
     ALLOCATOR_PROPERTIES actual;
     HRESULT r = allocator->SetProperties(&requested, &actual);
     if (FAILED(r)) 
         return r;
 
-    return (requested.cBuffers > actual.cBuffers) ||
+    return (minBuffers > actual.cBuffers) ||
         (requested.cbBuffer > actual.cbBuffer) ? E_FAIL : S_OK;
 }
 
@@ -480,17 +776,37 @@ HRESULT CH264DecoderFilter::CompleteConnect(PIN_DIRECTION dir, IPin* receivePin)
         m_preDecode = CFFMPEG::get()->CreateCodec(m_pInput->CurrentMediaType());
         if (!m_preDecode)
             return VFW_E_TYPE_NOT_ACCEPTED;
+
+        m_preDecode->SetLowLatency(m_lowLatency);
     }
     else if (PINDIR_OUTPUT == dir)
     {
         if (m_decoder) // DXVA1 has been activated.
         {
-            if (!m_decoder->Init(m_pixelFormat, m_averageTimePerFrame))
+            const bool initialized =
+                m_decoder->Init(m_pixelFormat, m_averageTimePerFrame);
+            CHWCapabilityCache::get()->SetLastProbe(
+                m_decoder->GetDecoderID(), getRendererID(receivePin),
+                m_preDecode->GetWidth(), m_preDecode->GetHeight(),
+                initialized);
+            if (!initialized)
                 m_decoder.reset();
         }
-        
-        if (!m_decoder) // Not support DXVA1.
+
+        if (!m_decoder) // Not support DXVA1, try DXVA2.
+            ActivateDXVA2(receivePin);
+
+        if (!m_decoder) // Not support DXVA2 either.
             m_decoder.reset(new CH264SWDecoder(m_preDecode.get()));
+
+        m_decoder->SetStats(&m_stats);
+        m_decoder->SetSkipMode(m_skipMode, m_deliverFrom);
+        m_decoder->SetDegradation(m_degradation);
+        if (!getPictureSize(m_pOutput->CurrentMediaType(), &m_outputWidth,
+                            &m_outputHeight))
+            m_outputWidth = m_outputHeight = 0;
+
+        m_outputTypeChanged = false;
     }
 
     return CTransformFilter::CompleteConnect(dir, receivePin);
@@ -498,102 +814,291 @@ HRESULT CH264DecoderFilter::CompleteConnect(PIN_DIRECTION dir, IPin* receivePin)
 
 HRESULT CH264DecoderFilter::BreakConnect(PIN_DIRECTION dir)
 {
+    // The DXVA2 decoder belongs to the renderer's device, so it goes with the
+    // output connection. The samples it holds must go back first, as the
+    // allocator keeps the decoder alive until then.
+    if (m_DXVA2Allocator)
+    {
+        if (m_decoder)
+            m_decoder->Flush();
+
+        m_DXVA2Allocator = NULL;
+        m_decoder.reset();
+    }
+
     if (PINDIR_INPUT == dir)
     {
         m_decoder.reset();
         m_preDecode.reset();
+        m_inputStaging.Free();
     }
 
+    m_samplePool.Clear();
     return S_OK;
 }
 
-HRESULT CH264DecoderFilter::NewSegment(REFERENCE_TIME start,
-                                       REFERENCE_TIME stop, double rate)
+HRESULT CH264DecoderFilter::AlterQuality(Quality q)
 {
+    // Up as far as the lateness calls for at once, but down one level at a
+    // time, so that a single on-time picture doesn't undo everything.
+    int level = m_degradation;
+    while ((level + 1 < CH264Decoder::DEGRADE_LEVEL_COUNT) &&
+           (q.Late > degradationLateness[level + 1]))
+        level++;
+
+    if ((level == m_degradation) && (level > CH264Decoder::DEGRADE_NONE) &&
+        (q.Late < degradationLateness[level] / 2))
+        level--;
+
+    if (level != m_degradation)
     {
         AutoLock lock(m_decodeAccess);
-        m_preDecode->FlushBuffers();
+        m_degradation = static_cast<CH264Decoder::KDegradation>(level);
         if (m_decoder)
-            m_decoder->Flush();
+            m_decoder->SetDegradation(m_degradation);
     }
 
+    // Once there is nothing left to shed, upstream has to drop samples.
+    return (CH264Decoder::DEGRADE_SKIP_DECODE == m_degradation) ?
+        S_FALSE : S_OK;
+}
+
+HRESULT CH264DecoderFilter::NewSegment(REFERENCE_TIME start,
+                                       REFERENCE_TIME stop, double rate)
+{
+    // Must not overtake the samples that are still queued.
+    if (m_pipeline)
+        return m_pipeline->QueueNewSegment(start, stop, rate);
+
+    flushDecoder();
     return CTransformFilter::NewSegment(start, stop, rate);
 }
 
 HRESULT CH264DecoderFilter::Receive(IMediaSample* inSample)
 {
     AM_SAMPLE2_PROPERTIES* const props = m_pInput->SampleProps();
-    if (props->dwStreamId != AM_STREAM_MEDIA)
-        return m_pOutput->Deliver(inSample);
+    if (m_pipeline)
+        return m_pipeline->QueueSample(inSample, *props);
 
-    assert(m_decoder);
-    if (!m_decoder)
-        return E_UNEXPECTED;
+    return decodeSample(inSample, *props);
+}
 
-    BYTE* data;
-    HRESULT r = inSample->GetPointer(&data);
-    if (FAILED(r))
-        return r;
+HRESULT CH264DecoderFilter::EndOfStream()
+{
+    if (m_pipeline)
+        return m_pipeline->QueueEndOfStream();
 
-    const int dataLength = inSample->GetActualDataLength();
-    const int minDataSize = dataLength + CFFMPEG::GetInputBufferPaddingSize();
-    if (inSample->GetSize() < minDataSize)
-    {
-        assert(false);
-        // Reconfigure sample size.
-    }
+    return CTransformFilter::EndOfStream();
+}
 
-    // Make sure the padding bytes are initialized to 0.
-    memset(data + dataLength, 0, CFFMPEG::GetInputBufferPaddingSize());
+HRESULT CH264DecoderFilter::BeginFlush()
+{
+    // Release the threads blocked on the queues first; the downstream flush
+    // then releases the ones blocked in Deliver() or GetDeliveryBuffer().
+    if (m_pipeline)
+        m_pipeline->BeginFlush();
 
-    REFERENCE_TIME start;
-    REFERENCE_TIME stop;
-    r = inSample->GetTime(&start, &stop);
-    if (FAILED(r))
-        return r;
+    m_samplePool.Clear();
+    return CTransformFilter::BeginFlush();
+}
 
-    if ((stop <= start) && (stop != std::numeric_limits<int64>::min()))
-        stop = start + m_averageTimePerFrame;
+HRESULT CH264DecoderFilter::EndFlush()
+{
+    // Waits for the threads to let go of what they took before the flush,
+    // before the downstream pin takes samples again.
+    if (m_pipeline)
+        m_pipeline->EndFlush();
 
-    m_preDecode->UpdateTime(start, stop);
+    return CTransformFilter::EndFlush();
+}
 
-    const int8* dataStart = reinterpret_cast<const int8*>(data);
-    int dataRemaining = dataLength;
-    while (dataRemaining > 0)
+HRESULT CH264DecoderFilter::StartStreaming()
+{
     {
-        intrusive_ptr<IMediaSample> outSample;
-        r = InitializeOutputSample(
-            inSample, reinterpret_cast<IMediaSample**>(&outSample));
-        if (FAILED(r))
-            return r;
-
-        int usedBytes = 0;
-        {
-            AutoLock lock(m_decodeAccess);
-            r = m_decoder->Decode(dataStart, dataRemaining, start, stop,
-                outSample.get(), &usedBytes);
-            if (S_FALSE == r)
-                return S_OK;
-
-            if (FAILED(r))
-                return r;
+        AutoLock lock(m_decodeAccess);
+        m_degradation = CH264Decoder::DEGRADE_NONE;
+        if (m_decoder)
+            m_decoder->SetDegradation(m_degradation);
+    }
 
-            r = m_decoder->DisplayNextFrame(outSample.get());
-        }
-        if (E_NOTIMPL == r)
-            r = m_pOutput->Deliver(outSample.get());
+    if (m_directRender && m_decoder)
+    {
+        AutoLock lock(m_decodeAccess);
+        m_decoder->SetDirectRender(
+            static_cast<CH264DecoderOutputPin*>(m_pOutput)->GetAllocator(),
+            &m_pOutput->CurrentMediaType());
+    }
 
-        if (FAILED(r))
-            return r;
+    if (!m_pipelined)
+        return S_OK;
 
-        dataRemaining -= usedBytes;
-        dataStart += usedBytes;
+    m_pipeline.reset(
+        new CDecodePipeline(this, m_inputQueueDepth, m_outputQueueDepth));
+    if (!m_pipeline->Start())
+    {
+        m_pipeline.reset();
+        return E_FAIL;
     }
 
-    return r;
+    return S_OK;
 }
 
-HRESULT CH264DecoderFilter::ActivateDXVA1(IAMVideoAccelerator* accel,
+HRESULT CH264DecoderFilter::StopStreaming()
+{
+    m_pipeline.reset();
+    m_samplePool.Clear();
+    if (m_decoder)
+    {
+        AutoLock lock(m_decodeAccess);
+        m_decoder->SetDirectRender(NULL, NULL);
+
+        // Gives back the surfaces held as reference pictures, so that the
+        // decommit of the DXVA2 allocator can finish.
+        if (m_DXVA2Allocator)
+            m_decoder->Flush();
+    }
+
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::Stop()
+{
+    // CTransformFilter::Stop() waits for the receive lock, which the
+    // upstream thread may hold while it waits for room in the input queue.
+    {
+        CAutoLock lock(&m_csFilter);
+        if (m_pipeline)
+            m_pipeline->Abort();
+    }
+
+    return CTransformFilter::Stop();
+}
+
+HRESULT CH264DecoderFilter::DecodeQueuedSample(
+    IMediaSample* sample, const AM_SAMPLE2_PROPERTIES& props)
+{
+    return decodeSample(sample, props);
+}
+
+void CH264DecoderFilter::FlushQueuedDecoder()
+{
+    flushDecoder();
+}
+
+HRESULT CH264DecoderFilter::DeliverQueuedSample(IMediaSample* sample)
+{
+    HRESULT r;
+    {
+        CStageTimer timer(&m_stats, H264_STAGE_DELIVER);
+        CTraceScope trace(H264_TRACE_DELIVER, -1, -1, -1,
+                          sample->GetActualDataLength());
+        r = m_pOutput->Deliver(sample);
+    }
+    if (FAILED(r))
+        m_stats.AddDropped();
+
+    return r;
+}
+
+HRESULT CH264DecoderFilter::DeliverQueuedNewSegment(REFERENCE_TIME start,
+                                                    REFERENCE_TIME stop,
+                                                    double rate)
+{
+    return CTransformFilter::NewSegment(start, stop, rate);
+}
+
+HRESULT CH264DecoderFilter::DeliverQueuedEndOfStream()
+{
+    return CTransformFilter::EndOfStream();
+}
+
+HRESULT CH264DecoderFilter::SetDirectRender(bool enable)
+{
+    CAutoLock lock(&m_csFilter);
+    if (State_Stopped != m_State)
+        return VFW_E_WRONG_STATE;
+
+    m_directRender = enable;
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::SetThreadingPolicy(const TThreadingPolicy& policy)
+{
+    CAutoLock lock(&m_csFilter);
+    if (State_Stopped != m_State)
+        return VFW_E_WRONG_STATE;
+
+    if (!m_preDecode)
+        return VFW_E_NOT_CONNECTED;
+
+    m_preDecode->SetThreadingPolicy(policy);
+
+    // The DXVA decoders only parse on the pre-decode context.
+    if (m_decoder && (GUID_NULL == m_decoder->GetDecoderID()))
+        m_preDecode->ApplyThreadingPolicy();
+
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::SetLowLatency(bool enable)
+{
+    CAutoLock lock(&m_csFilter);
+    if (State_Stopped != m_State)
+        return VFW_E_WRONG_STATE;
+
+    m_lowLatency = enable;
+    if (m_preDecode)
+    {
+        m_preDecode->SetLowLatency(enable);
+        if (m_decoder && (GUID_NULL == m_decoder->GetDecoderID()))
+            m_preDecode->ApplyThreadingPolicy();
+    }
+
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::SetSkipMode(CH264Decoder::KSkipMode mode,
+                                        REFERENCE_TIME deliverFrom)
+{
+    if ((mode < CH264Decoder::SKIP_NONE) ||
+        (mode > CH264Decoder::SKIP_NON_KEY))
+        return E_INVALIDARG;
+
+    AutoLock lock(m_decodeAccess);
+    m_skipMode = mode;
+    m_deliverFrom = deliverFrom;
+    if (m_decoder)
+        m_decoder->SetSkipMode(mode, deliverFrom);
+
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::SetFrameMemoryBudget(int64 budget)
+{
+    if (budget < 0)
+        return E_INVALIDARG;
+
+    CFFMPEG::get()->GetFrameArena()->SetBudget(budget);
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::SetPipelineMode(bool enable, int inputDepth,
+                                            int outputDepth)
+{
+    CAutoLock lock(&m_csFilter);
+    if (State_Stopped != m_State)
+        return VFW_E_WRONG_STATE;
+
+    if ((inputDepth < 1) || (outputDepth < 1))
+        return E_INVALIDARG;
+
+    m_pipelined = enable;
+    m_inputQueueDepth = inputDepth;
+    m_outputQueueDepth = outputDepth;
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::ActivateDXVA1(IAMVideoAccelerator* accel,
                                           const GUID* decoderID,
                                           const AMVAUncompDataInfo& uncompInfo,
                                           int surfaceCount)
@@ -609,7 +1114,7 @@ HRESULT CH264DecoderFilter::ActivateDXVA1(IAMVideoAccelerator* accel,
 
     m_decoder.reset();
     int campatible = checkHWCompatibilityForH264(
-        m_preDecode->GetWidth(), m_preDecode->GetHeight(),
+        *decoderID, m_preDecode->GetWidth(), m_preDecode->GetHeight(),
         m_preDecode->GetVideoLevel(), m_preDecode->GetRefFrameCount());
     if (DXVA_UNSUPPORTED_LEVEL == campatible)
         return E_FAIL;
@@ -619,6 +1124,79 @@ HRESULT CH264DecoderFilter::ActivateDXVA1(IAMVideoAccelerator* accel,
     return S_OK;
 }
 
+HRESULT CH264DecoderFilter::ActivateDXVA2(IPin* receivePin)
+{
+    if (!m_preDecode)
+        return E_FAIL;
+
+    if (!receivePin)
+        return E_POINTER;
+
+    // The decoding surfaces are NV12.
+    if (MEDIASUBTYPE_NV12 != *m_pOutput->CurrentMediaType().Subtype())
+        return VFW_E_TYPE_NOT_ACCEPTED;
+
+    intrusive_ptr<IMFGetService> service;
+    HRESULT r = receivePin->QueryInterface(__uuidof(IMFGetService),
+                                           reinterpret_cast<void**>(&service));
+    if (FAILED(r))
+        return r;
+
+    intrusive_ptr<IDirect3DDeviceManager9> deviceManager;
+    r = service->GetService(MR_VIDEO_ACCELERATION_SERVICE,
+                            __uuidof(IDirect3DDeviceManager9),
+                            reinterpret_cast<void**>(&deviceManager));
+    if (FAILED(r))
+        return r;
+
+    // DXVA2_ModeH264_E is the same GUID.
+    const GUID& decoderID = DXVA_ModeH264_E;
+    const int width = m_preDecode->GetWidth();
+    const int height = m_preDecode->GetHeight();
+    int campatible = checkHWCompatibilityForH264(
+        decoderID, width, height, m_preDecode->GetVideoLevel(),
+        m_preDecode->GetRefFrameCount());
+    if (DXVA_UNSUPPORTED_LEVEL == campatible)
+        return E_FAIL;
+
+    const CLSID rendererID = getRendererID(receivePin);
+    CHWCapabilityCache* caps = CHWCapabilityCache::get();
+    if (CHWCapabilityCache::PROBE_FAILED ==
+            caps->GetLastProbe(decoderID, rendererID, width, height))
+        return E_FAIL;
+
+    shared_ptr<CH264DXVA2Decoder> decoder(
+        new CH264DXVA2Decoder(decoderID, m_preDecode.get(),
+                              deviceManager.get()));
+    const bool initialized =
+        decoder->Init(m_pixelFormat, m_averageTimePerFrame);
+    caps->SetLastProbe(decoderID, rendererID, width, height, initialized);
+    if (!initialized)
+        return E_FAIL;
+
+    // For the GOPs the accelerator refuses once the stream is running, unless
+    // the frame memory budget has no room left for it.
+    shared_ptr<CCodecContext> fallback;
+    if (CFFMPEG::get()->GetFrameArena()->GetHeadroom() >=
+            CH264DXVADecoder::GetFallbackMemory(*m_preDecode))
+        fallback = CFFMPEG::CreateCodec(m_pInput->CurrentMediaType());
+
+    if (fallback)
+    {
+        fallback->SetLowLatency(m_preDecode->IsLowLatency());
+        fallback->ApplyThreadingPolicy();
+        decoder->SetFallback(fallback);
+    }
+
+    intrusive_ptr<IMemAllocator> allocator(new CDXVA2Allocator(decoder, &r));
+    if (FAILED(r))
+        return r;
+
+    m_DXVA2Allocator = allocator;
+    m_decoder = decoder;
+    return S_OK;
+}
+
 bool CH264DecoderFilter::IsFormatSupported(const GUID& formatID)
 {
     for (int i = 0; i < arraysize(supportedFormats); ++i)
@@ -634,35 +1212,354 @@ HRESULT CH264DecoderFilter::ConfirmDXVA1UncompFormat(IAMVideoAccelerator* accel,
 {
     assert(accel);
     assert(pixelFormat);
-    DWORD formatCount = 0;
-    HRESULT r = accel->GetUncompFormatsSupported(decoderID, &formatCount, NULL);
+    if (!m_preDecode)
+        return E_FAIL;
+
+    // Don't offer an accelerator that refused this kind of stream before.
+    const int width = m_preDecode->GetWidth();
+    const int height = m_preDecode->GetHeight();
+    const CLSID rendererID = getRendererID(m_pOutput->GetConnected());
+    CHWCapabilityCache* caps = CHWCapabilityCache::get();
+    if (CHWCapabilityCache::PROBE_FAILED ==
+            caps->GetLastProbe(*decoderID, rendererID, width, height))
+        return E_FAIL;
+
+    // An accelerator without NV12 surfaces is a failed probe as much as one
+    // that Init() turns down.
+    HRESULT r = caps->FindUncompFormat(accel, *decoderID, rendererID, width,
+                                       height, MAKEFOURCC('N', 'V', '1', '2'),
+                                       pixelFormat);
+    if (FAILED(r))
+        caps->SetLastProbe(*decoderID, rendererID, width, height, false);
+
+    return r;
+}
+
+void CH264DecoderFilter::SetDXVA1PixelFormat(const DDPIXELFORMAT& pixelFormat)
+{
+    memcpy(&m_pixelFormat, &pixelFormat, sizeof(m_pixelFormat));
+}
+
+HRESULT CH264DecoderFilter::decodeSample(IMediaSample* inSample,
+                                         const AM_SAMPLE2_PROPERTIES& props)
+{
+    if (props.dwStreamId != AM_STREAM_MEDIA)
+        return deliverOutput(inSample);
+
+    assert(m_decoder);
+    if (!m_decoder)
+        return E_UNEXPECTED;
+
+    BYTE* data;
+    HRESULT r = inSample->GetPointer(&data);
     if (FAILED(r))
         return r;
 
-    if (formatCount < 0)
-        return E_FAIL;
+    const int dataLength = inSample->GetActualDataLength();
+    const int padding = CFFMPEG::GetInputBufferPaddingSize();
+    if (inSample->GetSize() - dataLength >= padding)
+    {
+        // Make sure the padding bytes are initialized to 0.
+        memset(data + dataLength, 0, padding);
+    }
+    else
+    {
+        data = m_inputStaging.Stage(data, dataLength, padding);
+        if (!data)
+            return E_OUTOFMEMORY;
+    }
+
+    REFERENCE_TIME start;
+    REFERENCE_TIME stop;
+    r = inSample->GetTime(&start, &stop);
+    if (FAILED(r))
+        return r;
+
+    if ((stop <= start) && (stop != std::numeric_limits<int64>::min()))
+        stop = start + m_averageTimePerFrame;
+
+    m_preDecode->UpdateTime(start, stop);
+
+    const int8* dataStart = reinterpret_cast<const int8*>(data);
+    int dataRemaining = dataLength;
+    while (dataRemaining > 0)
+    {
+        int usedBytes = 0;
+        bool frameReady;
+        {
+            AutoLock lock(m_decodeAccess);
+            r = m_decoder->Decode(dataStart, dataRemaining, start, stop,
+                                  &usedBytes);
+            frameReady = m_decoder->IsFrameReady();
+        }
+        if (S_FALSE == r)
+            return S_OK;
+
+        if (FAILED(r))
+        {
+            m_stats.AddDropped();
+            return r;
+        }
+
+        // Pictures held back for reordering or by the decoding threads don't
+        // need an output sample yet. The DXVA2 decoder may have several
+        // ready once it has decoded a GOP again in software.
+        while (frameReady)
+        {
+            r = deliverNextFrame(props);
+            if (FAILED(r))
+            {
+                m_stats.AddDropped();
+                return r;
+            }
+
+            AutoLock lock(m_decodeAccess);
+            frameReady = m_decoder->IsFrameReady();
+        }
+
+        if (usedBytes <= 0)
+            break;
+
+        dataRemaining -= usedBytes;
+        dataStart += usedBytes;
+    }
+
+    return r;
+}
+
+HRESULT CH264DecoderFilter::deliverNextFrame(const AM_SAMPLE2_PROPERTIES& props)
+{
+    intrusive_ptr<IMediaSample> outSample;
+    HRESULT r;
+    {
+        AutoLock lock(m_decodeAccess);
+        r = m_decoder->GetDirectSample(
+            reinterpret_cast<IMediaSample**>(&outSample));
+    }
+    if (S_OK == r)
+    {
+        // Pictures that are reordered by the decoder don't belong to the
+        // input sample at hand.
+        if (!m_decoder->HasOwnTimeStamps())
+        {
+            r = setOutputSampleProperties(props, outSample.get());
+            if (FAILED(r))
+                return r;
+        }
+
+        return deliverOutput(outSample.get());
+    }
 
-    scoped_array<DDPIXELFORMAT> formats(new DDPIXELFORMAT[formatCount]);
-    r = accel->GetUncompFormatsSupported(decoderID, &formatCount,
-        formats.get());
+    // The DXVA decoders can't follow a size change without new surfaces.
+    if (GUID_NULL == m_decoder->GetDecoderID())
+        updateOutputType();
+
+    r = initializeOutputSample(props,
+                               reinterpret_cast<IMediaSample**>(&outSample));
     if (FAILED(r))
         return r;
 
-    for (DWORD i = 0; i < formatCount; ++i)
+    // A type the renderer attached itself answers the change already.
+    if (m_outputTypeChanged)
+    {
+        AM_MEDIA_TYPE* mediaType = NULL;
+        if (S_OK == outSample->GetMediaType(&mediaType))
+            DeleteMediaType(mediaType);
+        else
+            outSample->SetMediaType(&m_pOutput->CurrentMediaType());
+
+        m_outputTypeChanged = false;
+    }
+
+    // The decode lock is not held while waiting for the allocator, so a flush
+    // may have dropped the picture in the meantime.
     {
-        if (formats[i].dwFourCC != MAKEFOURCC('N', 'V', '1', '2'))
-            continue;
+        AutoLock lock(m_decodeAccess);
+        CStageTimer timer(&m_stats, H264_STAGE_CONVERT);
+        r = m_decoder->DisplayNextFrame(outSample.get());
+    }
+    if (FAILED(r))
+        return r;
 
-        memcpy(pixelFormat, &formats[i], sizeof(*pixelFormat));
+    if (S_FALSE == r)
+    {
+        m_samplePool.Recycle(outSample.get());
         return S_OK;
     }
 
-    return E_FAIL;
+    if (!m_decoder->NeedDeliverSample())
+        return r;
+
+    return deliverOutput(outSample.get());
 }
 
-void CH264DecoderFilter::SetDXVA1PixelFormat(const DDPIXELFORMAT& pixelFormat)
+// CTransformFilter::InitializeOutputSample() reads the properties of the
+// sample the input pin is currently receiving, which is a different one by
+// the time the decode thread gets to a queued sample.
+HRESULT CH264DecoderFilter::initializeOutputSample(
+    const AM_SAMPLE2_PROPERTIES& props, IMediaSample** outSample)
 {
-    memcpy(&m_pixelFormat, &pixelFormat, sizeof(m_pixelFormat));
+    assert(outSample);
+    DWORD flags = m_bSampleSkipped ? AM_GBF_PREVFRAMESKIPPED : 0;
+    if (!(props.dwSampleFlags & AM_SAMPLE_SPLICEPOINT))
+        flags |= AM_GBF_NOTASYNCPOINT;
+
+    REFERENCE_TIME start = props.tStart;
+    REFERENCE_TIME stop = props.tStop;
+    HRESULT r = m_samplePool.Acquire(
+        m_pOutput, (props.dwSampleFlags & AM_SAMPLE_TIMEVALID) ? &start : NULL,
+        (props.dwSampleFlags & AM_SAMPLE_STOPVALID) ? &stop : NULL, flags,
+        outSample);
+    if (FAILED(r))
+        return r;
+
+    return setOutputSampleProperties(props, *outSample);
+}
+
+HRESULT CH264DecoderFilter::setOutputSampleProperties(
+    const AM_SAMPLE2_PROPERTIES& props, IMediaSample* outSample)
+{
+    assert(outSample);
+    intrusive_ptr<IMediaSample2> sample2;
+    HRESULT r = outSample->QueryInterface(IID_IMediaSample2,
+                                          reinterpret_cast<void**>(&sample2));
+    if (SUCCEEDED(r))
+    {
+        AM_SAMPLE2_PROPERTIES outProps;
+        r = sample2->GetProperties(
+            FIELD_OFFSET(AM_SAMPLE2_PROPERTIES, tStart),
+            reinterpret_cast<BYTE*>(&outProps));
+        if (FAILED(r))
+            return r;
+
+        outProps.dwTypeSpecificFlags = props.dwTypeSpecificFlags;
+        outProps.dwSampleFlags =
+            (outProps.dwSampleFlags & AM_SAMPLE_TYPECHANGED) |
+            (props.dwSampleFlags & ~AM_SAMPLE_TYPECHANGED);
+        outProps.tStart = props.tStart;
+        outProps.tStop = props.tStop;
+        outProps.cbData = FIELD_OFFSET(AM_SAMPLE2_PROPERTIES, dwStreamId);
+        r = sample2->SetProperties(FIELD_OFFSET(AM_SAMPLE2_PROPERTIES,
+                                                dwStreamId),
+                                   reinterpret_cast<BYTE*>(&outProps));
+        if (props.dwSampleFlags & AM_SAMPLE_DATADISCONTINUITY)
+            m_bSampleSkipped = FALSE;
+
+        return r;
+    }
+
+    // Recycled samples still carry the flags of their previous use.
+    REFERENCE_TIME start = props.tStart;
+    REFERENCE_TIME stop = props.tStop;
+    outSample->SetTime(
+        (props.dwSampleFlags & AM_SAMPLE_TIMEVALID) ? &start : NULL,
+        (props.dwSampleFlags & AM_SAMPLE_STOPVALID) ? &stop : NULL);
+    outSample->SetSyncPoint(
+        (props.dwSampleFlags & AM_SAMPLE_SPLICEPOINT) ? TRUE : FALSE);
+    outSample->SetDiscontinuity(
+        (props.dwSampleFlags & AM_SAMPLE_DATADISCONTINUITY) ? TRUE : FALSE);
+    if (props.dwSampleFlags & AM_SAMPLE_DATADISCONTINUITY)
+        m_bSampleSkipped = FALSE;
+
+    return S_OK;
+}
+
+// Follows a new SPS size with the output type, without a reconnection.
+// libavcodec drops the pictures of the old sequence that are still held for
+// reordering when the size changes, so the size of the codec context is the
+// size of every picture that comes out from then on.
+HRESULT CH264DecoderFilter::updateOutputType()
+{
+    int width;
+    int height;
+    {
+        AutoLock lock(m_decodeAccess);
+        width = m_preDecode->GetWidth();
+        height = m_preDecode->GetHeight();
+    }
+    if (((width == m_outputWidth) && (height == m_outputHeight)) ||
+        (width <= 0) || (height <= 0))
+        return S_FALSE;
+
+    // Asked once per change. Should the downstream filter turn it down, the
+    // pictures are cropped to the current type, or fill a corner of it.
+    m_outputWidth = width;
+    m_outputHeight = height;
+
+    CMediaType mediaType(m_pOutput->CurrentMediaType());
+    if (!resizeVideoType(width, height, &mediaType))
+        return E_FAIL;
+
+    IPin* connected = m_pOutput->GetConnected();
+    if (!connected || (S_OK != connected->QueryAccept(&mediaType)))
+        return VFW_E_TYPE_NOT_ACCEPTED;
+
+    HRESULT r = resizeOutputBuffers(mediaType.GetSampleSize());
+    if (FAILED(r))
+        return r;
+
+    r = m_pOutput->SetMediaType(&mediaType);
+    if (FAILED(r))
+        return r;
+
+    m_outputTypeChanged = true;
+    return S_OK;
+}
+
+// Only grows the buffers. That takes every sample back first, which fails
+// while direct rendering holds reference pictures in them or the pipeline
+// has pictures queued; the allocator is left as it was then.
+HRESULT CH264DecoderFilter::resizeOutputBuffers(int size)
+{
+    IMemAllocator* allocator =
+        static_cast<CH264DecoderOutputPin*>(m_pOutput)->GetAllocator();
+    if (!allocator)
+        return E_UNEXPECTED;
+
+    ALLOCATOR_PROPERTIES props;
+    HRESULT r = allocator->GetProperties(&props);
+    if (FAILED(r))
+        return r;
+
+    if (props.cbBuffer >= size)
+        return S_OK;
+
+    m_samplePool.Clear();
+    r = allocator->Decommit();
+    if (FAILED(r))
+        return r;
+
+    ALLOCATOR_PROPERTIES requested = props;
+    requested.cbBuffer = size;
+    ALLOCATOR_PROPERTIES actual;
+    r = allocator->SetProperties(&requested, &actual);
+    const HRESULT committed = allocator->Commit();
+    if (FAILED(r))
+        return r;
+
+    if (FAILED(committed))
+        return committed;
+
+    return (actual.cbBuffer >= size) ? S_OK : E_FAIL;
+}
+
+HRESULT CH264DecoderFilter::deliverOutput(IMediaSample* outSample)
+{
+    if (m_pipeline)
+        return m_pipeline->QueueOutput(outSample);
+
+    CStageTimer timer(&m_stats, H264_STAGE_DELIVER);
+    CTraceScope trace(H264_TRACE_DELIVER, -1, -1, -1,
+                      outSample->GetActualDataLength());
+    return m_pOutput->Deliver(outSample);
+}
+
+void CH264DecoderFilter::flushDecoder()
+{
+    AutoLock lock(m_decodeAccess);
+    m_preDecode->FlushBuffers();
+    if (m_decoder)
+        m_decoder->Flush();
 }
 
 CH264DecoderFilter::CH264DecoderFilter(IUnknown* aggregator, HRESULT* r)
@@ -671,15 +1568,31 @@ CH264DecoderFilter::CH264DecoderFilter(IUnknown* aggregator, HRESULT* r)
     , m_preDecode()
     , m_pixelFormat()
     , m_decodeAccess()
+    , m_stats()
     , m_decoder()
     , m_averageTimePerFrame(1)
+    , m_pipelined(false)
+    , m_inputQueueDepth(defaultInputQueueDepth)
+    , m_outputQueueDepth(defaultOutputQueueDepth)
+    , m_pipeline()
+    , m_samplePool(samplePoolCapacity)
+    , m_inputStaging()
+    , m_outputWidth(0)
+    , m_outputHeight(0)
+    , m_outputTypeChanged(false)
+    , m_directRender(false)
+    , m_lowLatency(false)
+    , m_skipMode(CH264Decoder::SKIP_NONE)
+    , m_deliverFrom(std::numeric_limits<int64>::min())
+    , m_degradation(CH264Decoder::DEGRADE_NONE)
+    , m_DXVA2Allocator()
 {
     memset(&m_pixelFormat, 0, sizeof(m_pixelFormat));
 
     if (m_pInput)
         delete m_pInput;
 
-    m_pInput = new CTransformInputPin(inputPinName, this, r, inputPinName);
+    m_pInput = new CH264DecoderInputPin(this, r);
 
     if (m_pOutput)
         delete m_pOutput;
@@ -12,6 +12,9 @@
 
 #include "chromium/base/basictypes.h"
 #include "chromium/base/lock.h"
+#include "decode_pipeline.h"
+#include "decoder_stats.h"
+#include "h264_decoder.h"
 
 class CH264DecoderFilter;
 class CH264DecoderOutputPin : public CTransformOutputPin,
@@ -34,6 +37,13 @@ public:
     virtual HRESULT __stdcall GetCreateVideoAcceleratorData(
         const GUID* profileID, DWORD* miscDataSize, void** miscData);
 
+    // Takes the allocator of an activated DXVA2 decoder, whose samples are
+    // its decoding surfaces, over any the downstream pin offers.
+    virtual HRESULT DecideAllocator(IMemInputPin* pin,
+                                    IMemAllocator** allocator);
+
+    IMemAllocator* GetAllocator() { return m_pAllocator; }
+
 private:
     CH264DecoderFilter* m_decoder;
     int m_DXVA1SurfCount;
@@ -41,16 +51,83 @@ private:
     DDPIXELFORMAT m_uncompPixelFormat;
 };
 
+//------------------------------------------------------------------------------
+// Offers upstream an allocator whose buffers have room for the padding
+// libavcodec reads past the end of the data, so that it only needs zeroing.
+class CH264DecoderInputPin : public CTransformInputPin
+{
+public:
+    CH264DecoderInputPin(CH264DecoderFilter* decoder, HRESULT* r);
+    ~CH264DecoderInputPin();
+
+    virtual HRESULT __stdcall GetAllocator(IMemAllocator** allocator);
+    virtual HRESULT __stdcall GetAllocatorRequirements(
+        ALLOCATOR_PROPERTIES* props);
+};
+
+//------------------------------------------------------------------------------
+// Copies of the input samples that come without room for the padding, from
+// allocators other than the input pin's. Grows to the largest sample seen and
+// stays there, so that steady-state samples don't allocate.
+class CInputStagingBuffer
+{
+public:
+    CInputStagingBuffer();
+    ~CInputStagingBuffer();
+
+    // |size| bytes of |data| followed by |padding| zeroed bytes, 16 byte
+    // aligned. NULL if out of memory.
+    BYTE* Stage(const BYTE* data, int size, int padding);
+    void Free();
+
+private:
+    BYTE* m_buffer;
+    int m_capacity;
+};
+
+//------------------------------------------------------------------------------
+// Output samples that were acquired but not filled, kept for the next picture
+// so that it doesn't go through the allocator again.
+class COutputSamplePool
+{
+public:
+    explicit COutputSamplePool(int capacity);
+    ~COutputSamplePool();
+
+    HRESULT Acquire(CBaseOutputPin* pin, REFERENCE_TIME* start,
+                    REFERENCE_TIME* stop, DWORD flags, IMediaSample** sample);
+    void Recycle(IMediaSample* sample);
+
+    // Must be called before the allocator is decommitted or reconfigured.
+    void Clear();
+
+private:
+    Lock m_access;
+    std::vector<boost::intrusive_ptr<IMediaSample> > m_samples;
+    int m_capacity;
+};
+
 //------------------------------------------------------------------------------
 class CCodecContext;
-class CH264Decoder;
-class CH264DecoderFilter : public CTransformFilter
+struct TThreadingPolicy;
+class CH264DecoderFilter : public CTransformFilter,
+                           public CDecodePipeline::CDelegate,
+                           public IH264DecoderStats
 {
 public:
     static CUnknown* __stdcall CreateInstance(IUnknown* aggregator, HRESULT *r);
 
     virtual ~CH264DecoderFilter();
 
+    // IUnknown
+    DECLARE_IUNKNOWN;
+    virtual HRESULT __stdcall NonDelegatingQueryInterface(const IID& ID,
+                                                          void** o);
+
+    // IH264DecoderStats
+    virtual HRESULT __stdcall GetStats(TH264DecoderStats* stats);
+    virtual HRESULT __stdcall ResetStats();
+
     virtual HRESULT CheckInputType(const CMediaType* inputType);
     virtual HRESULT CheckTransform(const CMediaType* inputType, 
                                    const CMediaType* outType);
@@ -63,7 +140,63 @@ public:
     virtual HRESULT BreakConnect(PIN_DIRECTION dir);
     virtual HRESULT NewSegment(REFERENCE_TIME start, REFERENCE_TIME stop,
                                double rate);
+
+    // Sheds decoding work in stages while the renderer reports late
+    // pictures, and takes it back once they are on time again.
+    virtual HRESULT AlterQuality(Quality q);
     virtual HRESULT Receive(IMediaSample* sample);
+    virtual HRESULT EndOfStream();
+    virtual HRESULT BeginFlush();
+    virtual HRESULT EndFlush();
+    virtual HRESULT StartStreaming();
+    virtual HRESULT StopStreaming();
+    virtual HRESULT __stdcall Stop();
+
+    // CDecodePipeline::CDelegate
+    virtual HRESULT DecodeQueuedSample(IMediaSample* sample,
+                                       const AM_SAMPLE2_PROPERTIES& props);
+    virtual void FlushQueuedDecoder();
+    virtual HRESULT DeliverQueuedSample(IMediaSample* sample);
+    virtual HRESULT DeliverQueuedNewSegment(REFERENCE_TIME start,
+                                            REFERENCE_TIME stop, double rate);
+    virtual HRESULT DeliverQueuedEndOfStream();
+
+    // Decodes on a worker thread and delivers from another one instead of
+    // doing both inside Receive. Takes effect from the next run; only
+    // accepted while stopped.
+    HRESULT SetPipelineMode(bool enable, int inputDepth, int outputDepth);
+
+    // Lets libavcodec decode straight into YV12 output samples when the
+    // layout allows it, which saves the copy through CSWScale. The samples
+    // are referenced for as long as they hold reference pictures, so this is
+    // only for allocators whose memory stays valid after delivery. Affects
+    // the buffer count asked for at the next connection; only accepted while
+    // stopped.
+    HRESULT SetDirectRender(bool enable);
+
+    // Replaces the software decoder threading chosen from the stream. Needs
+    // a connected input pin and lasts until it is disconnected; only
+    // accepted while stopped.
+    HRESULT SetThreadingPolicy(const TThreadingPolicy& policy);
+
+    // Outputs each picture as soon as it is decoded instead of in display
+    // order, for live sources without B-frames. Streams whose SPS rules out
+    // reordering get this anyway. Only accepted while stopped.
+    HRESULT SetLowLatency(bool enable);
+
+    // Leaves pictures out of decoding for scrubbing and thumbnailing, and
+    // holds back the ones that start before |deliverFrom|, which are only
+    // decoded for reference. Can be changed at any time; lasts across
+    // reconnections.
+    HRESULT SetSkipMode(CH264Decoder::KSkipMode mode,
+                        REFERENCE_TIME deliverFrom);
+
+    // The memory, in bytes, that the decoded pictures of all the decoders
+    // in the process should keep to; 0 for none. Streams that start close to
+    // it decode in software on one thread and in DXVA2 without the software
+    // fallback, and the blocks kept for reuse beyond it are given back at
+    // once. Can be changed at any time.
+    HRESULT SetFrameMemoryBudget(int64 budget);
 
     HRESULT ActivateDXVA1(IAMVideoAccelerator* accel, const GUID* decoderID,
                           const AMVAUncompDataInfo& uncompInfo,
@@ -74,15 +207,49 @@ public:
                                      DDPIXELFORMAT* pixelFormat);
     void SetDXVA1PixelFormat(const DDPIXELFORMAT& pixelFormat);
 
+    // Decodes into the Direct3D surfaces of a renderer that offers a
+    // IDirect3DDeviceManager9, which is what the EVR does. Needs an NV12
+    // output type.
+    HRESULT ActivateDXVA2(IPin* receivePin);
+    IMemAllocator* GetDXVA2Allocator() { return m_DXVA2Allocator.get(); }
+
 protected:
     CH264DecoderFilter(IUnknown* aggregator, HRESULT* r);
 
 private:
+    HRESULT decodeSample(IMediaSample* inSample,
+                         const AM_SAMPLE2_PROPERTIES& props);
+    HRESULT initializeOutputSample(const AM_SAMPLE2_PROPERTIES& props,
+                                   IMediaSample** outSample);
+    HRESULT setOutputSampleProperties(const AM_SAMPLE2_PROPERTIES& props,
+                                      IMediaSample* outSample);
+    HRESULT deliverNextFrame(const AM_SAMPLE2_PROPERTIES& props);
+    HRESULT updateOutputType();
+    HRESULT resizeOutputBuffers(int size);
+    HRESULT deliverOutput(IMediaSample* outSample);
+    void flushDecoder();
+
     std::vector<boost::shared_ptr<CMediaType> > m_mediaTypes;
     boost::shared_ptr<CCodecContext> m_preDecode;
     DDPIXELFORMAT m_pixelFormat;
     Lock m_decodeAccess;
+    CDecoderStats m_stats;
     int64 m_averageTimePerFrame;
+    bool m_pipelined;
+    int m_inputQueueDepth;
+    int m_outputQueueDepth;
+    boost::scoped_ptr<CDecodePipeline> m_pipeline;
+    COutputSamplePool m_samplePool;
+    CInputStagingBuffer m_inputStaging;
+    int m_outputWidth;
+    int m_outputHeight;
+    bool m_outputTypeChanged;
+    bool m_directRender;
+    bool m_lowLatency;
+    CH264Decoder::KSkipMode m_skipMode;
+    REFERENCE_TIME m_deliverFrom;
+    CH264Decoder::KDegradation m_degradation;
+    boost::intrusive_ptr<IMemAllocator> m_DXVA2Allocator;
 
     // Put it into a first-release position.
     boost::shared_ptr<CH264Decoder> m_decoder;
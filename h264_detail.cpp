@@ -60,6 +60,66 @@ void copyScalingMatrix(DXVA_Qmatrix_H264* dest, const DXVA_Qmatrix_H264* source)
             dest->bScalingLists8x8[i][j] =
                 source->bScalingLists8x8[i][ZZScan8[j]];
 }
+
+// The fields of the picture parameters that only depend on the SPS and PPS.
+void fillParameterSetFields(const SPS* sps, const PPS* pps,
+                            DXVA_PicParams_H264* picParams)
+{
+    picParams->wFrameWidthInMbsMinus1 =
+        sps->mb_width - 1; // pic_width_in_mbs_minus1;
+
+    // pic_height_in_map_units_minus1;
+    picParams->wFrameHeightInMbsMinus1 =
+        sps->mb_height * (2 - sps->frame_mbs_only_flag) - 1;
+    picParams->num_ref_frames = sps->ref_frame_count; // num_ref_frames;
+    picParams->residual_colour_transform_flag =
+        sps->residual_color_transform_flag;
+    picParams->chroma_format_idc = sps->chroma_format_idc;
+    picParams->constrained_intra_pred_flag = pps->constrained_intra_pred;
+    picParams->weighted_pred_flag = pps->weighted_pred;
+    picParams->weighted_bipred_idc = pps->weighted_bipred_idc;
+    picParams->frame_mbs_only_flag = sps->frame_mbs_only_flag;
+    picParams->transform_8x8_mode_flag = pps->transform_8x8_mode;
+    picParams->MinLumaBipredSize8x8Flag = (sps->level_idc >= 31);
+    picParams->bit_depth_luma_minus8 =
+        sps->bit_depth_luma - 8; // bit_depth_luma_minus8
+    picParams->bit_depth_chroma_minus8 =
+        sps->bit_depth_chroma - 8; // bit_depth_chroma_minus8
+    picParams->log2_max_frame_num_minus4 =
+        sps->log2_max_frame_num - 4; // log2_max_frame_num_minus4;
+    picParams->pic_order_cnt_type = sps->poc_type; // pic_order_cnt_type;
+
+    // log2_max_pic_order_cnt_lsb_minus4;
+    picParams->log2_max_pic_order_cnt_lsb_minus4 = sps->log2_max_poc_lsb - 4;
+    picParams->delta_pic_order_always_zero_flag =
+        sps->delta_pic_order_always_zero_flag;
+    picParams->direct_8x8_inference_flag = sps->direct_8x8_inference_flag;
+    picParams->entropy_coding_mode_flag =
+        pps->cabac; // entropy_coding_mode_flag;
+    picParams->pic_order_present_flag =
+        pps->pic_order_present; // pic_order_present_flag;
+    picParams->num_slice_groups_minus1 =
+        pps->slice_group_count - 1; // num_slice_groups_minus1;
+    picParams->slice_group_map_type =
+        pps->mb_slice_group_map_type; // slice_group_map_type;
+
+    // deblocking_filter_control_present_flag;
+    picParams->deblocking_filter_control_present_flag =
+        pps->deblocking_filter_parameters_present;
+    picParams->redundant_pic_cnt_present_flag =
+        pps->redundant_pic_cnt_present; // redundant_pic_cnt_present_flag;
+    picParams->slice_group_change_rate_minus1 =
+        pps->slice_group_change_rate_minus1;
+
+    picParams->chroma_qp_index_offset = pps->chroma_qp_index_offset[0];
+    picParams->second_chroma_qp_index_offset = pps->chroma_qp_index_offset[1];
+    picParams->num_ref_idx_l0_active_minus1 =
+        pps->ref_count[0]-1; // num_ref_idx_l0_active_minus1;
+    picParams->num_ref_idx_l1_active_minus1 =
+        pps->ref_count[1]-1; // num_ref_idx_l1_active_minus1;
+    picParams->pic_init_qp_minus26 = pps->init_qp - 26;
+    picParams->pic_init_qs_minus26 = pps->init_qs - 26;
+}
 }
 
 namespace h264_detail
@@ -147,13 +207,40 @@ void UpdateRefFrameSliceLong(const DXVA_PicParams_H264* picParams,
     }
 }
 
-HRESULT BuildPicParams(const CCodecContext* cont,
+HRESULT UpdateParameterSets(const CCodecContext* cont,
+                            TParameterSetCache* cache)
+{
+    assert(cont);
+    assert(cache);
+
+    const H264Context* info =
+        reinterpret_cast<const H264Context*>(cont->GetPrivateData());
+    assert(info);
+    if (!info)
+        return E_FAIL;
+
+    // libavcodec copies the active parameter sets into the context without
+    // their ids, and a set may be sent again with the same id but different
+    // content, so the copies are compared instead.
+    const char* sps = reinterpret_cast<const char*>(&info->sps);
+    const char* pps = reinterpret_cast<const char*>(&info->pps);
+    if (cache->Valid &&
+        !memcmp(&cache->SPS[0], sps, sizeof(info->sps)) &&
+        !memcmp(&cache->PPS[0], pps, sizeof(info->pps)))
+        return S_FALSE;
+
+    cache->SPS.assign(sps, sps + sizeof(info->sps));
+    cache->PPS.assign(pps, pps + sizeof(info->pps));
+    cache->Valid = true;
+    return S_OK;
+}
+
+HRESULT BuildPicParams(const CCodecContext* cont, bool parameterSetsChanged,
                        DXVA_PicParams_H264* picParams, int* fieldType,
                        int* sliceType)
 {
     assert(cont);
     assert(picParams);
-    assert(scalingMatrix);
     assert(fieldType);
     assert(sliceType);
 
@@ -195,68 +282,16 @@ HRESULT BuildPicParams(const CCodecContext* cont,
     }
 
     *sliceType = info->slice_type;
+    if (parameterSetsChanged)
+        fillParameterSetFields(sps, pps, picParams);
 
     const int fieldPicFlag = (info->s.picture_structure != PICT_FRAME);
-    picParams->wFrameWidthInMbsMinus1 =
-        sps->mb_width - 1; // pic_width_in_mbs_minus1;
-
-    // pic_height_in_map_units_minus1;
-    picParams->wFrameHeightInMbsMinus1 =
-        sps->mb_height * (2 - sps->frame_mbs_only_flag) - 1;
-    picParams->num_ref_frames = sps->ref_frame_count; // num_ref_frames;
     picParams->field_pic_flag = fieldPicFlag;
     picParams->MbaffFrameFlag = (info->sps.mb_aff && (fieldPicFlag==0));
-    picParams->residual_colour_transform_flag =
-        sps->residual_color_transform_flag;
     picParams->sp_for_switch_flag = info->sp_for_switch_flag;
-    picParams->chroma_format_idc = sps->chroma_format_idc;
     picParams->RefPicFlag = info->ref_pic_flag;
-    picParams->constrained_intra_pred_flag = pps->constrained_intra_pred;
-    picParams->weighted_pred_flag = pps->weighted_pred;
-    picParams->weighted_bipred_idc = pps->weighted_bipred_idc;
-    picParams->frame_mbs_only_flag = sps->frame_mbs_only_flag;
-    picParams->transform_8x8_mode_flag = pps->transform_8x8_mode;
-    picParams->MinLumaBipredSize8x8Flag = (info->sps.level_idc >= 31);
     picParams->IntraPicFlag = (FF_I_TYPE == info->slice_type);
-    picParams->bit_depth_luma_minus8 =
-        sps->bit_depth_luma - 8; // bit_depth_luma_minus8
-    picParams->bit_depth_chroma_minus8 =
-        sps->bit_depth_chroma - 8; // bit_depth_chroma_minus8
     picParams->frame_num = info->frame_num;
-    picParams->log2_max_frame_num_minus4 =
-        sps->log2_max_frame_num - 4; // log2_max_frame_num_minus4;
-    picParams->pic_order_cnt_type = sps->poc_type; // pic_order_cnt_type;
-
-    // log2_max_pic_order_cnt_lsb_minus4;
-    picParams->log2_max_pic_order_cnt_lsb_minus4 = sps->log2_max_poc_lsb - 4;
-    picParams->delta_pic_order_always_zero_flag =
-        sps->delta_pic_order_always_zero_flag;
-    picParams->direct_8x8_inference_flag = sps->direct_8x8_inference_flag;
-    picParams->entropy_coding_mode_flag =
-        pps->cabac; // entropy_coding_mode_flag;
-    picParams->pic_order_present_flag =
-        pps->pic_order_present; // pic_order_present_flag;
-    picParams->num_slice_groups_minus1 =
-        pps->slice_group_count - 1; // num_slice_groups_minus1;
-    picParams->slice_group_map_type =
-        pps->mb_slice_group_map_type; // slice_group_map_type;
-
-    // deblocking_filter_control_present_flag;
-    picParams->deblocking_filter_control_present_flag =
-        pps->deblocking_filter_parameters_present;
-    picParams->redundant_pic_cnt_present_flag =
-        pps->redundant_pic_cnt_present; // redundant_pic_cnt_present_flag;
-    picParams->slice_group_change_rate_minus1 =
-        pps->slice_group_change_rate_minus1;
-
-    picParams->chroma_qp_index_offset = pps->chroma_qp_index_offset[0];
-    picParams->second_chroma_qp_index_offset = pps->chroma_qp_index_offset[1];
-    picParams->num_ref_idx_l0_active_minus1 =
-        pps->ref_count[0]-1; // num_ref_idx_l0_active_minus1;
-    picParams->num_ref_idx_l1_active_minus1 =
-        pps->ref_count[1]-1; // num_ref_idx_l1_active_minus1;
-    picParams->pic_init_qp_minus26 = pps->init_qp - 26;
-    picParams->pic_init_qs_minus26 = pps->init_qs - 26;
 
     if (fieldPicFlag)
     {
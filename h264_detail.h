@@ -1,6 +1,8 @@
 #ifndef _H264_DETAIL_H_
 #define _H264_DETAIL_H_
 
+#include <vector>
+
 #include <windows.h>
 #include <dxva.h>
 
@@ -8,10 +10,29 @@ class CCodecContext;
 
 namespace h264_detail
 {
+// Copies of the SPS and PPS that the picture parameters and the scaling
+// matrix were last built from.
+struct TParameterSetCache
+{
+    TParameterSetCache() : Valid(false), SPS(), PPS() {}
+
+    bool Valid;
+    std::vector<char> SPS;
+    std::vector<char> PPS;
+};
+
+// S_OK if the active SPS or PPS differ from those in |cache|, which then
+// takes them. S_FALSE if they are the same.
+HRESULT UpdateParameterSets(const CCodecContext* cont,
+                            TParameterSetCache* cache);
+
 void UpdateRefFrameSliceLong(const DXVA_PicParams_H264* picParams,
                              const CCodecContext* cont,
                              DXVA_Slice_H264_Long* slices);
-HRESULT BuildPicParams(const CCodecContext* cont,
+
+// Leaves the fields that come from the SPS and PPS as they are unless
+// |parameterSetsChanged|.
+HRESULT BuildPicParams(const CCodecContext* cont, bool parameterSetsChanged,
                        DXVA_PicParams_H264* picParams, int* fieldType,
                        int* sliceType);
 HRESULT BuildScalingMatrix(const CCodecContext* cont,
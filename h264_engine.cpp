@@ -0,0 +1,287 @@
+#include "h264_engine.h"
+
+#include <cassert>
+
+#include <streams.h>
+#include <dvdmedia.h>
+
+#include "ffmpeg.h"
+#include "frame_arena.h"
+
+namespace
+{
+// More than the pictures H.264 can hold back for reordering.
+const int maxPendingTimes = 64;
+
+struct { const GUID& SubType; int BitCount; } outputFormats[] =
+{
+    { MEDIASUBTYPE_NV12, 12 },  // OUTPUT_NV12
+    { MEDIASUBTYPE_YV12, 12 },  // OUTPUT_YV12
+    { MEDIASUBTYPE_YUY2, 16 }   // OUTPUT_YUY2
+};
+
+// What CCodecContext::Init() takes from a splitter: MPEG2VIDEOINFO, with the
+// parameter sets and the NAL length size for AVC1.
+void buildInputType(const CH264Engine::TConfig& config, CMediaType* mediaType)
+{
+    const int sequenceSize = config.ParameterSets ? config.ParameterSetSize : 0;
+    MPEG2VIDEOINFO* info = reinterpret_cast<MPEG2VIDEOINFO*>(
+        mediaType->AllocFormatBuffer(
+            FIELD_OFFSET(MPEG2VIDEOINFO, dwSequenceHeader) + sequenceSize));
+    memset(info, 0, mediaType->FormatLength());
+    info->hdr.bmiHeader.biSize = sizeof(info->hdr.bmiHeader);
+    info->hdr.bmiHeader.biWidth = config.Width;
+    info->hdr.bmiHeader.biHeight = config.Height;
+    info->hdr.bmiHeader.biCompression = config.NALLength ?
+        MAKEFOURCC('a', 'v', 'c', '1') : MAKEFOURCC('H', '2', '6', '4');
+    info->dwFlags = config.NALLength;
+    info->cbSequenceHeader = sequenceSize;
+    if (sequenceSize)
+        memcpy(info->dwSequenceHeader, config.ParameterSets, sequenceSize);
+
+    mediaType->SetType(&MEDIATYPE_Video);
+    mediaType->SetSubtype(config.NALLength ? &MEDIASUBTYPE_AVC1 :
+                                             &MEDIASUBTYPE_H264);
+    mediaType->SetFormatType(&FORMAT_MPEG2Video);
+}
+}
+
+//------------------------------------------------------------------------------
+class CH264Engine::CHeapFrameAllocator : public CH264Engine::CFrameAllocator
+{
+public:
+    virtual bool AllocFrame(TFrame* frame)
+    {
+        assert(frame);
+        frame->Data = _aligned_malloc(frame->Size, 16);
+        frame->Opaque = NULL;
+        return !!frame->Data;
+    }
+
+    virtual void ReleaseFrame(const TFrame& frame)
+    {
+        _aligned_free(frame.Data);
+    }
+};
+
+CH264Engine::CH264Engine()
+    : m_codec()
+    , m_frame(new CVideoFrame)
+    , m_scale(new CSWScale)
+    , m_heapAllocator(new CHeapFrameAllocator)
+    , m_allocator(NULL)
+    , m_callback(NULL)
+    , m_format(OUTPUT_NV12)
+    , m_input()
+    , m_frames()
+    , m_times()
+{
+}
+
+CH264Engine::~CH264Engine()
+{
+    releaseQueuedFrames();
+}
+
+HRESULT CH264Engine::Init(const TConfig& config, CFrameAllocator* allocator,
+                          CFrameCallback* callback)
+{
+    if ((config.Format < 0) || (config.Format >= arraysize(outputFormats)))
+        return E_INVALIDARG;
+
+    if (m_codec)
+        return E_UNEXPECTED;
+
+    CMediaType inputType;
+    buildInputType(config, &inputType);
+    m_codec = CFFMPEG::CreateCodec(inputType);
+    if (!m_codec)
+        return E_FAIL;
+
+    m_codec->SetLowLatency(config.LowLatency);
+    if (config.MaxThreads)
+    {
+        TThreadingPolicy policy = m_codec->GetThreadingPolicy();
+        policy.MaxThreads = config.MaxThreads;
+        policy.SliceThreads = policy.SliceThreads && (config.MaxThreads > 1);
+        policy.FrameThreads = policy.FrameThreads && (config.MaxThreads > 1);
+        m_codec->SetThreadingPolicy(policy);
+    }
+    m_codec->ApplyThreadingPolicy();
+
+    m_allocator = allocator ? allocator : m_heapAllocator.get();
+    m_callback = callback;
+    m_format = config.Format;
+    return S_OK;
+}
+
+HRESULT CH264Engine::Push(const void* data, int size, int64 start,
+                          int64 stop)
+{
+    if (!m_codec)
+        return E_UNEXPECTED;
+
+    if ((size <= 0) || !data)
+        return E_INVALIDARG;
+
+    const int padding = CFFMPEG::GetInputBufferPaddingSize();
+    m_input.resize(size + padding);
+    memcpy(&m_input[0], data, size);
+    memset(&m_input[size], 0, padding);
+    m_codec->UpdateTime(start, stop);
+    m_times.push_back(std::make_pair(start, stop));
+    if (static_cast<int>(m_times.size()) > maxPendingTimes)
+        m_times.pop_front();
+
+    return decode(&m_input[0], size);
+}
+
+bool CH264Engine::Poll(TFrame* frame)
+{
+    assert(frame);
+    if (m_frames.empty())
+        return false;
+
+    *frame = m_frames.front();
+    m_frames.pop_front();
+    return true;
+}
+
+void CH264Engine::ReleaseFrame(const TFrame& frame)
+{
+    assert(m_allocator);
+    m_allocator->ReleaseFrame(frame);
+}
+
+HRESULT CH264Engine::Drain()
+{
+    if (!m_codec)
+        return E_UNEXPECTED;
+
+    // Empty packets take out the pictures libavcodec still holds, one each.
+    m_input.assign(CFFMPEG::GetInputBufferPaddingSize(), 0);
+    HRESULT r = S_OK;
+    do
+    {
+        m_codec->Decode(m_frame.get(), &m_input[0], 0);
+        if (!m_frame->IsComplete())
+            break;
+
+        r = outputFrame();
+    } while (SUCCEEDED(r));
+
+    m_codec->FlushBuffers();
+    m_times.clear();
+    return r;
+}
+
+void CH264Engine::Flush()
+{
+    if (m_codec)
+        m_codec->FlushBuffers();
+
+    m_frame->SetComplete(false);
+    m_times.clear();
+    releaseQueuedFrames();
+}
+
+HRESULT CH264Engine::SetFrameMemoryBudget(int64 budget)
+{
+    if (budget < 0)
+        return E_INVALIDARG;
+
+    CFFMPEG::get()->GetFrameArena()->SetBudget(budget);
+    return S_OK;
+}
+
+HRESULT CH264Engine::decode(const void* data, int size)
+{
+    const int8* dataStart = reinterpret_cast<const int8*>(data);
+    int dataRemaining = size;
+    while (dataRemaining > 0)
+    {
+        const int usedBytes =
+            m_codec->Decode(m_frame.get(), dataStart, dataRemaining);
+        if (usedBytes < 0)
+            return S_FALSE;
+
+        if (m_frame->IsComplete())
+        {
+            HRESULT r = outputFrame();
+            if (FAILED(r))
+                return r;
+        }
+
+        if (!usedBytes)
+            break;
+
+        dataRemaining -= usedBytes;
+        dataStart += usedBytes;
+    }
+
+    return S_OK;
+}
+
+HRESULT CH264Engine::outputFrame()
+{
+    TFrame frame = {0};
+    frame.Width = m_codec->GetWidth();
+    frame.Height = m_codec->GetHeight();
+    frame.Format = m_format;
+    frame.Size = frame.Width * frame.Height *
+        outputFormats[m_format].BitCount / 8;
+    if (m_frame->GetTime(&frame.Start, NULL))
+        frame.Stop = takeStopTime(frame.Start);
+    else
+        frame.Start = frame.Stop = 0;
+
+    m_frame->SetComplete(false);
+    if (!m_scale->Init(*m_codec, outputFormats[m_format].SubType,
+                       frame.Width, frame.Height))
+        return E_FAIL;
+
+    // A picture the allocator has no room for is dropped, not an error.
+    if (!m_allocator->AllocFrame(&frame))
+        return S_FALSE;
+
+    if (!m_scale->Convert(*m_frame, frame.Data))
+    {
+        m_allocator->ReleaseFrame(frame);
+        return E_FAIL;
+    }
+
+    if (m_callback)
+        m_callback->OnFrame(frame);
+    else
+        m_frames.push_back(frame);
+
+    return S_OK;
+}
+
+int64 CH264Engine::takeStopTime(int64 start)
+{
+    // Pictures come out in display order, so the entry can be anywhere.
+    // Packets that bring no picture of their own leave theirs behind, up to
+    // maxPendingTimes.
+    for (std::deque<std::pair<int64, int64> >::iterator i = m_times.begin();
+         i != m_times.end(); ++i)
+    {
+        if (i->first == start)
+        {
+            const int64 stop = i->second;
+            m_times.erase(i);
+            return stop;
+        }
+    }
+
+    return start + 1;
+}
+
+void CH264Engine::releaseQueuedFrames()
+{
+    for (std::deque<TFrame>::const_iterator i = m_frames.begin();
+         i != m_frames.end(); ++i)
+        m_allocator->ReleaseFrame(*i);
+
+    m_frames.clear();
+}
\ No newline at end of file
@@ -0,0 +1,138 @@
+#ifndef _H264_ENGINE_H_
+#define _H264_ENGINE_H_
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <windows.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "chromium/base/basictypes.h"
+
+// Software H.264 decoding of one stream without a filter graph, for servers
+// that run many streams side by side. Packets are pushed in; pictures come
+// out in display order through Poll() or a callback, converted into memory
+// from a CFrameAllocator. An engine is not thread-safe, but any number of
+// them can run on different threads; they share the CFFMPEG worker pool.
+class CCodecContext;
+class CVideoFrame;
+class CSWScale;
+class CH264Engine
+{
+public:
+    enum KOutputFormat
+    {
+        OUTPUT_NV12 = 0,
+        OUTPUT_YV12 = 1,
+        OUTPUT_YUY2 = 2
+    };
+
+    struct TConfig
+    {
+        // The SPS and PPS: an Annex B byte stream, or each one preceded by a
+        // 16 bit big endian size when NALLength is not 0. May be empty if
+        // the packets carry them.
+        const void* ParameterSets;
+        int ParameterSetSize;
+        int NALLength;      // 0 for Annex B packets, otherwise 1, 2 or 4
+        int Width;          // 0 if not known before the first SPS
+        int Height;
+        KOutputFormat Format;
+        bool LowLatency;    // See CCodecContext::SetLowLatency()
+        int MaxThreads;     // 0 for the policy chosen from the stream
+    };
+
+    struct TFrame
+    {
+        void* Data;         // Tightly packed planes; the stride is Width
+        void* Opaque;       // For the CFrameAllocator
+        int Size;
+        int Width;
+        int Height;
+        KOutputFormat Format;
+        int64 Start;        // As pushed with the packet; Stop is Start + 1
+        int64 Stop;         // when no packet was pushed with Start
+    };
+
+    class CFrameAllocator
+    {
+    public:
+        // Sets |frame->Data|, 16 byte aligned and |frame->Size| bytes long,
+        // and whatever it needs in |frame->Opaque|. Returning false drops
+        // the picture.
+        virtual bool AllocFrame(TFrame* frame) = 0;
+        virtual void ReleaseFrame(const TFrame& frame) = 0;
+
+    protected:
+        virtual ~CFrameAllocator() {}
+    };
+
+    class CFrameCallback
+    {
+    public:
+        // Called from Push() and Drain(). The frame is the callee's from
+        // then on, to be given back with CH264Engine::ReleaseFrame().
+        virtual void OnFrame(const TFrame& frame) = 0;
+
+    protected:
+        virtual ~CFrameCallback() {}
+    };
+
+    CH264Engine();
+    ~CH264Engine();
+
+    // |allocator| and |callback| must outlive the engine. Without an
+    // allocator the frames are allocated on the heap; without a callback
+    // they queue up for Poll().
+    HRESULT Init(const TConfig& config, CFrameAllocator* allocator,
+                 CFrameCallback* callback);
+
+    // One or more whole NAL units. The data is copied, so it needs no
+    // padding. S_FALSE if part of it could not be decoded.
+    HRESULT Push(const void* data, int size, int64 start, int64 stop);
+
+    // The next decoded frame, if any.
+    bool Poll(TFrame* frame);
+    void ReleaseFrame(const TFrame& frame);
+
+    // Outputs the pictures held back for reordering, at the end of the
+    // stream. The packets pushed afterwards must start from an IDR picture.
+    HRESULT Drain();
+
+    // Drops the pictures held back and those not polled yet, for a seek.
+    void Flush();
+
+    // See CH264DecoderFilter::SetFrameMemoryBudget(); shared with the
+    // filters in the process.
+    static HRESULT SetFrameMemoryBudget(int64 budget);
+
+private:
+    class CHeapFrameAllocator;
+
+    HRESULT decode(const void* data, int size);
+    HRESULT outputFrame();
+    int64 takeStopTime(int64 start);
+    void releaseQueuedFrames();
+
+    boost::shared_ptr<CCodecContext> m_codec;
+    boost::scoped_ptr<CVideoFrame> m_frame;
+    boost::scoped_ptr<CSWScale> m_scale;
+    boost::scoped_ptr<CHeapFrameAllocator> m_heapAllocator;
+    CFrameAllocator* m_allocator;
+    CFrameCallback* m_callback;
+    KOutputFormat m_format;
+    std::vector<uint8> m_input;
+    std::deque<TFrame> m_frames;
+
+    // The times of the packets not output yet. libavcodec only carries the
+    // start time through to the picture, so the stop time is looked up by
+    // it.
+    std::deque<std::pair<int64, int64> > m_times;
+
+    DISALLOW_COPY_AND_ASSIGN(CH264Engine);
+};
+
+#endif  // _H264_ENGINE_H_
\ No newline at end of file
@@ -0,0 +1,267 @@
+#include "h264_nalu.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include <intrin.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+
+#include "common/hardware_env.h"
+
+namespace
+{
+// Bit mask of the candidates among 16 consecutive positions whose next three
+// bytes are 00 00 01, given the bytes at offsets 0, 1 and 2 of them.
+inline int matchStartcodes(__m128i b0, __m128i b1, __m128i b2)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(b0, zero)) &
+        _mm_movemask_epi8(_mm_cmpeq_epi8(b1, zero)) &
+        _mm_movemask_epi8(_mm_cmpeq_epi8(b2, one));
+}
+
+inline int firstBit(int mask)
+{
+    unsigned long bit;
+    _BitScanForward(&bit, mask);
+    return static_cast<int>(bit);
+}
+}
+
+int CH264NALU::FindStartcodeC(const BYTE* buffer, int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+        if ((*(reinterpret_cast<const DWORD*>(buffer + i)) & 0x00FFFFFF) ==
+            0x00010000)
+            return i;
+
+    return end;
+}
+
+int CH264NALU::FindStartcodeSSE2(const BYTE* buffer, int begin, int end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        // Most of a slice has no zero byte at all, so reject those blocks
+        // with a single compare.
+        const __m128i b0 =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i));
+        if (!_mm_movemask_epi8(_mm_cmpeq_epi8(b0, zero)))
+            continue;
+
+        const int mask = matchStartcodes(
+            b0,
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i + 1)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i + 2)));
+        if (mask)
+            return i + firstBit(mask);
+    }
+
+    return FindStartcodeC(buffer, i, end);
+}
+
+int CH264NALU::FindStartcodeSSSE3(const BYTE* buffer, int begin, int end)
+{
+    // Align the loads, then build the shifted vectors with palignr instead of
+    // issuing unaligned loads that split cache lines.
+    int i = begin;
+    const int head = (16 - (reinterpret_cast<intptr_t>(buffer + i) & 15)) & 15;
+    if (head)
+    {
+        const int headEnd = std::min(i + head, end);
+        const int found = FindStartcodeC(buffer, i, headEnd);
+        if (found < headEnd)
+            return found;
+
+        i = headEnd;
+    }
+
+    // Each iteration reads buffer[i] up to buffer[i + 31], which stays within
+    // the 3 readable bytes past |end|, the last being buffer[end + 2], as
+    // long as i + 29 <= end.
+    const __m128i zero = _mm_setzero_si128();
+    if (i + 29 <= end)
+    {
+        __m128i current =
+            _mm_load_si128(reinterpret_cast<const __m128i*>(buffer + i));
+        for (; i + 29 <= end; i += 16)
+        {
+            const __m128i next =
+                _mm_load_si128(reinterpret_cast<const __m128i*>(buffer + i + 16));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(current, zero)))
+            {
+                const int mask = matchStartcodes(
+                    current, _mm_alignr_epi8(next, current, 1),
+                    _mm_alignr_epi8(next, current, 2));
+                if (mask)
+                    return i + firstBit(mask);
+            }
+
+            current = next;
+        }
+    }
+
+    return FindStartcodeC(buffer, i, end);
+}
+
+CH264NALU::FindStartcodeFunc CH264NALU::GetFindStartcode()
+{
+    const int features = CHardwareEnv::get()->GetProcessorFeatures();
+    if (features & CHardwareEnv::PROCESSOR_FEATURE_SSSE3)
+        return FindStartcodeSSSE3;
+
+    if (features & CHardwareEnv::PROCESSOR_FEATURE_SSE2)
+        return FindStartcodeSSE2;
+
+    return FindStartcodeC;
+}
+
+CH264NALU::CH264NALU()
+    : forbiddenBit(0)
+    , referenceIdc(0)
+    , unitType(NALU_TYPE_SLICE)
+    , m_startPos(0)
+    , m_dataPos(0)
+    , m_dataLen(0)
+    , m_buffer(NULL)
+    , m_curPos(0)
+    , m_nextRTP(0)
+    , m_size(0)
+    , m_NALSize(0)
+    , m_findStartcode(NULL)
+{
+    static FindStartcodeFunc bestFindStartcode = GetFindStartcode();
+    m_findStartcode = bestFindStartcode;
+}
+
+void CH264NALU::SetBuffer(const void* buffer, int size, int NALSize)
+{
+    m_buffer = reinterpret_cast<const BYTE*>(buffer);
+    m_size = size;
+    m_NALSize = NALSize;
+    m_curPos = 0;
+    m_nextRTP = 0;
+
+    m_startPos = 0;
+    m_dataPos = 0;
+}
+
+bool CH264NALU::moveToNextStartcode()
+{
+    int buffEnd =
+        (m_nextRTP > 0) ? std::min(m_nextRTP, m_size - 4) : m_size - 4;
+
+    if (m_curPos < buffEnd)
+    {
+        const int i = m_findStartcode(m_buffer, m_curPos, buffEnd);
+        if (i < buffEnd)
+        {
+            // Find next AnnexB Nal
+            m_curPos = i;
+            return true;
+        }
+    }
+
+    if (m_NALSize && (m_nextRTP < m_size))
+    {
+        m_curPos = m_nextRTP;
+        return true;
+    }
+
+    m_curPos = m_size;
+    return false;
+}
+
+bool CH264NALU::ReadNext()
+{
+    if (m_curPos >= m_size)
+        return false;
+
+    if (m_NALSize && (m_curPos == m_nextRTP))
+    {
+        // RTP Nalu type : (XX XX) XX XX NAL..., with XX XX XX XX or XX XX equal
+        // to NAL size
+        m_startPos = m_curPos;
+        m_dataPos = m_curPos + m_NALSize;
+        int temp = 0;
+        for (int i = 0; i < m_NALSize; ++i)
+            temp = (temp << 8) + m_buffer[m_curPos++];
+
+        m_nextRTP += temp + m_NALSize;
+        moveToNextStartcode();
+    }
+    else
+    {
+        // Remove trailing bits
+        while (!m_buffer[m_curPos] &&
+            ((*(reinterpret_cast<const DWORD*>(m_buffer + m_curPos)) &
+                0x00FFFFFF) != 0x00010000))
+            m_curPos++;
+
+        // AnnexB Nalu : 00 00 01 NAL...
+        m_startPos = m_curPos;
+        m_curPos += 3;
+        m_dataPos = m_curPos;
+        moveToNextStartcode();
+    }
+
+    forbiddenBit = (m_buffer[m_dataPos]>>7) & 1;
+    referenceIdc = (m_buffer[m_dataPos]>>5) & 3;
+    unitType = static_cast<KNALUType>(m_buffer[m_dataPos] & 0x1f);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+CH264NALIndex::CH264NALIndex()
+    : m_units()
+    , m_count(0)
+    , m_sliceCount(0)
+    , m_buffer(NULL)
+    , m_size(0)
+    , m_NALSize(0)
+{
+}
+
+CH264NALIndex::~CH264NALIndex()
+{
+}
+
+void CH264NALIndex::Build(const void* buffer, int size, int NALSize)
+{
+    assert(buffer);
+    Clear();
+    m_buffer = reinterpret_cast<const BYTE*>(buffer);
+    m_size = size;
+    m_NALSize = NALSize;
+
+    CH264NALU block;
+    block.SetBuffer(buffer, size, NALSize);
+    while (block.ReadNext())
+    {
+        if (m_count >= static_cast<int>(m_units.size()))
+            m_units.resize(m_units.size() * 2 + 16);
+
+        TNALUnitDesc& unit = m_units[m_count++];
+        unit.NALPos = block.GetNALPos();
+        unit.DataPos = block.GetDataPos();
+        unit.DataLength = block.GetDataLength();
+        unit.Type = block.GetType();
+        unit.RefFrame = block.IsRefFrame();
+
+        if ((NALU_TYPE_SLICE == unit.Type) || (NALU_TYPE_IDR == unit.Type))
+            m_sliceCount++;
+    }
+}
+
+void CH264NALIndex::Clear()
+{
+    m_count = 0;
+    m_sliceCount = 0;
+    m_buffer = NULL;
+    m_size = 0;
+    m_NALSize = 0;
+}
\ No newline at end of file
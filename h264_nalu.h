@@ -0,0 +1,125 @@
+#ifndef _H264_NALU_H_
+#define _H264_NALU_H_
+
+#include <vector>
+
+#include <windows.h>
+
+enum KNALUType
+{
+    NALU_TYPE_SLICE = 1,
+    NALU_TYPE_DPA = 2,
+    NALU_TYPE_DPB = 3,
+    NALU_TYPE_DPC = 4,
+    NALU_TYPE_IDR = 5,
+    NALU_TYPE_SEI = 6,
+    NALU_TYPE_SPS = 7,
+    NALU_TYPE_PPS = 8,
+    NALU_TYPE_AUD = 9,
+    NALU_TYPE_EOSEQ = 10,
+    NALU_TYPE_EOSTREAM = 11,
+    NALU_TYPE_FILL = 12
+};
+
+class CH264NALU
+{
+public:
+    // Returns the offset of the first 00 00 01 starting in [begin, end), or
+    // |end| if there is none. Up to 3 bytes past |end| may be read.
+    typedef int (*FindStartcodeFunc)(const BYTE* buffer, int begin, int end);
+
+    static int FindStartcodeC(const BYTE* buffer, int begin, int end);
+    static int FindStartcodeSSE2(const BYTE* buffer, int begin, int end);
+    static int FindStartcodeSSSE3(const BYTE* buffer, int begin, int end);
+
+    // The fastest scanner supported by the processor.
+    static FindStartcodeFunc GetFindStartcode();
+
+    CH264NALU();
+
+    KNALUType GetType() const { return unitType; };
+    bool IsRefFrame() const { return (referenceIdc != 0); };
+
+    int GetDataLength() const { return m_curPos - m_dataPos; };
+    const BYTE* GetDataBuffer() { return m_buffer + m_dataPos; };
+    int GetDataPos() const { return m_dataPos; }
+    int GetRoundedDataLength() const
+    {
+        int size = m_curPos - m_dataPos;
+        return size + 128 - (size % 128);
+    }
+
+    int GetLength() const { return m_curPos - m_startPos; };
+    const BYTE* GetNALBuffer() { return m_buffer + m_startPos; };
+    int GetNALPos() const { return m_startPos; }
+    bool IsEOF() const { return m_curPos >= m_size; };
+
+    void SetBuffer (const void* buffer, int size, int NALSize);
+    bool ReadNext();
+    int GetRawDataSize() const { return m_size; }
+    const void* GetRawDataBuffer() const { return m_buffer; }
+    void SetFindStartcode(FindStartcodeFunc f) { m_findStartcode = f; }
+
+private:
+    bool moveToNextStartcode();
+
+    int forbiddenBit;       // should be always FALSE
+    int referenceIdc;       // NALU_PRIORITY_xxxx
+    KNALUType unitType;     // NALU_TYPE_xxxx
+
+    int m_startPos;         // NALU start (including startcode / size)
+    int m_dataPos;          // Useful part
+    unsigned m_dataLen;     // Length of the NAL unit (Excluding the start
+                            // code, which does not belong to the NALU)
+
+    const BYTE* m_buffer;
+    int m_curPos;
+    int m_nextRTP;
+    int m_size;
+    int m_NALSize;
+    FindStartcodeFunc m_findStartcode;
+};
+
+//------------------------------------------------------------------------------
+// Offsets, lengths and types of the NAL units of one access unit. libavcodec
+// doesn't report where it found them, so this is a scan of its own next to
+// the parser's: it runs once per access unit, before the parser, and the
+// bitstream builders and the slice count checks all read from it instead of
+// each scanning the buffer again.
+class CH264NALIndex
+{
+public:
+    struct TNALUnitDesc
+    {
+        int NALPos;         // NALU start (including startcode / size)
+        int DataPos;        // Useful part
+        int DataLength;
+        KNALUType Type;
+        bool RefFrame;
+    };
+
+    CH264NALIndex();
+    ~CH264NALIndex();
+
+    void Build(const void* buffer, int size, int NALSize);
+    void Clear();
+
+    int GetCount() const { return m_count; }
+    int GetSliceCount() const { return m_sliceCount; }
+    const TNALUnitDesc& Get(int i) const { return m_units[i]; }
+    const BYTE* GetBuffer() const { return m_buffer; }
+    int GetSize() const { return m_size; }
+    int GetNALLength() const { return m_NALSize; }
+
+private:
+    // Grows on demand and is never shrunk, so steady-state access units don't
+    // allocate.
+    std::vector<TNALUnitDesc> m_units;
+    int m_count;
+    int m_sliceCount;
+    const BYTE* m_buffer;
+    int m_size;
+    int m_NALSize;
+};
+
+#endif  // _H264_NALU_H_
\ No newline at end of file
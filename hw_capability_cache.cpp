@@ -0,0 +1,294 @@
+#include "hw_capability_cache.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "chromium/base/win_util.h"
+#include "common/hardware_env.h"
+
+using std::vector;
+
+namespace
+{
+// A failed probe is believed for this long, in ms, times the number of
+// failures in a row up to maxProbeBackoff, then the accelerator gets another
+// try. A failure may be transient, such as another instance holding it.
+const DWORD probeRetryInterval = 30 * 1000;
+const int maxProbeBackoff = 8;
+
+bool hasDriverVersionReached(LARGE_INTEGER version, int a, int b, int c, int d)
+{
+    if (HIWORD(version.HighPart) > a)
+        return true;
+
+    if (HIWORD(version.HighPart) == a)
+    {
+        if (LOWORD(version.HighPart) > b)
+            return true;
+
+        if (LOWORD(version.HighPart) == b)
+        {
+            if (HIWORD(version.LowPart) > c)
+                return true;
+
+            if (HIWORD(version.LowPart) == c)
+                if (LOWORD(version.LowPart) >= d)
+                    return true;
+        }
+    }
+
+    return false;
+}
+
+// Sets |maxRefFrames| to 0 where the DPB size limit of level 4.1 applies.
+void evaluateVendorTables(int vendor, int device, int64 driverVersion,
+                          bool hd, bool* level51, int* maxRefFrames)
+{
+    assert(level51);
+    assert(maxRefFrames);
+
+    LARGE_INTEGER videoDriverVersion;
+    videoDriverVersion.QuadPart = driverVersion;
+    *level51 = false;
+    *maxRefFrames = 0;
+    if (CHardwareEnv::PCI_VENDOR_NVIDIA == vendor)
+    {
+        // nVidia cards support level 5.1 since drivers v6.14.11.7800 for
+        // XP and drivers v7.15.11.7800 for Vista/7
+        if (win_util::GetWinVersion() >= win_util::WINVERSION_VISTA)
+        {
+            if (hasDriverVersionReached(videoDriverVersion, 7, 15, 11, 7800))
+            {
+                *level51 = true;
+
+                // max ref frames is 16 for HD and 11 otherwise
+                *maxRefFrames = hd ? 16 : 11;
+            }
+        }
+        else
+        {
+            if (hasDriverVersionReached(videoDriverVersion, 6, 14, 11, 7800))
+            {
+                *level51 = true;
+
+                // max ref frames is 14
+                *maxRefFrames = 14;
+            }
+        }
+    }
+    else if (CHardwareEnv::PCI_VENDOR_S3_GRAPHICS == vendor)
+    {
+        *level51 = true;
+    }
+    else if (CHardwareEnv::PCI_VENDOR_ATI == vendor)
+    {
+        // HD4xxx and HD5xxx ATI cards support level 5.1 since drivers
+        // v8.14.1.6105 (Catalyst 10.4)
+        if ((0x68 == (device >> 8)) || (0x94 == (device >> 8)))
+        {
+            if (hasDriverVersionReached(videoDriverVersion, 8, 14, 1, 6105))
+            {
+                *level51 = true;
+                *maxRefFrames = 16;
+            }
+        }
+    }
+}
+
+HRESULT findFormat(const vector<DDPIXELFORMAT>& formats, DWORD fourCC,
+                   DDPIXELFORMAT* format)
+{
+    for (int i = 0; i < static_cast<int>(formats.size()); ++i)
+    {
+        if (formats[i].dwFourCC != fourCC)
+            continue;
+
+        memcpy(format, &formats[i], sizeof(*format));
+        return S_OK;
+    }
+
+    return E_FAIL;
+}
+}
+
+CHWCapabilityCache::KResolutionClass CHWCapabilityCache::GetResolutionClass(
+    int width, int height)
+{
+    if (width < 1280)
+        return RESOLUTION_SD;
+
+    if ((width <= 1920) && (height <= 1088))
+        return RESOLUTION_HD;
+
+    return RESOLUTION_ABOVE_HD;
+}
+
+CHWCapabilityCache::CHWCapabilityCache()
+    : m_access()
+    , m_entries()
+{
+}
+
+CHWCapabilityCache::~CHWCapabilityCache()
+{
+}
+
+CHWCapabilityCache::TLevelLimits CHWCapabilityCache::GetLevelLimits(
+    const GUID& decoderID, int width, int height)
+{
+    // The vendor tables only know the driver.
+    const TKey key = makeKey(decoderID, GUID_NULL, width, height);
+    TLevelLimits limits;
+    {
+        AutoLock lock(m_access);
+        TEntry& entry = m_entries[key];
+        if (!entry.HasLevelLimits)
+        {
+            evaluateVendorTables(key.Vendor, key.Device, key.DriverVersion,
+                                 key.Resolution != RESOLUTION_SD,
+                                 &entry.Level51, &entry.MaxRefFrames);
+            entry.HasLevelLimits = true;
+        }
+
+        limits.Level51 = entry.Level51;
+        limits.MaxRefFrames = entry.MaxRefFrames;
+    }
+
+    // The DPB limit depends on the exact picture size, not only on its class.
+    if (!limits.MaxRefFrames)
+        limits.MaxRefFrames =
+            std::min(11, 8388608 / std::max(width * height, 1));
+
+    return limits;
+}
+
+HRESULT CHWCapabilityCache::FindUncompFormat(IAMVideoAccelerator* accel,
+                                             const GUID& decoderID,
+                                             const CLSID& rendererID,
+                                             int width, int height,
+                                             DWORD fourCC,
+                                             DDPIXELFORMAT* format)
+{
+    assert(accel);
+    assert(format);
+    const TKey key = makeKey(decoderID, rendererID, width, height);
+    {
+        AutoLock lock(m_access);
+        const TEntry& entry = m_entries[key];
+        if (entry.HasUncompFormats)
+            return findFormat(entry.UncompFormats, fourCC, format);
+    }
+
+    // Not asked under the lock: the driver may take its time.
+    DWORD formatCount = 0;
+    HRESULT r = accel->GetUncompFormatsSupported(&decoderID, &formatCount,
+                                                 NULL);
+    if (FAILED(r))
+        return r;
+
+    vector<DDPIXELFORMAT> formats(formatCount);
+    if (formatCount)
+    {
+        r = accel->GetUncompFormatsSupported(&decoderID, &formatCount,
+                                             &formats[0]);
+        if (FAILED(r))
+            return r;
+
+        formats.resize(formatCount);
+    }
+
+    AutoLock lock(m_access);
+    TEntry& entry = m_entries[key];
+    entry.UncompFormats.swap(formats);
+    entry.HasUncompFormats = true;
+    return findFormat(entry.UncompFormats, fourCC, format);
+}
+
+CHWCapabilityCache::KProbeResult CHWCapabilityCache::GetLastProbe(
+    const GUID& decoderID, const CLSID& rendererID, int width, int height)
+{
+    const TKey key = makeKey(decoderID, rendererID, width, height);
+    AutoLock lock(m_access);
+    std::map<TKey, TEntry>::const_iterator i = m_entries.find(key);
+    if (i == m_entries.end())
+        return PROBE_UNKNOWN;
+
+    const TEntry& entry = i->second;
+    if (PROBE_FAILED != entry.LastProbe)
+        return entry.LastProbe;
+
+    const DWORD retryAfter = probeRetryInterval *
+        std::min(entry.ProbeFailures, maxProbeBackoff);
+    if (GetTickCount() - entry.LastFailureTime >= retryAfter)
+        return PROBE_UNKNOWN;
+
+    return PROBE_FAILED;
+}
+
+void CHWCapabilityCache::SetLastProbe(const GUID& decoderID,
+                                      const CLSID& rendererID, int width,
+                                      int height, bool succeeded)
+{
+    const TKey key = makeKey(decoderID, rendererID, width, height);
+    AutoLock lock(m_access);
+    TEntry& entry = m_entries[key];
+    entry.LastProbe = succeeded ? PROBE_SUCCEEDED : PROBE_FAILED;
+    if (succeeded)
+    {
+        entry.ProbeFailures = 0;
+        return;
+    }
+
+    entry.ProbeFailures++;
+    entry.LastFailureTime = GetTickCount();
+}
+
+bool CHWCapabilityCache::TKey::operator<(const TKey& other) const
+{
+    if (Vendor != other.Vendor)
+        return Vendor < other.Vendor;
+
+    if (Device != other.Device)
+        return Device < other.Device;
+
+    if (DriverVersion != other.DriverVersion)
+        return DriverVersion < other.DriverVersion;
+
+    if (Resolution != other.Resolution)
+        return Resolution < other.Resolution;
+
+    const int renderer =
+        memcmp(&RendererID, &other.RendererID, sizeof(RendererID));
+    if (renderer)
+        return renderer < 0;
+
+    return memcmp(&DecoderID, &other.DecoderID, sizeof(DecoderID)) < 0;
+}
+
+CHWCapabilityCache::TEntry::TEntry()
+    : HasLevelLimits(false)
+    , Level51(false)
+    , MaxRefFrames(0)
+    , HasUncompFormats(false)
+    , UncompFormats()
+    , LastProbe(PROBE_UNKNOWN)
+    , ProbeFailures(0)
+    , LastFailureTime(0)
+{
+}
+
+CHWCapabilityCache::TKey CHWCapabilityCache::makeKey(const GUID& decoderID,
+                                                     const CLSID& rendererID,
+                                                     int width,
+                                                     int height) const
+{
+    // Only a driver update changes these, and that takes a restart.
+    TKey key;
+    key.Vendor = CHardwareEnv::get()->GetVideoCardVendor();
+    key.Device = CHardwareEnv::get()->GetVideoCardDeviceID();
+    key.DriverVersion = CHardwareEnv::get()->GetVideoCardDriverVersion();
+    key.RendererID = rendererID;
+    key.DecoderID = decoderID;
+    key.Resolution = GetResolutionClass(width, height);
+    return key;
+}
\ No newline at end of file
@@ -0,0 +1,102 @@
+#ifndef _HW_CAPABILITY_CACHE_H_
+#define _HW_CAPABILITY_CACHE_H_
+
+#include <map>
+#include <vector>
+
+#include <d3dx9.h>
+#include <videoacc.h>
+
+#include "chromium/base/basictypes.h"
+#include "chromium/base/lock.h"
+#include "chromium/base/singleton.h"
+
+// What the video card can decode, remembered for the lifetime of the process
+// so that rebuilding a graph doesn't probe the driver again. The entries are
+// keyed by adapter (vendor, device and driver version), renderer, decoder
+// GUID and resolution class. The renderer is the class ID of the filter that
+// provides the accelerator: the VMR, the overlay mixer and the EVR each have
+// their own, which may offer different formats and fail differently, and
+// DXVA1 and DXVA2 share the H.264 GUIDs.
+class CHWCapabilityCache : public Singleton<CHWCapabilityCache>
+{
+public:
+    enum KResolutionClass
+    {
+        RESOLUTION_SD = 0,      // Narrower than 1280
+        RESOLUTION_HD = 1,      // Up to 1920x1088
+        RESOLUTION_ABOVE_HD = 2
+    };
+
+    enum KProbeResult
+    {
+        PROBE_UNKNOWN = 0,
+        PROBE_SUCCEEDED = 1,
+        PROBE_FAILED = 2
+    };
+
+    struct TLevelLimits
+    {
+        bool Level51;       // Level 5.1 streams decode correctly
+        int MaxRefFrames;
+    };
+
+    static KResolutionClass GetResolutionClass(int width, int height);
+
+    CHWCapabilityCache();
+    ~CHWCapabilityCache();
+
+    // From the vendor and driver tables.
+    TLevelLimits GetLevelLimits(const GUID& decoderID, int width, int height);
+
+    // The first uncompressed DXVA1 format with |fourCC| that |accel|, of the
+    // renderer |rendererID|, offers for |decoderID|. Only asks the first time
+    // for each renderer. E_FAIL if there is none.
+    HRESULT FindUncompFormat(IAMVideoAccelerator* accel, const GUID& decoderID,
+                             const CLSID& rendererID, int width, int height,
+                             DWORD fourCC, DDPIXELFORMAT* format);
+
+    // Whether the accelerator accepted the stream the last time it was
+    // initialized for this key. A failure only holds for a while, longer
+    // with each failure in a row, and PROBE_UNKNOWN then asks for another
+    // try; a success clears it.
+    KProbeResult GetLastProbe(const GUID& decoderID, const CLSID& rendererID,
+                              int width, int height);
+    void SetLastProbe(const GUID& decoderID, const CLSID& rendererID,
+                      int width, int height, bool succeeded);
+
+private:
+    struct TKey
+    {
+        int Vendor;
+        int Device;
+        int64 DriverVersion;
+        CLSID RendererID;   // GUID_NULL for what only the driver decides
+        GUID DecoderID;
+        KResolutionClass Resolution;
+
+        bool operator<(const TKey& other) const;
+    };
+
+    struct TEntry
+    {
+        TEntry();
+
+        bool HasLevelLimits;
+        bool Level51;
+        int MaxRefFrames;   // 0 for the DPB size limit of level 4.1
+        bool HasUncompFormats;
+        std::vector<DDPIXELFORMAT> UncompFormats;
+        KProbeResult LastProbe;
+        int ProbeFailures;      // In a row
+        DWORD LastFailureTime;  // GetTickCount()
+    };
+
+    TKey makeKey(const GUID& decoderID, const CLSID& rendererID, int width,
+                 int height) const;
+
+    Lock m_access;
+    std::map<TKey, TEntry> m_entries;
+};
+
+#endif  // _HW_CAPABILITY_CACHE_H_
\ No newline at end of file
@@ -0,0 +1,164 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include <windows.h>
+
+CWorkerPool::CWorker::CWorker(CWorkerPool* owner)
+    : m_owner(owner)
+    , m_handle()
+    , m_started(false)
+{
+}
+
+bool CWorkerPool::CWorker::Start()
+{
+    m_started = PlatformThread::Create(0, this, &m_handle);
+    return m_started;
+}
+
+void CWorkerPool::CWorker::Join()
+{
+    if (m_started)
+        PlatformThread::Join(m_handle);
+
+    m_started = false;
+}
+
+void CWorkerPool::CWorker::ThreadMain()
+{
+    m_owner->workerMain();
+}
+
+//------------------------------------------------------------------------------
+CWorkerPool::CWorkerPool(int threadCount)
+    : m_workers()
+    , m_lock()
+    , m_workAvailable(&m_lock)
+    , m_workDone(&m_lock)
+    , m_jobs()
+    , m_cursor(0)
+    , m_quit(false)
+{
+    for (int i = 1; i < threadCount; ++i)
+    {
+        CWorker* worker = new CWorker(this);
+        if (!worker->Start())
+        {
+            delete worker;
+            break;
+        }
+
+        m_workers.push_back(worker);
+    }
+}
+
+CWorkerPool::~CWorkerPool()
+{
+    {
+        AutoLock lock(m_lock);
+        assert(m_jobs.empty());
+        m_quit = true;
+        m_workAvailable.Broadcast();
+    }
+
+    for (int i = 0; i < static_cast<int>(m_workers.size()); ++i)
+    {
+        m_workers[i]->Join();
+        delete m_workers[i];
+    }
+}
+
+void CWorkerPool::Run(CTask* task, int count)
+{
+    assert(task);
+    if (count <= 0)
+        return;
+
+    if (m_workers.empty() || (1 == count))
+    {
+        for (int i = 0; i < count; ++i)
+            task->Execute(i);
+
+        return;
+    }
+
+    TJob job;
+    job.Task = task;
+    job.Count = count;
+    job.Next = 0;
+    job.Pending = count;
+    job.Active = 0;
+    {
+        AutoLock lock(m_lock);
+        m_jobs.push_back(&job);
+        m_workAvailable.Broadcast();
+    }
+
+    while (executeItem(&job))
+        ;
+
+    // Also wait for the workers to leave the job, since it is about to go
+    // out of scope.
+    AutoLock lock(m_lock);
+    while (job.Pending || job.Active)
+        m_workDone.Wait();
+
+    m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &job));
+}
+
+void CWorkerPool::workerMain()
+{
+    AutoLock lock(m_lock);
+    for (;;)
+    {
+        TJob* job = NULL;
+        while (!m_quit && !(job = pickJob()))
+            m_workAvailable.Wait();
+
+        if (m_quit)
+            break;
+
+        job->Active++;
+        m_lock.Release();
+        executeItem(job);
+        m_lock.Acquire();
+        job->Active--;
+        if (!job->Pending && !job->Active)
+            m_workDone.Broadcast();
+    }
+}
+
+CWorkerPool::TJob* CWorkerPool::pickJob()
+{
+    // Round robin over the jobs that still have unclaimed items.
+    const int count = static_cast<int>(m_jobs.size());
+    for (int i = 0; i < count; ++i)
+    {
+        TJob* job = m_jobs[(m_cursor + i) % count];
+        if (job->Next < job->Count)
+        {
+            m_cursor = (m_cursor + i + 1) % count;
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+bool CWorkerPool::executeItem(TJob* job)
+{
+    const int i = InterlockedIncrement(&job->Next) - 1;
+    if (i >= job->Count)
+        return false;
+
+    job->Task->Execute(i);
+    if (!InterlockedDecrement(&job->Pending))
+    {
+        AutoLock lock(m_lock);
+        m_workDone.Broadcast();
+    }
+
+    return true;
+}
\ No newline at end of file
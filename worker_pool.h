@@ -0,0 +1,82 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include <vector>
+
+#include "chromium/base/basictypes.h"
+#include "chromium/base/condition_variable.h"
+#include "chromium/base/lock.h"
+#include "chromium/base/platform_thread.h"
+
+// Persistent threads that run the items of tasks in parallel. Any number of
+// threads may call Run() at the same time; each caller works on its own task,
+// while the pool threads take one item at a time from the running tasks in
+// turn, so a task with many items can't starve the others. The pool threads
+// are the only extra concurrency, however many tasks are running.
+class CWorkerPool
+{
+public:
+    class CTask
+    {
+    public:
+        virtual void Execute(int index) = 0;
+
+    protected:
+        virtual ~CTask() {}
+    };
+
+    // Starts |threadCount| - 1 threads, since a caller always takes part.
+    explicit CWorkerPool(int threadCount);
+    ~CWorkerPool();
+
+    int GetThreadCount() const
+    {
+        return static_cast<int>(m_workers.size()) + 1;
+    }
+
+    // Calls task->Execute() for every index in [0, count) and returns when
+    // all of them are done.
+    void Run(CTask* task, int count);
+
+private:
+    class CWorker : public PlatformThread::Delegate
+    {
+    public:
+        explicit CWorker(CWorkerPool* owner);
+
+        bool Start();
+        void Join();
+        virtual void ThreadMain();
+
+    private:
+        CWorkerPool* m_owner;
+        PlatformThreadHandle m_handle;
+        bool m_started;
+    };
+
+    // Lives on the stack of the Run() caller.
+    struct TJob
+    {
+        CTask* Task;
+        int Count;
+        volatile LONG Next;
+        volatile LONG Pending;
+        int Active;
+    };
+
+    void workerMain();
+    TJob* pickJob();
+    bool executeItem(TJob* job);
+
+    std::vector<CWorker*> m_workers;
+    Lock m_lock;
+    ConditionVariable m_workAvailable;
+    ConditionVariable m_workDone;
+    std::vector<TJob*> m_jobs;
+    int m_cursor;
+    bool m_quit;
+
+    DISALLOW_COPY_AND_ASSIGN(CWorkerPool);
+};
+
+#endif  // _WORKER_POOL_H_
\ No newline at end of file